@@ -5,6 +5,7 @@
 #include <fstream>
 #include "user.hpp"
 #include <iostream>
+#include <mutex>
 //
 // AuthStrategy provides interface for user authorisation
 // Credentials are saved in a text file formatted in the following way:
@@ -18,6 +19,7 @@ class AuthStrategy
 
   private:
     string user_file;
+    std::recursive_mutex users_mutex; // user file is shared by all workers
 
   public:
     AuthStrategy(const string& user_file): user_file(user_file)
@@ -25,9 +27,13 @@ class AuthStrategy
     AuthStrategy(const char* user_file): user_file(user_file)
     {}
 
+    // Every access to the user file has to hold this lock
+    std::recursive_mutex& getMutex() {return users_mutex;}
+
     // Returns line from user file describing given user
     const string getUserLine(const string& username)
     {
+      std::lock_guard<std::recursive_mutex> lock(users_mutex);
       std::ifstream uf(user_file);
       string line;
       while(std::getline(uf, line))
@@ -49,6 +55,7 @@ class AuthStrategy
     // Check given credentials against credentials stored in user file
     User* auth(string& username, string& password)
     {
+       std::lock_guard<std::recursive_mutex> lock(users_mutex);
        string line = getUserLine(username);
        std::cout << "AUTH line: "<<line<<std::endl; //Debug
        if(line == "")
@@ -0,0 +1,84 @@
+#ifndef COMPLETIONQUEUE_H
+#define COMPLETIONQUEUE_H
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+//
+// Result of a job executed outside of the event loop, addressed to a connection
+// Connection is identified by its pool handle, so result for closed connection
+// is not delivered to a new one which reused the slot
+// READ_AHEAD completions carry no response, they tell that a block read ahead for a download is in memory
+//
+struct Completion
+{
+    enum Kind { JOB_RESULT = 0, READ_AHEAD };
+    uint64_t conn_id;
+    std::string response;
+    int kind;
+
+    Completion(uint64_t conn_id, const std::string &response, int kind = JOB_RESULT):
+      conn_id(conn_id), response(response), kind(kind) {}
+};
+
+//
+// CompletionQueue passes completions from pool threads to the event loop owning connection
+// Loop registers getFd() in its reactor, the descriptor becomes readable when completions are posted
+//
+class CompletionQueue
+{
+  private:
+    int efd;
+    std::mutex mtx;
+    std::vector<Completion> completions;
+
+  public:
+    CompletionQueue()
+    {
+        efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (efd == -1)
+            perror("eventfd");
+    }
+
+    ~CompletionQueue()
+    {
+        if (efd != -1)
+            close(efd);
+    }
+
+    CompletionQueue(const CompletionQueue&) = delete;
+    CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+    int getFd() const {return efd;}
+
+    // Called from pool threads
+    void post(const Completion &completion)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            completions.push_back(completion);
+        }
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof one) == -1)
+            perror("write(eventfd)");
+    }
+
+    // Called from event loop, moves all posted completions to out
+    void drain(std::vector<Completion> &out)
+    {
+        uint64_t count;
+        if (read(efd, &count, sizeof count) == -1 && errno != EAGAIN)
+            perror("read(eventfd)");
+        std::lock_guard<std::mutex> lock(mtx);
+        out.swap(completions);
+        completions.clear();
+    }
+};
+
+#endif //COMPLETIONQUEUE_H
@@ -3,23 +3,43 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <string>
 #include <stdio.h>
-#include <list>
 #include <vector>
+#include <unordered_map>
 #include "auth_strategy/user.hpp"
+#include "completionqueue.h"
+#include "reactor.h"
+#include "utils/timerwheel.h"
+#include "utils/recvbuffer.h"
+#include "utils/sendqueue.h"
+#include "utils/stats.h"
+#include "utils/frame.h"
+#include "utils/mappedfile.h"
+#include "utils/blockcache.h"
+#include "utils/envelopecache.h"
+#include "utils/fanout.h"
+#include "utils/readahead.h"
+#include "utils/compression.h"
 #include "utils/base644.h"
 #include "utils/json.hpp"
 #include <iostream>
-#include <fstream>
+#include <atomic>
+#include <coroutine>
+#include <string_view>
 //#include "downloadProcess.h"
 
-unsigned long long bytes = 0;
+std::atomic<unsigned long long> bytes(0); // shared by all workers
 
 class Connection;
 
@@ -29,28 +49,172 @@ private:
   using string = std::string;
   string path; // file path
   unsigned long long offset; // current file offset
-  const int CHUNK_SIZE = 1024; // size of data chunk of file
+  unsigned long long end; // end of requested range, clipped to file size when file is opened
+  unsigned long long range_length; // length of requested range, 0 when it goes to the end of file
+  string if_version; // version of file client resumes, download fails when file has changed since
+  string version; // file size and mtime, taken when file is opened
+  bool described; // total size and version were sent in first response
+  int chunk_size; // bytes of file data in one base64 chunk
+  static const int BINARY_CHUNK_SIZE = 65536; // size of data chunk of file in binary mode
+  static const int PACKAGE_BYTES = 65536; // base64 package has as many chunks as fit in it, at least one
   Connection *connection; // connection which triggered download process
   using json = nlohmann::json;
   int priority; // integer in 1 to 10 describing file priority, where 10 is the highest
+  bool aborted; // set by DWLABORT, download coroutine stops at next resumption
+  bool binary; // raw file bytes are sent after JSON header instead of base64 chunks
+public:
+  //
+  // File opened for download off the event loop by open(), download takes it over with its first package
+  //
+  struct Source
+  {
+    SendQueue::File file; // nullptr when file can't be opened or isn't a regular file
+    struct stat st;
+  };
+
+private:
+  std::shared_ptr<Source> source; // set by setSource(), segments of one DWL share it
+  SendQueue::File file; // taken over on first package and kept until download ends, shared with queued file segments
+  std::vector<std::vector<char>> buffers; // chunk buffers filled by one preadv() per base64 package
+  bool mapped; // base64 chunks are encoded straight from mapping shared by downloads of the same file
+  std::shared_ptr<MappedFile> mapping;
+  FileVersion file_version; // identity of opened file in block cache
+  std::vector<char> package; // base64 package copied out of block cache or read for fan-out group
+  ThreadPool *io_pool; // reads blocks of read-ahead, nullptr reads file on event loop
+  int readahead_window; // packages read ahead, 0 disables read-ahead
+  ReadAhead readahead; // started when file is opened with pool, mapped and sendfile() downloads only page data in
+  bool data_wait; // last package needs block which is still being read
+  int codec; // Compression::Codec of chunks, they are compressed on pool threads by read-ahead, never on event loop
+  std::coroutine_handle<> data_waiter; // download coroutine waiting for its read-ahead block
+  unsigned long long size; // file size, taken when file is opened
+  uint32_t stream; // stream id of DWL request, responses are sent on it in FRAMING_BINARY
+  std::coroutine_handle<> waiter; // download coroutine waiting for its turn from scheduler
+  long long deficit; // bytes download may still queue in current round of scheduler, negative after overshoot
+  int segment; // index of segment of segmented download, -1 when file is downloaded in one piece
+  int segments; // number of segments of segmented download
+  std::shared_ptr<int> segments_left; // segments of the same DWL which haven't ended, shared by all of them
 
 public:
-  DownloadProcess(string &path, Connection *conn, int priority);
+  static const int PACKAGE_SIZE = 5; // chunks queued each time download gets its turn in binary mode
+  static const int DEFAULT_CHUNK_SIZE = 1024;
+  static const int MAX_CHUNK_SIZE = 16 << 20;
+  static const int MAX_SEGMENTS = 16; // most segments one DWL can be split into
+  static const int MIN_SEGMENT_BYTES = 65536; // smaller ranges are split into fewer segments
+
+  DownloadProcess(string &path, Connection *conn, int priority, bool binary, uint32_t stream, int chunk_size, bool mapped);
 
   ~DownloadProcess();
 
-  int putNextPackage(int packageSize);
+  int putNextPackage();
+
+  int putBase64Package(int chunks);
+
+  int putMappedPackage(int chunks);
+
+  int putCachedPackage(int chunks);
+
+  int putCachedEnvelopes(int chunks);
+
+  int putFanoutPackage(int chunks);
+
+  FanoutRegistry::Package producePackage(unsigned long long length);
+
+  int putPrefetchedPackage(int chunks);
+
+  ssize_t readData(unsigned long long at, size_t length, char *dest);
+
+  static ssize_t readFile(const SendQueue::File &file, const FileVersion &version, unsigned long long at, size_t length, char *dest);
+
+  static ssize_t pageIn(const std::shared_ptr<MappedFile> &mapping, unsigned long long at, size_t length);
 
-  int putOneChunk();
+  static void compressChunks(ReadBlock &block, int codec, int chunk_size);
 
-  char* getDataChunk(int &);
+  EnvelopeCache::Envelope makeEnvelope(string data, unsigned long long chunk_offset, size_t length, bool compressed);
+
+  void putChunkResponse(string data, unsigned long long chunk_offset, size_t length, bool compressed = false);
+
+  void putErrorResponse(int code, string message);
+
+  int checkRange();
+
+  void describeFile(json &response);
+
+  void markSegment(json &response);
+
+  bool endsStream();
+
+  int putBinaryPackage(int packageSize);
+
+  int openFile();
+
+  void putLastResponse();
 
   string getPath() const {return path;}
 
+  // Path as requested by user, without data root
+  string getRequestPath() const {return path.substr(5, path.size());}
+
   int getPriority() const {return priority;}
 
   void setPriority(int priority) {this->priority = priority;}
 
+  bool isAborted() const {return aborted;}
+
+  void abort() {aborted = true;}
+
+  // Bytes of file not queued yet, shortest remaining first policy prefers small ones
+  unsigned long long getRemaining() const {return end > offset ? end - offset : 0;}
+
+  void setRange(unsigned long long offset, unsigned long long length, string version);
+
+  void setSegment(int segment, int segments, std::shared_ptr<int> segments_left);
+
+  void setReadAhead(ThreadPool *pool, int window);
+
+  void setCompression(int codec);
+
+  static void open(const string &path, Source &source);
+
+  void setSource(std::shared_ptr<Source> source);
+
+  long long getDeficit() const {return deficit;}
+  void addDeficit(long long value) {deficit += value;}
+
+  // True when download waits for its turn from scheduler
+  bool isWaiting() const {return (bool)waiter;}
+  // True when download coroutine is suspended, waiting for its turn or for read-ahead block
+  bool isSuspended() const {return waiter || data_waiter;}
+
+  // Download which couldn't queue its package because data wasn't read yet waits for the data first
+  void setWaiter(std::coroutine_handle<> handle)
+  {
+    if (data_wait)
+      data_waiter = handle;
+    else
+      waiter = handle;
+  }
+
+  // Download waiting for read-ahead block goes on waiting for its turn once the block is in memory
+  void wakeIfDataReady()
+  {
+    if (!data_waiter || !readahead.isReady(offset))
+      return;
+    waiter = data_waiter;
+    data_waiter = nullptr;
+    data_wait = false;
+  }
+
+  // Let download coroutine queue its next package, it may finish and destroy this object
+  void resumeWaiter()
+  {
+    std::coroutine_handle<> handle = getWaiter();
+    waiter = nullptr;
+    data_waiter = nullptr;
+    handle.resume();
+  }
+
+  std::coroutine_handle<> getWaiter() const {return waiter ? waiter : data_waiter;}
+
 };
 
 //
@@ -59,66 +223,93 @@ public:
 class Connection
 {
   public:
-    static const int READ_SIZE = 256;
-    static const int REQUEST_SIZE_LIMIT = 10000; // maximum length of a single request
+    static const int REQUEST_SIZE_LIMIT = 10000; // maximum length of a single JSON request, raw data of binary frames aside
+    static const size_t SEND_LOW_WATERMARK = 16384; // default, see send_low
+    static const size_t SEND_HIGH_WATERMARK = 65536; // default, see send_high
     using string = std::string;
+    enum TimerKind { TIMER_IDLE = 0, TIMER_REQUEST, TIMER_STALL, TIMER_COUNT };
+
+    // File of UPL in progress written by completion-based reactor, it stays open until UPLFIN
+    struct Upload
+    {
+        SendQueue::File file;
+        unsigned long long offset; // where next chunk is written
+    };
+
   private:
     int socket; // socket used for communication with user
     User *user; // nullptr when user is not authorized
-    fd_set* read_fdset;
-    fd_set* write_fdset;
-    char buf[READ_SIZE+1]; // buffer for reading from socket
-    std::vector<char> recived_chars; // container for storing text read from socket until whole request is recived
-    std::list<string> requests; // incoming reques are queued in connection
-    std::list<string> responses; // responses are queued waiting to be sent
-    std::vector<DownloadProcess*> downloadProcesses;
+    uint64_t id; // handle of connection in worker's pool, completions of blocking jobs are matched against it
+    CompletionQueue *completions; // queue of event loop owning connection, results of blocking jobs are posted there
+    Reactor *reactor; // reactor of event loop owning connection, it writes uploads when it completes I/O
+    int worker; // id of worker owning connection, bytes its scheduler queues are counted per worker
+    int jobs_in_flight; // blocking jobs submitted and not completed yet
+    TimerNode timers[TIMER_COUNT]; // idle, request assembly and transfer stall timeouts, armed by worker
+    uint64_t last_activity; // time in ms of last successful read or send
+    uint64_t last_progress; // time in ms of last successful send while there was something to send
+    RecvBuffer requests; // incoming bytes, split into '\0' terminated requests (or frames) which are queued in place
+    int framing; // FRAMING_JSON until FRAMING_BINARY is negotiated in AUTH
+    FrameHeader request_header; // header of request being handled, its responses go to the same stream
+    SendQueue responses; // responses to requests are queued waiting to be sent, they preempt bulk data
+    SendQueue bulk; // download data, sent when there are no responses waiting
+    SendQueue *sending; // queue whose data completion-based reactor is sending, nullptr when no send is in flight
+    std::vector<DownloadProcess*> downloadProcesses; // owned by download coroutines of this connection
+    size_t download_cursor; // download which has its turn in deficit round robin of this connection
+    bool download_turn; // download at cursor already got its quantum in this turn
+    long long sched_deficit; // deficit of connection in scheduler, debt of last overshoot is kept while it is not active
+    size_t send_low; // connection asks scheduler for more download data once queued bytes drop below it
+    size_t send_high; // downloads stop once this many bytes are queued, request parsing once this many bytes of responses are
+    std::coroutine_handle<> job_waiter; // coroutine waiting for result of blocking job
+    string job_result;
+    int write_result; // bytes written by last file write or -errno
+    std::unordered_map<string, Upload> uploads; // by path of uploaded file
 
   public:
-    Connection(): requests(),responses(), recived_chars()
+    Connection(): requests(),responses(),bulk()
     {
         this->socket = -1;
         this->user = nullptr;
-        this->read_fdset = nullptr;
-        this->write_fdset = nullptr;
+        this->id = 0;
+        this->completions = nullptr;
+        this->reactor = nullptr;
+        this->worker = -1;
+        this->jobs_in_flight = 0;
+        this->write_result = 0;
+        this->framing = FRAMING_JSON;
+        this->download_cursor = 0;
+        this->download_turn = false;
+        this->sched_deficit = 0;
+        this->send_low = SEND_LOW_WATERMARK;
+        this->send_high = SEND_HIGH_WATERMARK;
+        this->sending = nullptr;
+        requests.setLimits(REQUEST_SIZE_LIMIT, FrameHeader::MAX_LENGTH);
+        initTimers();
     }
-    Connection(int socket, User *user = nullptr, fd_set* rfdset=nullptr, fd_set* wfdset=nullptr):
-    requests(),responses(),recived_chars()
+    Connection(int socket, User *user = nullptr):
+    requests(),responses(),bulk()
     {
         this->socket = socket;
         this->user = user;
-        this->read_fdset = rfdset;
-        this->write_fdset = wfdset;
-    }
-
-    Connection(const Connection &other)
-    {
-        user = nullptr;
-        *this = other;
+        this->id = 0;
+        this->completions = nullptr;
+        this->reactor = nullptr;
+        this->worker = -1;
+        this->jobs_in_flight = 0;
+        this->write_result = 0;
+        this->framing = FRAMING_JSON;
+        this->download_cursor = 0;
+        this->download_turn = false;
+        this->sched_deficit = 0;
+        this->send_low = SEND_LOW_WATERMARK;
+        this->send_high = SEND_HIGH_WATERMARK;
+        this->sending = nullptr;
+        requests.setLimits(REQUEST_SIZE_LIMIT, FrameHeader::MAX_LENGTH);
+        initTimers();
     }
 
-    Connection& operator=(const Connection& other)
-    {
-        if(this != &other)
-        {
-            requests = other.requests;
-            responses = other.responses;
-            socket = other.socket;
-
-            if(other.user != nullptr)
-            {
-                if(user != nullptr)
-                    delete user;
-                user = new User(*(other.user));
-            }
-            else
-                user = nullptr;
-
-            read_fdset = other.read_fdset;
-            write_fdset = other.write_fdset;
-            recived_chars = other.recived_chars;
-        }
-        return *this;
-    }
+    // Connections live in ConnectionPool and are never copied, download processes and timers point to them
+    Connection(const Connection &other) = delete;
+    Connection& operator=(const Connection& other) = delete;
 
 
     ~Connection()
@@ -126,120 +317,445 @@ class Connection
         if (user!=nullptr)
             delete user;
 
-        for (int i = 0; i < downloadProcesses.size(); i++)
-        {
-          delete downloadProcesses[i];
-        }
+        // Suspended coroutines can't be resumed anymore, destroying them frees their download processes
+        std::vector<std::coroutine_handle<>> waiters;
+        for (size_t i = 0; i < downloadProcesses.size(); i++)
+            if (downloadProcesses[i]->isSuspended())
+                waiters.push_back(downloadProcesses[i]->getWaiter());
+        downloadProcesses.clear();
+        if (job_waiter)
+            waiters.push_back(job_waiter);
+        job_waiter = nullptr;
+        for (size_t i = 0; i < waiters.size(); i++)
+            waiters[i].destroy();
     }
 
+    //
+    // Awaitable which suspends download coroutine until scheduler gives it a turn
+    // Turns are given only while connection has less than send_high bytes of download data queued
+    struct SendTurn
+    {
+        DownloadProcess *download;
+        bool await_ready() const {return false;}
+        void await_suspend(std::coroutine_handle<> handle) {download->setWaiter(handle);}
+        void await_resume() const {}
+    };
+
+    SendTurn sendTurn(DownloadProcess *download) {return SendTurn{download};}
+
     User* getUser() const {return user;}
-    void setUser(User* user ){this->user = user;}
+    void setUser(User* user )
+    {
+        if (this->user != nullptr && this->user != user)
+            delete this->user;
+        this->user = user;
+    }
     int getSocket() const{return socket;}
     void setSocket(int socket){this->socket = socket;}
     //return request from Q fron without popping it
-    string getRequest() const {return requests.front();}
+    std::string_view getRequest() const {return requests.front();}
     // Pops request from the queue and reurns it
-    string popRequest()
+    // Returned view points into receive buffer and stays valid until next reciveMsg() or receiveData()
+    std::string_view popRequest()
     {
-        string req = requests.front();
-        requests.pop_front();
+        std::string_view req = requests.front();
+        request_header = requests.frontHeader();
+        requests.pop();
         return req;
     }
+    // Header of last popped request, in FRAMING_JSON it is default request header with stream 0
+    FrameHeader getRequestHeader() const {return request_header;}
+
+    int getFraming() const {return framing;}
+
+    // Switch framing of data following last popped request and of responses queued from now on
+    void setFraming(int framing)
+    {
+        if (framing == FRAMING_BINARY && this->framing != FRAMING_BINARY)
+            requests.setLengthPrefixed();
+        this->framing = framing;
+    }
+
+    // Queue final response to request which is being handled, it goes ahead of queued download data
     void setResponse(string res)
     {
         //std::cout << "ADDING RESPONSE: " + res << std::endl;
-        responses.push_back(res);
+        if (framing == FRAMING_BINARY)
+            responses.push(FrameHeader(FrameHeader::RESPONSE, FrameHeader::FRAME_FIN, request_header.stream, res.size()).encode(), false);
+        responses.push(std::move(res));
+    }
+
+    // Queue download response on given stream behind its previous data, fin marks last response of the stream
+    void setStreamResponse(uint32_t stream, string res, bool fin)
+    {
+        if (framing == FRAMING_BINARY)
+            bulk.push(FrameHeader(FrameHeader::RESPONSE, fin ? FrameHeader::FRAME_FIN : 0, stream, res.size()).encode(), false);
+        bulk.push(std::move(res));
     }
-    bool isRequsetComplete() const {return (requests.size() > 0);}
-    int responsesPending() const {return responses.size();}
+
+    // Queue buffer which may be shared with other connections
+    void setStreamResponse(uint32_t stream, const SendQueue::Segment &res, bool fin)
+    {
+        if (framing == FRAMING_BINARY)
+            bulk.push(FrameHeader(FrameHeader::RESPONSE, fin ? FrameHeader::FRAME_FIN : 0, stream, res->size()).encode(), false);
+        bulk.push(res);
+    }
+
+    //
+    // Queue JSON header followed by range of file which is sent with sendfile()
+    // In FRAMING_JSON header is terminated by '\n', in FRAMING_BINARY both go in one FRAME_RAW frame
+    void setStreamData(uint32_t stream, string header, const SendQueue::File &file, off_t offset, size_t length)
+    {
+        if (framing == FRAMING_BINARY)
+        {
+            string frame = FrameHeader(FrameHeader::RESPONSE, FrameHeader::FRAME_RAW, stream, header.size() + 1 + length).encode();
+            frame += header;
+            frame += '\0';
+            bulk.push(std::move(frame), false);
+        }
+        else
+            bulk.push(header + "\n", false);
+        bulk.push(file, offset, length);
+    }
+    bool isRequsetComplete() const {return (requests.framesQueued() > 0);}
+    // Requests are handled in order, next one waits until blocking job of previous one completes
+    // Client which doesn't read its responses gets no more of them until they drain below high watermark
+    bool canParseRequest() const {return (requests.framesQueued() > 0 && jobs_in_flight == 0 && responses.bytes() < send_high);}
+
+    void setSendWatermarks(size_t low, size_t high)
+    {
+        send_low = low;
+        send_high = high;
+    }
+
+    uint64_t getId() const {return id;}
+    CompletionQueue* getCompletionQueue() const {return completions;}
+    void setCompletionQueue(uint64_t id, CompletionQueue *completions)
+    {
+        this->id = id;
+        this->completions = completions;
+    }
+    Reactor* getReactor() const {return reactor;}
+    void setReactor(Reactor *reactor) {this->reactor = reactor;}
+    void setWorker(int worker) {this->worker = worker;}
+    //
+    // Suspend coroutine until blocking job submitted for this connection completes
+    //
+    void startJob(std::coroutine_handle<> waiter)
+    {
+        jobs_in_flight++;
+        job_waiter = waiter;
+    }
+
+    //
+    // Deliver result of blocking job, resumes coroutine waiting for it
+    //
+    void finishJob(const string &result)
+    {
+        jobs_in_flight--;
+        std::coroutine_handle<> waiter = job_waiter;
+        job_waiter = nullptr;
+        job_result = result;
+        if (waiter)
+            waiter.resume();
+        else if (result != "")
+            setResponse(result);
+    }
+
+    string getJobResult() const {return job_result;}
+
+    //
+    // Deliver result of file write started with reactor, it is awaited like blocking job
+    //
+    void finishWrite(int result)
+    {
+        write_result = result;
+        finishJob("");
+    }
+
+    int getWriteResult() const {return write_result;}
+
+    // Returns upload of file at path or nullptr when its file isn't open
+    Upload* findUpload(const string &path)
+    {
+        auto it = uploads.find(path);
+        return it != uploads.end() ? &it->second : nullptr;
+    }
+
+    void addUpload(const string &path, SendQueue::File file, unsigned long long offset)
+    {
+        uploads[path] = Upload{file, offset};
+    }
+
+    // File is closed once write in flight, if any, completes
+    void finishUpload(const string &path) {uploads.erase(path);}
+
+    //
+    // Block read ahead for one of downloads is in memory, downloads which waited for it wait for their turn again
+    //
+    void finishReadAhead()
+    {
+        for (size_t i = 0; i < downloadProcesses.size(); i++)
+            downloadProcesses[i]->wakeIfDataReady();
+    }
+
+    TimerNode* getTimer(int kind) {return &timers[kind];}
+    // True when part of a request has been recived and connection waits for the rest of it
+    bool hasPartialRequest() const {return requests.partialSize() > 0;}
+    uint64_t getLastActivity() const {return last_activity;}
+    void setLastActivity(uint64_t time) {last_activity = time;}
+    uint64_t getLastProgress() const {return last_progress;}
+    void setLastProgress(uint64_t time) {last_progress = time;}
+    int responsesPending() const {return responses.size() + bulk.size();}
+    int requestsQueued() const {return requests.framesQueued();}
 
 
     // Read data from socket and return read result
+    // '\0' means that wohle request has been recived - it is queued in the receive buffer
     int reciveMsg()
-    {   int rval=0;
-       // memset(buf, 0, sizeof buf);
-       // req_complete = false;
-        if ((rval = read(socket, buf, READ_SIZE)) == -1)
-            perror("reading stream message");
-        else if (rval > 0)
+    {
+        int rval = requests.readFrom(socket);
+        ServerStats::add(stats.recv_calls);
+        if (rval > 0)
+            ServerStats::add(stats.bytes_received, rval);
+        if (rval == -1)
         {
-            buf[rval] = '\0';
-            for(int i =0; i < rval; i++)
-            {
-                if(buf[i] != '\0')
-                {
-                    recived_chars.push_back(buf[i]);
-                    if(recived_chars.size() > REQUEST_SIZE_LIMIT)
-                        closeConnection(); // Close connection when request size limi is exceeded
-                }
-                else
-                {//'\0' means that wohle request has been recived - push it in the Q and reset recived_chars
-                    requests.push_back(string(recived_chars.begin(), recived_chars.end()));
-                    //std::cout<<"["<<socket<<"]NEW Request:"<<requests.back()<<std::endl<<std::flush;
-                    recived_chars.clear();
-                }
-            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("reading stream message");
         }
+        else if (requests.isOversize())
+            closeConnection(); // Close connection when request size limi is exceeded
         return rval;
     }
 
+    //
+    // Queue data received by completion-based reactor, len is result of the receive
+    // Returns len like reciveMsg() returns read result
+    int receiveData(const char *data, int len)
+    {
+        ServerStats::add(stats.recv_calls);
+        if (len <= 0)
+        {
+            if (len < 0)
+                std::cout << "reading stream message: " << strerror(-len) << std::endl;
+            return len;
+        }
+        requests.append(data, len);
+        ServerStats::add(stats.bytes_received, len);
+        if (requests.isOversize())
+            closeConnection(); // Close connection when request size limi is exceeded
+        return len;
+    }
+
+    //
+    // Send queued responses with one gather write, partially sent response stays at the front of the Q
+    // Responses to requests go first, download data is sent when there are none. When a response
+    // arrives while download message is partially sent, the message is finished first (frame boundary)
+    // and the response follows it in the same call.
+    //
     int sendResponse()
     {
-        string& res = responses.front();
-        int bytes_sent = send(socket, res.c_str(), res.size(),MSG_DONTWAIT | MSG_NOSIGNAL);
-        bytes += bytes_sent;
+        int total = 0;
+        while (true)
+        {
+            bool finish_message = bulk.inMessage() && !responses.empty();
+            SendQueue &queue = (finish_message || responses.empty()) ? bulk : responses;
+            int completed;
+            int bytes_sent = queue.flush(socket, completed, finish_message);
+            ServerStats::add(stats.send_calls);
+            if (bytes_sent == -1 && errno == ENODATA)
+            {
+                // File was truncated while being sent, promised length can't be delivered
+                std::cout << "File shrank during binary download, closing connection" << std::endl;
+                closeConnection();
+                return -1;
+            }
+            if (bytes_sent <= 0) // socket buffer is full or error, keep response in the Q
+            {
+                if (total > 0)
+                    break;
+                return bytes_sent;
+            }
+            bytes += bytes_sent;
+            ServerStats::add(stats.bytes_sent, bytes_sent);
+            total += bytes_sent;
+            if (!finish_message || bulk.inMessage())
+                break;
+        }
+
+        return total;
+    }
+
+    //
+    // Describe next send for completion-based reactor, the same data sendResponse() would send next
+    // Returns false when there is nothing to send or a send is already in flight
+    bool prepareSend(SendQueue::Batch &batch)
+    {
+        if (sending != nullptr || socket == -1)
+            return false;
+        bool finish_message = bulk.inMessage() && !responses.empty();
+        SendQueue &queue = (finish_message || responses.empty()) ? bulk : responses;
+        if (!queue.prepare(batch, finish_message))
+            return false;
+        sending = &queue;
+        ServerStats::add(stats.send_calls);
+        return true;
+    }
 
-        if(bytes_sent < res.size() && bytes_sent > 0) // erase sent fragment from response and keep it in the Q
-            res.erase(0,bytes_sent);
-        else // Whole response was sent - pop it from Q
+    // Send described by prepareSend() couldn't be started
+    void cancelSend() {sending = nullptr;}
+
+    //
+    // Account result of send started after prepareSend(), returns it
+    // Failed send closes connection, file which shrank below its queued segment is reported as ENODATA
+    int finishSend(int result)
+    {
+        SendQueue *queue = sending;
+        sending = nullptr;
+        if (queue == nullptr || socket == -1)
+            return 0;
+        if (result == -EAGAIN || result == -EINTR)
+            return 0;
+        if (result <= 0)
         {
-            responses.pop_front();
-            handleDownloads();
+            if (result == -ENODATA)
+                std::cout << "File shrank during binary download, closing connection" << std::endl;
+            else if (result < 0)
+                std::cout << "sending stream message: " << strerror(-result) << std::endl;
+            closeConnection();
+            return result;
         }
+        queue->consume(result);
+        bytes += result;
+        ServerStats::add(stats.bytes_sent, result);
+        return result;
+    }
+
+    // True when download data drained below low watermark and a download waits for its turn,
+    // worker then puts connection in scheduler's active set
+    bool wantsDownloadTurn() const
+    {
+        return (socket != -1 && bulk.bytes() < send_low && hasWaitingDownload());
+    }
 
-        return bytes_sent;
+    // True while connection can take more download data, it stays in scheduler's active set
+    bool canTakeDownloadData() const
+    {
+        return (socket != -1 && bulk.bytes() < send_high && hasWaitingDownload());
     }
 
-    void handleDownloads()
+    // Weight of connection among connections of its user: sum of priorities of its downloads
+    int getDownloadWeight() const
     {
-      for (int i = 0; i < downloadProcesses.size(); i++)
-      {
-        if (downloadProcesses[i]->putNextPackage(downloadProcesses[i]->getPriority()) == 0) // it was unable to put next package into the responses queue. Whole file was queued.
+        int weight = 0;
+        for (size_t i = 0; i < downloadProcesses.size(); i++)
+            weight += downloadProcesses[i]->getPriority();
+        return weight;
+    }
+
+    long long getSchedDeficit() const {return sched_deficit;}
+    void setSchedDeficit(long long deficit) {sched_deficit = deficit;}
+
+    bool hasWaitingDownload() const
+    {
+        for (size_t i = 0; i < downloadProcesses.size(); i++)
+            if (downloadProcesses[i]->isWaiting())
+                return true;
+        return false;
+    }
+
+    // Waiting download with the fewest bytes left to queue, nullptr when there is none
+    DownloadProcess* shortestWaitingDownload() const
+    {
+        DownloadProcess *shortest = nullptr;
+        for (size_t i = 0; i < downloadProcesses.size(); i++)
         {
-          //std::cout<<"DWL [" << downloadProcesses[i]->getPath() << "] ENDED\n" << "PENDING DOWNLOADS: " << downloadProcesses.size() << std::endl;
-          delete downloadProcesses[i];
-          downloadProcesses.erase(downloadProcesses.begin() + i);
-          //std::cout<<"PENDING DOWNLOADS AFTER POP: " << downloadProcesses.size() << std::endl;
+            DownloadProcess *dwlProc = downloadProcesses[i];
+            if (dwlProc->isWaiting() && (shortest == nullptr || dwlProc->getRemaining() < shortest->getRemaining()))
+                shortest = dwlProc;
         }
-      }
+        return shortest;
     }
 
-    void pushDownloadProcess(DownloadProcess *actvDwnl)
+    //
+    // Give waiting download one turn, it queues one package of data
+    // Returns number of bytes queued, they are accounted to user and priority of the download
+    size_t serveDownload(DownloadProcess *dwlProc)
     {
-      downloadProcesses.push_back(actvDwnl);
-      std::cout << "ADDED NEW DWL PROC. NOW SIZE IS: " <<downloadProcesses.size() << std::endl;
+        size_t queued = bulk.bytes();
+        int priority = dwlProc->getPriority();
+        dwlProc->resumeWaiter(); // dwlProc is destroyed when download finishes
+        size_t produced = bulk.bytes() > queued ? bulk.bytes() - queued : 0;
+        stats.addShare(worker, user != nullptr ? user->username : "", priority, produced);
+        return produced;
     }
 
-    // Return true if read from socket won't block
-    // Server needs to call select() for this to work
-    bool isReadReady()
+    //
+    // Serve waiting downloads by deficit round robin weighted by priority until allowance is used up
+    // or connection can't take more data. Download at cursor gets quantum * priority once per turn
+    // and queues packages while its deficit is positive, the last one may overshoot and the
+    // overshoot is taken from its next turn. Returns number of bytes queued
+    size_t serveDownloads(long long allowance, long long quantum)
     {
-        return (socket > 0 && read_fdset != nullptr && FD_ISSET(socket, read_fdset));
+        size_t used = 0;
+        while ((long long)used < allowance && canTakeDownloadData())
+        {
+            if (download_cursor >= downloadProcesses.size())
+                download_cursor = 0;
+            DownloadProcess *dwlProc = downloadProcesses[download_cursor];
+            if (!dwlProc->isWaiting())
+            {
+                download_cursor++;
+                download_turn = false;
+                continue;
+            }
+            if (!download_turn)
+            {
+                dwlProc->addDeficit(quantum * dwlProc->getPriority());
+                download_turn = true;
+            }
+            if (dwlProc->getDeficit() > 0)
+            {
+                size_t produced = serveDownload(dwlProc);
+                used += produced;
+                bool finished = download_cursor >= downloadProcesses.size() || downloadProcesses[download_cursor] != dwlProc;
+                if (finished)
+                {
+                    download_turn = false; // next download moved to cursor
+                    continue;
+                }
+                dwlProc->addDeficit(-(long long)produced);
+                if (dwlProc->getDeficit() > 0 && dwlProc->isWaiting())
+                    continue;
+            }
+            download_cursor++;
+            download_turn = false;
+        }
+        return used;
     }
 
-    bool isWriteReady()
+    void pushDownloadProcess(DownloadProcess *actvDwnl)
     {
-        return (socket > 0 && write_fdset != nullptr && FD_ISSET(socket, write_fdset));
+      downloadProcesses.push_back(actvDwnl);
+      std::cout << "ADDED NEW DWL PROC. NOW SIZE IS: " <<downloadProcesses.size() << std::endl;
     }
-    void setReadReady()
+
+    void removeDownloadProcess(DownloadProcess *dwlProc)
     {
-        if(read_fdset && socket > 0)
-            FD_SET(socket, read_fdset);
+      for (size_t i = 0; i < downloadProcesses.size(); i++)
+      {
+        if (downloadProcesses[i] == dwlProc)
+        {
+          downloadProcesses.erase(downloadProcesses.begin() + i);
+          return;
+        }
+      }
     }
-    void setWriteReady()
+
+    // Return true when connection has something to send and write interest should be armed
+    bool wantsWrite() const
     {
-        if(write_fdset && socket > 0)
-            FD_SET(socket, write_fdset);
+        return (socket > 0 && (responses.size() > 0 || bulk.size() > 0));
     }
 
     void closeConnection()
@@ -248,59 +764,71 @@ class Connection
             close(socket);
         socket = -1 ;
         if(user != nullptr){
+            delete user;
             user = nullptr;
         }
-        read_fdset = nullptr;
-        write_fdset = nullptr;
         requests.clear();
         responses.clear();
+        bulk.clear();
+        sending = nullptr;
+        uploads.clear();
 
-        std::cout <<bytes<<std::endl;
+        std::cout <<bytes.load()<<std::endl;
     }
 
     /**
     * Returns true when download process with given path was aborted successfully. Otherwise false.
+    * Segments of segmented download share the path, all of them are aborted.
+    * Every aborted download ends its stream with response 410.
     */
     bool abortDownloadProcess(string &path)
     {
       DownloadProcess *dwlProc = nullptr;
+      bool found = false;
       //std::cout << "PATH TO ABORT: " << path << std::endl;
-      for (int i = 0; i < downloadProcesses.size(); i++)
+      for (size_t i = 0; i < downloadProcesses.size(); )
       {
-        string currentPath = downloadProcesses[i]->getPath().substr(5, downloadProcesses[i]->getPath().size());
+        string currentPath = downloadProcesses[i]->getRequestPath();
         //std::cout << "CURR PATH: " << currentPath << std::endl;
-        if (currentPath == path)
+        if (currentPath != path)
         {
-          // found downloadProcess
-          dwlProc = downloadProcesses[i];
-          downloadProcesses.erase(downloadProcesses.begin() + i);
-          delete dwlProc;
-          std::cout << "DWL " << path << " ABORTED. PENDING DOWNLOADS: " << downloadProcesses.size() << std::endl;
-          return true;
+          i++;
+          continue;
         }
+        // found downloadProcess
+        dwlProc = downloadProcesses[i];
+        downloadProcesses.erase(downloadProcesses.begin() + i);
+        dwlProc->abort();
+        // Stream of the download gets its last response (FIN frame in FRAMING_BINARY) behind data queued so far
+        dwlProc->putErrorResponse(410, "Download aborted.");
+        found = true;
+        std::cout << "DWL " << path << " ABORTED. PENDING DOWNLOADS: " << downloadProcesses.size() << std::endl;
+        if (dwlProc->isSuspended())
+          dwlProc->resumeWaiter(); // download coroutine finishes and frees dwlProc
       }
-      return false;
+      return found;
     }
 
     bool changeDownloadPriority(string &path, int priority)
     {
-      DownloadProcess *dwlProc = nullptr;
-      for (int i = 0; i < downloadProcesses.size(); i++)
+      bool found = false;
+      for (size_t i = 0; i < downloadProcesses.size(); i++)
       {
-        if (downloadProcesses[i]->getPath() == path)
+        if (downloadProcesses[i]->getRequestPath() == path) // every segment of segmented download
         {
           downloadProcesses[i]->setPriority(priority);
-          std::cout << "DWL " << path << " ALTER PRIORITY: " << priority << std::endl;
-          return true;
+          found = true;
         }
       }
-      return false;
+      if (found)
+        std::cout << "DWL " << path << " ALTER PRIORITY: " << priority << std::endl;
+      return found;
     }
 /*
     downloadProcess* getDownloadProcess(string &path)
     {
       downloadProcess *dwlProc = nullptr;
-      for (int i = 0; i < downloadProcesses.size(); i++)
+      for (size_t i = 0; i < downloadProcesses.size(); i++)
       {
         if (downloadProcesses[i]->getPath() == path)
         {
@@ -311,15 +839,90 @@ class Connection
       return dwlProc;
     }
     */
+
+  private:
+    void initTimers()
+    {
+        for (int i = 0; i < TIMER_COUNT; i++)
+        {
+            timers[i].kind = i;
+            timers[i].owner = this;
+        }
+        last_activity = last_progress = 0;
+    }
 };
 
 
-DownloadProcess::DownloadProcess(string &path, Connection *conn, int priority = 1)
+DownloadProcess::DownloadProcess(string &path, Connection *conn, int priority = 1, bool binary = false, uint32_t stream = 0,
+                                 int chunk_size = DownloadProcess::DEFAULT_CHUNK_SIZE, bool mapped = false)
 {
+  this->chunk_size = chunk_size;
+  this->mapped = mapped && !binary; // binary mode sends with sendfile() from page cache already
+  this->stream = stream;
   this->path = path;
   this->connection = conn;
   offset = 0; // initial offset is 0, start reading at beginning
+  range_length = 0;
+  described = false;
   this->priority = priority;
+  aborted = false;
+  this->binary = binary;
+  size = end = 0; // known once file is opened
+  deficit = 0;
+  segment = -1;
+  segments = 1;
+  io_pool = nullptr;
+  readahead_window = 0;
+  data_wait = false;
+  codec = Compression::CODEC_NONE;
+}
+
+/**
+* Download only length bytes (0 means up to the end of file) starting at offset.
+* Non-empty version must match version of file, so resumed download doesn't mix two versions of it.
+* Must be called before first package is put.
+*/
+void DownloadProcess::setRange(unsigned long long offset, unsigned long long length, string version)
+{
+  this->offset = offset;
+  range_length = length;
+  if_version = version;
+}
+
+/**
+* Make download one of segments of segmented download, they are served concurrently on the same stream.
+* Every response tells the segment it belongs to, last segment to end ends the stream.
+*/
+void DownloadProcess::setSegment(int segment, int segments, std::shared_ptr<int> segments_left)
+{
+  this->segment = segment;
+  this->segments = segments;
+  this->segments_left = segments_left;
+}
+
+/**
+* Read file ahead of download on pool threads, window packages at a time (0 reads it on the event loop).
+* Must be called before first package is put.
+*/
+void DownloadProcess::setReadAhead(ThreadPool *pool, int window)
+{
+  io_pool = pool;
+  readahead_window = window;
+}
+
+/**
+* Compress chunks with codec, chunks which don't shrink are sent as they are.
+* Compressed downloads are read through read-ahead on pool threads even with mmap source or read-ahead
+* turned off, they share responses only with downloads using the same codec. Without pool chunks aren't
+* compressed, like binary mode whose raw data goes with sendfile().
+* Must be called after setReadAhead() and before first package is put.
+*/
+void DownloadProcess::setCompression(int codec)
+{
+  bool pooled = io_pool != nullptr && connection->getCompletionQueue() != nullptr;
+  this->codec = (binary || !pooled) ? (int)Compression::CODEC_NONE : codec;
+  if (this->codec != Compression::CODEC_NONE)
+    mapped = false;
 }
 
 DownloadProcess::~DownloadProcess()
@@ -329,88 +932,815 @@ DownloadProcess::~DownloadProcess()
 
 /**
 * Appends next package of data chunks to the connection.responses.
-* packageSize parameter determines number of chunks in one package.
 * Returns 0 when whole file was sent and there is no need to put next packages. Object can be destroyed.
 * Returns 1 when there are still chunks to be sent.
 */
-int DownloadProcess::putNextPackage(int packageSize)
+int DownloadProcess::putNextPackage()
+{
+  if (binary)
+    return putBinaryPackage(PACKAGE_SIZE);
+  int chunks = PACKAGE_BYTES / chunk_size;
+  if (chunks < 1)
+    chunks = 1;
+  return putBase64Package(chunks);
+}
+
+/**
+* Opens file for the whole download, so every package is read from the same descriptor.
+* Blocks on disk, download coroutine runs it on pool thread. File stays nullptr when it can't be opened
+* or isn't a regular file.
+*/
+void DownloadProcess::open(const string &path, Source &source)
+{
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1 || fstat(fd, &source.st) == -1 || !S_ISREG(source.st.st_mode))
+  {
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+  source.file = std::make_shared<FileHandle>(fd);
+}
+
+/**
+* Download file opened by open(), the same source may be given to every segment of segmented download.
+* Must be called before first package is put.
+*/
+void DownloadProcess::setSource(std::shared_ptr<Source> source)
+{
+  this->source = source;
+}
+
+/**
+* Takes over file of source set by setSource() for the rest of download.
+* Returns 0 on success, -1 when file couldn't be opened.
+*/
+int DownloadProcess::openFile()
+{
+  if (source == nullptr || source->file == nullptr)
+    return -1;
+  struct stat st = source->st;
+  int fd = source->file->fd;
+  file = source->file;
+  source = nullptr;
+  file_version = FileVersion(st);
+  size = st.st_size;
+  version = std::to_string(st.st_size) + "-" + std::to_string(st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec);
+  end = (range_length > 0 && offset + range_length < size) ? offset + range_length : size;
+  if (mapped)
+    mapping = mappedFiles.acquire(fd, st); // empty or unmappable file is read with preadv()
+  bool pooled = io_pool != nullptr && connection->getCompletionQueue() != nullptr;
+  size_t window = readahead_window > 0 ? readahead_window : 1;
+  if (pooled && mapping != nullptr)
+  {
+    // Pages are faulted in on pool, event loop encodes only chunks which are in memory
+    int chunks = PACKAGE_BYTES / chunk_size;
+    if (chunks < 1)
+      chunks = 1;
+    std::shared_ptr<MappedFile> pages = mapping;
+    readahead.start(io_pool, connection->getCompletionQueue(), connection->getId(),
+                    [pages](unsigned long long at, size_t length, char *) {return pageIn(pages, at, length);},
+                    nullptr, (size_t)chunks * chunk_size, end, window, false);
+  }
+  else if (pooled && binary && !connection->getReactor()->completesIo())
+  {
+    // Range is read into page cache on pool, so sendfile() on event loop doesn't wait for disk.
+    // Reactor completing I/O reads file segments on its ring already.
+    SendQueue::File handle = file;
+    FileVersion handle_version = file_version;
+    readahead.start(io_pool, connection->getCompletionQueue(), connection->getId(),
+                    [handle, handle_version](unsigned long long at, size_t length, char *dest)
+                    {return readFile(handle, handle_version, at, length, dest);},
+                    nullptr, (size_t)PACKAGE_SIZE * BINARY_CHUNK_SIZE, end, window, false);
+  }
+  else if (mapping == nullptr && !binary && pooled && (readahead_window > 0 || codec != Compression::CODEC_NONE))
+  {
+    int chunks = PACKAGE_BYTES / chunk_size;
+    if (chunks < 1)
+      chunks = 1;
+    SendQueue::File handle = file;
+    FileVersion handle_version = file_version;
+    ReadAhead::Encoder encoder = nullptr;
+    if (codec != Compression::CODEC_NONE)
+    {
+      int block_codec = codec;
+      int block_chunk_size = chunk_size;
+      encoder = [block_codec, block_chunk_size](ReadBlock &block) {compressChunks(block, block_codec, block_chunk_size);};
+    }
+    readahead.start(io_pool, connection->getCompletionQueue(), connection->getId(),
+                    [handle, handle_version](unsigned long long at, size_t length, char *dest)
+                    {return readFile(handle, handle_version, at, length, dest);},
+                    encoder, (size_t)chunks * chunk_size, end, window);
+  }
+  return 0;
+}
+
+/**
+* Reads up to chunks chunks of file with one preadv() and appends each of them base64 encoded in its own response.
+* Short read means end of file, response with code 200 follows the last chunk then.
+* Returns 0 when whole file was queued, 1 when there are still chunks to be sent.
+*/
+int DownloadProcess::putBase64Package(int chunks)
 {
-  //std::cout << "PUTTING NEXT PACKAGE: " << path << " " << packageSize << std::endl;
-  for (int i = 0; i < packageSize; i++)
+  if (file == nullptr)
   {
-    if (putOneChunk() == -1) // last chunk of file appneded
+    if (openFile() == -1)
+    {
+      putLastResponse(); // file which can't be read is reported as empty one
+      return 0;
+    }
+    if (checkRange() == -1)
       return 0;
   }
+
+  data_wait = false;
+
+  // Downloads going through the file in step share packages read and encoded once
+  int fanned = putFanoutPackage(chunks);
+  if (fanned != -1)
+    return fanned;
+
+  // Chunks other downloads of the file encoded already are queued as they are
+  int cached = putCachedEnvelopes(chunks);
+  if (cached > 0)
+  {
+    if (offset >= end)
+    {
+      putLastResponse();
+      return 0;
+    }
+    chunks -= cached;
+    if (chunks == 0)
+      return 1;
+  }
+
+  if (mapping != nullptr)
+    return putMappedPackage(chunks);
+  if (readahead.isEnabled())
+    return putPrefetchedPackage(chunks);
+  if (blockCache.isEnabled())
+    return putCachedPackage(chunks);
+
+  unsigned long long requested = end > offset ? end - offset : 0;
+  if (requested > (unsigned long long)chunks * chunk_size)
+    requested = (unsigned long long)chunks * chunk_size;
+  else
+    chunks = (requested + chunk_size - 1) / chunk_size;
+  if (requested == 0)
+  {
+    putLastResponse();
+    return 0;
+  }
+
+  if (chunks > IOV_MAX)
+    chunks = IOV_MAX;
+  if (buffers.size() < (size_t)chunks)
+    buffers.resize(chunks);
+  std::vector<struct iovec> iov(chunks);
+  for (int i = 0; i < chunks; i++)
+  {
+    buffers[i].resize(chunk_size);
+    iov[i].iov_base = buffers[i].data();
+    iov[i].iov_len = (i + 1 < chunks || requested % chunk_size == 0) ? chunk_size : requested % chunk_size;
+  }
+  requested = (unsigned long long)(chunks - 1) * chunk_size + iov[chunks - 1].iov_len;
+
+  ssize_t rval;
+  do
+  {
+    rval = preadv(file->fd, iov.data(), chunks, offset);
+  } while (rval == -1 && errno == EINTR);
+  if (rval == -1)
+  {
+    perror("preadv");
+    putErrorResponse(500, "Error reading file.");
+    return 0;
+  }
+  bytes += rval;
+
+  size_t left = rval;
+  for (int i = 0; i < chunks && left > 0; i++)
+  {
+    size_t length = left < (size_t)chunk_size ? left : chunk_size;
+    left -= length;
+    putChunkResponse(base64_encode(reinterpret_cast<unsigned char*>(buffers[i].data()), length), offset, length);
+    offset += length;
+  }
+
+  if ((unsigned long long)rval < requested || offset >= end) // end of file or of requested range
+  {
+    putLastResponse();
+    return 0;
+  }
   return 1;
 }
 
-int DownloadProcess::putOneChunk()
+/**
+* Copies up to chunks chunks out of blocks of shared block cache and appends each of them base64 encoded.
+* Blocks missing from cache are read from file, so downloads of a hot file read it from disk about once.
+* Returns 0 when whole file was queued, 1 when there are still chunks to be sent.
+*/
+int DownloadProcess::putCachedPackage(int chunks)
 {
-  // get chunk of file
-  int sizeOfChunk;
-  char *binaryChunk = getDataChunk(sizeOfChunk);
-  offset += CHUNK_SIZE;
+  unsigned long long requested = end > offset ? end - offset : 0;
+  if (requested > (unsigned long long)chunks * chunk_size)
+    requested = (unsigned long long)chunks * chunk_size;
+  if (requested == 0)
+  {
+    putLastResponse();
+    return 0;
+  }
 
-  if (binaryChunk == nullptr) // end of file
-    return -1;
+  if (package.size() < requested)
+    package.resize(requested);
+  ssize_t rval = blockCache.read(file->fd, file_version, offset, requested, package.data());
+  if (rval == -1)
+  {
+    putErrorResponse(500, "Error reading file.");
+    return 0;
+  }
+  bytes += rval;
+
+  for (ssize_t pos = 0; pos < rval; pos += chunk_size)
+  {
+    size_t length = rval - pos < chunk_size ? rval - pos : chunk_size;
+    putChunkResponse(base64_encode(reinterpret_cast<unsigned char*>(package.data() + pos), length), offset, length);
+    offset += length;
+  }
+
+  if ((unsigned long long)rval < requested || offset >= end) // end of file or of requested range
+  {
+    putLastResponse();
+    return 0;
+  }
+  return 1;
+}
+
+/**
+* Encodes up to chunks chunks from block read ahead on pool threads, the event loop doesn't wait for disk.
+* When the block isn't read yet nothing is queued and download waits for it before its next turn.
+* Package ends at the end of block, so it may have fewer chunks.
+* Returns 0 when whole file was queued, 1 when there are still chunks to be sent.
+*/
+int DownloadProcess::putPrefetchedPackage(int chunks)
+{
+  unsigned long long requested = end > offset ? end - offset : 0;
+  if (requested > (unsigned long long)chunks * chunk_size)
+    requested = (unsigned long long)chunks * chunk_size;
+  if (requested == 0)
+  {
+    putLastResponse();
+    return 0;
+  }
+
+  ReadAhead::Block block = readahead.get(offset);
+  if (block == nullptr)
+  {
+    data_wait = true;
+    return 1;
+  }
+  if (block->result == -1)
+  {
+    putErrorResponse(500, "Error reading file.");
+    return 0;
+  }
+  unsigned long long skip = offset - block->offset;
+  unsigned long long available = (unsigned long long)block->result > skip ? block->result - skip : 0;
+  if (requested > available)
+    requested = available;
+  bytes += requested;
+
+  for (unsigned long long pos = 0; pos < requested; pos += chunk_size)
+  {
+    size_t length = requested - pos < (unsigned long long)chunk_size ? requested - pos : chunk_size;
+    size_t index = (skip + pos) / chunk_size; // blocks start at chunk boundary
+    if (index < block->packed.size() && !block->packed[index].empty())
+    {
+      const string &packed = block->packed[index];
+      putChunkResponse(base64_encode(reinterpret_cast<const unsigned char*>(packed.data()), packed.size()), offset, length, true);
+    }
+    else
+      putChunkResponse(base64_encode(reinterpret_cast<unsigned char*>(block->data.data() + skip + pos), length), offset, length);
+    offset += length;
+  }
+
+  bool file_end = block->result < (ssize_t)block->length && offset >= block->offset + block->result;
+  if (file_end || offset >= end) // end of file or of requested range
+  {
+    putLastResponse();
+    return 0;
+  }
+  return 1;
+}
+
+/**
+* Encodes up to chunks chunks straight from pages of shared mapping of the file.
+* File size is checked before every package, so pages past the end of a truncated file are not touched.
+* If file shrinks while package is being encoded, SIGBUS handler marks mapping damaged and download fails
+* without sending the package.
+* Returns 0 when whole file was queued, 1 when there are still chunks to be sent.
+*/
+int DownloadProcess::putMappedPackage(int chunks)
+{
+  struct stat st;
+  unsigned long long limit = mapping->length;
+  if (fstat(file->fd, &st) == 0 && (unsigned long long)st.st_size < limit)
+    limit = st.st_size;
+  if (end < limit)
+    limit = end;
+  unsigned long long length = limit > offset ? limit - offset : 0;
+  if (length > (unsigned long long)chunks * chunk_size)
+    length = (unsigned long long)chunks * chunk_size;
+
+  if (readahead.isEnabled() && length > 0)
+  {
+    // Package is encoded only from pages faulted in on pool, it ends at the end of block
+    ReadAhead::Block block = readahead.get(offset);
+    if (block == nullptr)
+    {
+      data_wait = true;
+      return 1;
+    }
+    if (length > block->offset + block->length - offset)
+      length = block->offset + block->length - offset;
+  }
+  else
+  {
+    // Pages of next package are read in while this one is encoded and sent
+    unsigned long long page = sysconf(_SC_PAGESIZE);
+    unsigned long long ahead = (offset + length) & ~(page - 1);
+    if (ahead < limit)
+      madvise(mapping->data + ahead, (offset + 2 * length < limit ? offset + 2 * length : limit) - ahead, MADV_WILLNEED);
+  }
 
-  // encode with base64
-  unsigned char *chunkToEncode = reinterpret_cast<unsigned char*>(binaryChunk);
-  string encodedChunk = base64_encode(chunkToEncode, sizeOfChunk);
+  std::vector<string> encoded;
+  {
+    MappedFile::Guard guard(mapping.get());
+    for (unsigned long long pos = 0; pos < length; pos += chunk_size)
+    {
+      unsigned long long chunk = length - pos < (unsigned long long)chunk_size ? length - pos : chunk_size;
+      encoded.push_back(base64_encode(reinterpret_cast<unsigned char*>(mapping->data + offset + pos), chunk));
+    }
+  }
+  if (mapping->isDamaged())
+  {
+    std::cout << "File " << path << " shrank during download" << std::endl;
+    putErrorResponse(500, "File changed during download.");
+    return 0;
+  }
+
+  for (size_t i = 0; i < encoded.size(); i++)
+  {
+    unsigned long long chunk_offset = offset + i * chunk_size;
+    putChunkResponse(std::move(encoded[i]), chunk_offset, limit - chunk_offset < (unsigned long long)chunk_size ? limit - chunk_offset : chunk_size);
+  }
+  offset += length;
+  bytes += length;
+  if (offset >= limit)
+  {
+    putLastResponse();
+    return 0;
+  }
+  return 1;
+}
 
-  // prepare json wrapper for chunk = response
+/**
+* Appends shared responses of up to chunks chunks starting at offset from envelope cache.
+* Stops at first chunk which isn't cached. Returns number of chunks appended.
+*/
+int DownloadProcess::putCachedEnvelopes(int chunks)
+{
+  if (!envelopeCache.isEnabled() || !described || segment >= 0)
+    return 0;
+  int cached = 0;
+  while (cached < chunks && offset < end)
+  {
+    size_t length = end - offset < (unsigned long long)chunk_size ? end - offset : chunk_size;
+    EnvelopeCache::Envelope envelope = envelopeCache.find(file_version, path, codec, offset, length);
+    if (envelope == nullptr)
+      break;
+    connection->setStreamResponse(stream, envelope, false);
+    offset += length;
+    bytes += length;
+    cached++;
+  }
+  return cached;
+}
+
+/**
+* Appends response with one base64 encoded chunk of file of length bytes.
+* First chunk also tells its offset, the rest follow it without gaps. Responses which are the same
+* for every download of the file go to envelope cache.
+* Compressed chunk tells codec, client decompresses it to length bytes.
+*/
+void DownloadProcess::putChunkResponse(string data, unsigned long long chunk_offset, size_t length, bool compressed)
+{
+  if (envelopeCache.isEnabled() && described && segment < 0)
+  {
+    connection->setStreamResponse(stream, makeEnvelope(std::move(data), chunk_offset, length, compressed), false);
+    return;
+  }
   json response;
   response["type"] = "RESPONSE";
   response["command"] = "DWL";
   response["code"] = 206; // partial data
-  response["path"] = path.substr(5, path.size()); // cut data/ at the beginning
-  response["data"] = encodedChunk;
+  response["path"] = getRequestPath();
+  if (!described || segment >= 0) // chunks of segments are interleaved, each of them tells its offset
+  {
+    response["offset"] = chunk_offset;
+    describeFile(response);
+  }
+  markSegment(response);
+  if (compressed)
+    response["compression"] = Compression::name(codec);
+  response["data"] = std::move(data);
+  connection->setStreamResponse(stream, response.dump()+"\n", false);
+}
 
-  // appened json wrapper
-  string responseString = response.dump()+"\n";
-  connection->setResponse(responseString);
+/**
+* Makes response with base64 encoded chunk of length bytes at chunk_offset, which is the same for every
+* download of the file that already sent its first chunk, and puts it in envelope cache.
+*/
+EnvelopeCache::Envelope DownloadProcess::makeEnvelope(string data, unsigned long long chunk_offset, size_t length, bool compressed)
+{
+  json response;
+  response["type"] = "RESPONSE";
+  response["command"] = "DWL";
+  response["code"] = 206; // partial data
+  response["path"] = getRequestPath();
+  if (compressed)
+    response["compression"] = Compression::name(codec);
+  response["data"] = std::move(data);
+  EnvelopeCache::Envelope envelope = std::make_shared<const string>(response.dump()+"\n");
+  if (envelopeCache.isEnabled())
+    envelopeCache.add(file_version, path, codec, chunk_offset, length, envelope);
+  return envelope;
+}
 
-  // clean up
-  delete[] binaryChunk;
-  //delete encodedChunk;
-  return 0;
+/**
+* Appends next package from fan-out group of downloads of the file which go through it in step with this one.
+* Only base64 downloads of the whole rest of file, standing at package boundary, take part.
+* Returns -1 when download has to read the file on its own, otherwise the same as putBase64Package().
+*/
+int DownloadProcess::putFanoutPackage(int chunks)
+{
+  unsigned long long package_bytes = (unsigned long long)chunks * chunk_size;
+  if (!fanout.isEnabled() || segment >= 0 || end != size || offset >= end || offset % package_bytes != 0)
+    return -1;
+  unsigned long long length = end - offset < package_bytes ? end - offset : package_bytes;
+  FanoutRegistry::Package shared = fanout.get(file_version, path, chunk_size, codec, offset / package_bytes, !described,
+                                              [this, length]() {return producePackage(length);});
+  if (shared == nullptr)
+    return data_wait ? 1 : -1; // package waits for read-ahead block of this download
+
+  size_t i = 0;
+  if (!described && shared->length > 0)
+  {
+    // First chunk of download tells offset, size and version, it can't be shared
+    putChunkResponse(shared->first_data, offset, shared->length < (unsigned long long)chunk_size ? shared->length : chunk_size,
+                     shared->first_compressed);
+    i = 1;
+  }
+  for (; i < shared->envelopes.size(); i++)
+    connection->setStreamResponse(stream, shared->envelopes[i], false);
+  offset += shared->length;
+  bytes += shared->length;
+
+  if (shared->length < length || offset >= end) // end of file
+  {
+    putLastResponse();
+    return 0;
+  }
+  return 1;
 }
 
+/**
+* Reads and encodes length bytes at current offset into package shared by fan-out group.
+* Returns nullptr when file can't be read.
+*/
+FanoutRegistry::Package DownloadProcess::producePackage(unsigned long long length)
+{
+  char *data_start;
+  ssize_t rval;
+  size_t first_index = 0; // index of first chunk of package in block
+  ReadAhead::Block block;
+  if (readahead.isEnabled())
+  {
+    block = readahead.get(offset);
+    if (block == nullptr)
+    {
+      data_wait = true; // group lock isn't held while block is read, download asks again when it is in memory
+      return nullptr;
+    }
+    if (block->result == -1)
+      return nullptr;
+    unsigned long long skip = offset - block->offset;
+    rval = block->result > (ssize_t)skip ? block->result - skip : 0;
+    if ((unsigned long long)rval < length && block->result == (ssize_t)block->length)
+      return nullptr; // block ends inside package and isn't end of file, download reads on its own
+  }
+  if (block != nullptr && mapping == nullptr)
+  {
+    if ((unsigned long long)rval > length)
+      rval = length;
+    data_start = block->data.data() + offset - block->offset;
+    first_index = (offset - block->offset) / chunk_size;
+  }
+  else
+  {
+    // Pages of mapping are in memory already when block paging them in is ready
+    if (package.size() < length)
+      package.resize(length);
+    rval = readData(offset, length, package.data());
+    if (rval == -1)
+      return nullptr;
+    data_start = package.data();
+  }
 
+  std::shared_ptr<FanoutPackage> produced = std::make_shared<FanoutPackage>();
+  for (ssize_t pos = 0; pos < rval; pos += chunk_size)
+  {
+    size_t chunk = rval - pos < chunk_size ? rval - pos : chunk_size;
+    size_t index = first_index + pos / chunk_size;
+    bool compressed = block != nullptr && index < block->packed.size() && !block->packed[index].empty();
+    string data = compressed ? base64_encode(reinterpret_cast<const unsigned char*>(block->packed[index].data()), block->packed[index].size())
+                             : base64_encode(reinterpret_cast<unsigned char*>(data_start + pos), chunk);
+    if (pos == 0)
+    {
+      produced->first_data = data;
+      produced->first_compressed = compressed;
+    }
+    produced->envelopes.push_back(makeEnvelope(std::move(data), offset + pos, chunk, compressed));
+  }
+  produced->length = rval;
+  produced->last = (unsigned long long)rval < length || offset + rval >= size;
+  return produced;
+}
 
-char* DownloadProcess::getDataChunk(int &readDataSize)
+/**
+* Reads length bytes of file at given offset into dest from shared mapping, block cache or the file itself.
+* Returns number of bytes read, less than length at the end of file, or -1 on error.
+*/
+ssize_t DownloadProcess::readData(unsigned long long at, size_t length, char *dest)
 {
-  std::ifstream file; // file to be sent
-  file.open(path, std::ios::binary);
+  if (mapping != nullptr)
+  {
+    struct stat st;
+    unsigned long long limit = mapping->length;
+    if (fstat(file->fd, &st) == 0 && (unsigned long long)st.st_size < limit)
+      limit = st.st_size;
+    if (at >= limit)
+      return 0;
+    if (length > limit - at)
+      length = limit - at;
+    {
+      MappedFile::Guard guard(mapping.get());
+      memcpy(dest, mapping->data + at, length);
+    }
+    return mapping->isDamaged() ? -1 : (ssize_t)length;
+  }
+  return readFile(file, file_version, at, length, dest);
+}
 
-  file.seekg(offset);
-  char *buffer = new char[CHUNK_SIZE];
-  file.read(buffer, CHUNK_SIZE);
-  readDataSize = file.gcount();
+/**
+* Reads length bytes of opened file at given offset into dest through block cache or with pread().
+* Doesn't touch any download, so read-ahead runs it on pool threads.
+* Returns number of bytes read, less than length at the end of file, or -1 on error.
+*/
+ssize_t DownloadProcess::readFile(const SendQueue::File &file, const FileVersion &version, unsigned long long at, size_t length, char *dest)
+{
+  if (blockCache.isEnabled())
+    return blockCache.read(file->fd, version, at, length, dest);
 
-  bytes += readDataSize;
+  size_t done = 0;
+  while (done < length)
+  {
+    ssize_t rval = pread(file->fd, dest + done, length - done, at + done);
+    if (rval == -1 && errno == EINTR)
+      continue;
+    if (rval == -1)
+    {
+      perror("pread");
+      return -1;
+    }
+    if (rval == 0)
+      break;
+    done += rval;
+  }
+  return done;
+}
 
-  if (file.gcount() == 0) // end of file
+/**
+* Faults in pages of mapping holding length bytes at given offset, read-ahead runs it on pool threads so
+* event loop encodes from pages which are in memory. Pages past the end of truncated file mark mapping damaged.
+* Returns number of bytes paged in.
+*/
+ssize_t DownloadProcess::pageIn(const std::shared_ptr<MappedFile> &mapping, unsigned long long at, size_t length)
+{
+  if (at >= mapping->length)
+    return 0;
+  if (length > mapping->length - at)
+    length = mapping->length - at;
+  unsigned long long page = sysconf(_SC_PAGESIZE);
+  unsigned long long start = at & ~(page - 1);
+  madvise(mapping->data + start, at + length - start, MADV_WILLNEED);
+  MappedFile::Guard guard(mapping.get());
+  volatile char sink = 0;
+  for (unsigned long long pos = start; pos < at + length; pos += page)
+    sink = sink + mapping->data[pos];
+  return length;
+}
+
+/**
+* Compresses chunks of block read ahead, runs on pool thread. When sample at the start of block doesn't
+* shrink, block is taken for incompressible (JPEG, archive) and none of its chunks is compressed.
+*/
+void DownloadProcess::compressChunks(ReadBlock &block, int codec, int chunk_size)
+{
+  size_t chunks = (block.result + chunk_size - 1) / chunk_size;
+  bool worth = Compression::worthCompressing(codec, block.data.data(), block.result);
+  block.packed.resize(chunks);
+  for (size_t i = 0; i < chunks; i++)
   {
-    file.close();
-    delete[] buffer;
-    std::cout << "DWL PROCESS " << path << " ENDED. SENT BYTES: " << bytes << std::endl;
+    size_t at = i * chunk_size;
+    size_t length = block.result - at < (size_t)chunk_size ? block.result - at : chunk_size;
+    if (worth && !Compression::compress(codec, block.data.data() + at, length, block.packed[i]))
+      block.packed[i].clear();
+    compressionStats.add(codec, !block.packed[i].empty(), length, block.packed[i].empty() ? length : block.packed[i].size());
+  }
+}
 
-    json response;
-    response["type"] = "RESPONSE";
-    response["command"] = "DWL";
-    response["code"] = 200;
-    response["path"] = path.substr(5, path.size()); // cut data/ at the beginning
-    response["data"] = "Entire file was sent.";
+/**
+* Adds total size and version of file to first response of download, so client can resume it later.
+*/
+void DownloadProcess::describeFile(json &response)
+{
+  if (described)
+    return;
+  response["size"] = size;
+  response["version"] = version;
+  described = true;
+}
 
-    string responseString = response.dump()+"\n";
-    connection->setResponse(responseString);
+/**
+* Adds segment index and count to response of segmented download, so client can tell when all segments ended.
+*/
+void DownloadProcess::markSegment(json &response)
+{
+  if (segment < 0)
+    return;
+  response["segment"] = segment;
+  response["segments"] = segments;
+}
 
-    return nullptr;
+/**
+* Called once by the response which ends download. Returns false when other segments of segmented
+* download are still going on, the stream stays open for them.
+*/
+bool DownloadProcess::endsStream()
+{
+  if (segments_left == nullptr)
+    return true;
+  return --*segments_left == 0;
+}
+
+/**
+* Checks requested range against opened file, appends error response when it can't be served:
+* 412 when client resumes other version of file, 416 when range starts past the end of file.
+* Returns 0 when download can go on, -1 when it ended.
+*/
+int DownloadProcess::checkRange()
+{
+  if (if_version != "" && if_version != version)
+  {
+    putErrorResponse(412, "File changed, version is " + version);
+    return -1;
+  }
+  if (offset > size)
+  {
+    putErrorResponse(416, "Offset is past the end of file.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Appends error response which ends download that can't go on.
+* It tells current size and version of file, so client can start over.
+*/
+void DownloadProcess::putErrorResponse(int code, string message)
+{
+  json response;
+  response["type"] = "RESPONSE";
+  response["command"] = "DWL";
+  response["code"] = code;
+  response["path"] = getRequestPath();
+  if (file != nullptr)
+  {
+    response["size"] = size;
+    response["version"] = version;
+  }
+  markSegment(response);
+  response["data"] = message;
+  connection->setStreamResponse(stream, response.dump()+"\n", endsStream());
+}
+
+/**
+* Appends response with code 200 which ends base64 download.
+*/
+void DownloadProcess::putLastResponse()
+{
+  std::cout << "DWL PROCESS " << path << " ENDED. SENT BYTES: " << bytes.load() << std::endl;
+
+  json response;
+  response["type"] = "RESPONSE";
+  response["command"] = "DWL";
+  response["code"] = 200;
+  response["path"] = getRequestPath();
+  if (file != nullptr)
+    describeFile(response); // range was empty, there was no chunk to describe file
+  markSegment(response);
+  response["data"] = "Entire file was sent.";
+  connection->setStreamResponse(stream, response.dump()+"\n", endsStream());
+}
+
+
+
+/**
+* Appends JSON header followed by packageSize binary chunks of raw file data, sent with sendfile().
+* Header tells offset and length of data which follows it, first one also size and version of file.
+* Last package is followed by response with code 200 and file size.
+* Returns 0 when whole file was queued, 1 when there are still chunks to be sent.
+*/
+int DownloadProcess::putBinaryPackage(int packageSize)
+{
+  json response;
+  response["type"] = "RESPONSE";
+  response["command"] = "DWL";
+  response["path"] = getRequestPath();
+  response["mode"] = "binary";
+  markSegment(response);
+
+  if (file == nullptr)
+  {
+    if (openFile() == -1)
+    {
+      response["code"] = 404;
+      response["data"] = "File not found";
+      connection->setStreamResponse(stream, response.dump()+"\n", endsStream());
+      return 0;
+    }
+    if (checkRange() == -1)
+      return 0;
+  }
+
+  data_wait = false;
+  unsigned long long length = end > offset ? end - offset : 0;
+  if (length > (unsigned long long)packageSize * BINARY_CHUNK_SIZE)
+    length = (unsigned long long)packageSize * BINARY_CHUNK_SIZE;
+  if (readahead.isEnabled() && length > 0)
+  {
+    // Data is sent once block holding it is in page cache, package ends at the end of block
+    ReadAhead::Block block = readahead.get(offset);
+    if (block == nullptr)
+    {
+      data_wait = true;
+      return 1;
+    }
+    if (block->result == -1)
+    {
+      putErrorResponse(500, "Error reading file.");
+      return 0;
+    }
+    unsigned long long skip = offset - block->offset;
+    unsigned long long available = (unsigned long long)block->result > skip ? block->result - skip : 0;
+    if (length > available)
+      length = available; // file shrank, nothing past its end is sent
+    if (available < block->length - skip)
+      end = offset + length;
+  }
+  if (length > 0)
+  {
+    response["code"] = 206; // partial data
+    response["offset"] = offset;
+    response["length"] = length;
+    describeFile(response);
+    connection->setStreamData(stream, response.dump(), file, offset, length);
+    offset += length;
+    bytes += length;
+    if (offset < end)
+      return 1;
   }
 
-  file.close();
-  return buffer;
+  std::cout << "DWL PROCESS " << path << " ENDED. SENT BYTES: " << bytes.load() << std::endl;
+  response.erase("offset");
+  response.erase("length");
+  response["code"] = 200;
+  response["size"] = size;
+  response["version"] = version;
+  response["data"] = "Entire file was sent.";
+  connection->setStreamResponse(stream, response.dump()+"\n", endsStream());
+  return 0;
 }
 
 #endif //CONNECTION_H
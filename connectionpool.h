@@ -0,0 +1,133 @@
+#ifndef CONNECTIONPOOL_H
+#define CONNECTIONPOOL_H
+
+#include "connection.h"
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+//
+// ConnectionPool is a slab of connections with stable addresses
+// Connections are allocated in blocks which are never moved, so pointers to them (timers,
+// download processes) stay valid until connection is released. Free slots are reused in O(1).
+// Connections are referred to by handles: slot index and slot generation packed in 64 bits.
+// Generation changes whenever slot is released, so a stale handle never resolves to a new connection.
+// Fields checked by event loop on every wakeup are kept apart from connections in a compact array.
+//
+class ConnectionPool
+{
+  public:
+    static const uint32_t SLAB_BLOCK = 256; // connections allocated at once
+    static const uint32_t MAX_INDEX = 0xfffffff0; // indices above are free for tokens which are not connections
+
+    //
+    // Per-slot state read by event loop on every wakeup
+    //
+    struct HotState
+    {
+        int socket = -1;
+        uint32_t generation = 1;
+        bool live = false;
+        bool write_armed = false; // write interest for socket is registered in reactor
+        bool pending = false; // connection is queued for handling in next loop iteration
+    };
+
+  private:
+    std::vector<Connection*> blocks; // raw storage for SLAB_BLOCK connections each
+    std::vector<HotState> hot; // indexed by slot
+    std::vector<uint32_t> free_slots;
+    size_t live_count;
+
+  public:
+    ConnectionPool(): live_count(0) {}
+
+    ~ConnectionPool()
+    {
+        for (uint32_t i = 0; i < hot.size(); i++)
+            if (hot[i].live)
+                slot(i)->~Connection();
+        for (size_t i = 0; i < blocks.size(); i++)
+            ::operator delete(blocks[i]);
+    }
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    static uint64_t makeHandle(uint32_t index, uint32_t generation) {return ((uint64_t)generation << 32) | index;}
+    static uint32_t handleIndex(uint64_t handle) {return (uint32_t)handle;}
+    static uint32_t handleGeneration(uint64_t handle) {return (uint32_t)(handle >> 32);}
+
+    size_t size() const {return live_count;}
+
+    //
+    // Construct connection for given socket, returns its handle
+    //
+    uint64_t create(int socket)
+    {
+        uint32_t index;
+        if (!free_slots.empty())
+        {
+            index = free_slots.back();
+            free_slots.pop_back();
+        }
+        else
+        {
+            index = (uint32_t)hot.size();
+            if (index % SLAB_BLOCK == 0)
+                blocks.push_back(static_cast<Connection*>(::operator new(sizeof(Connection) * SLAB_BLOCK)));
+            hot.push_back(HotState());
+        }
+        new (slot(index)) Connection(socket);
+        HotState &st = hot[index];
+        st.socket = socket;
+        st.live = true;
+        st.write_armed = false;
+        st.pending = false;
+        live_count++;
+        return makeHandle(index, st.generation);
+    }
+
+    // Returns connection for given handle or nullptr when it has been released
+    Connection* get(uint64_t handle)
+    {
+        HotState *st = state(handle);
+        return st != nullptr ? slot(handleIndex(handle)) : nullptr;
+    }
+
+    // Returns hot state of live connection for given handle or nullptr when it has been released
+    HotState* state(uint64_t handle)
+    {
+        uint32_t index = handleIndex(handle);
+        if (index >= hot.size())
+            return nullptr;
+        HotState &st = hot[index];
+        if (!st.live || st.generation != handleGeneration(handle))
+            return nullptr;
+        return &st;
+    }
+
+    //
+    // Destroy connection, its slot is reused by next create()
+    //
+    void release(uint64_t handle)
+    {
+        HotState *st = state(handle);
+        if (st == nullptr)
+            return;
+        uint32_t index = handleIndex(handle);
+        slot(index)->~Connection();
+        st->live = false;
+        st->socket = -1;
+        st->generation++;
+        free_slots.push_back(index);
+        live_count--;
+    }
+
+  private:
+    Connection* slot(uint32_t index)
+    {
+        return blocks[index / SLAB_BLOCK] + (index % SLAB_BLOCK);
+    }
+};
+
+#endif //CONNECTIONPOOL_H
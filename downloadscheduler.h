@@ -0,0 +1,222 @@
+#ifndef DOWNLOADSCHEDULER_H
+#define DOWNLOADSCHEDULER_H
+
+#include "connection.h"
+#include "connectionpool.h"
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+
+//
+// DownloadScheduler decides which download queues its next package of data
+// Connections whose download data drained below low watermark are activated by worker, every loop
+// iteration run() hands out up to a budget of bytes and active connections stay active until they
+// reach high watermark or have no download waiting. Under DRR policy bytes are shared by deficit
+// round robin on three levels: users get equal quanta, connections of a user get quantum * sum of
+// priorities of their downloads out of the user's deficit and downloads of a connection get
+// quantum * priority out of the connection's.
+// A package may overshoot deficit, the debt is kept when user or connection leaves the active set
+// (typically because the package filled its send queue) and paid before it is served again.
+// Under SRPT policy the waiting download with the fewest bytes left goes first, which cuts mean
+// completion time when small files compete with large ones.
+// Every worker schedules its own connections, they are split between workers by the kernel.
+//
+class DownloadScheduler
+{
+  public:
+    using string = std::string;
+    enum Policy { POLICY_DRR = 0, POLICY_SRPT };
+    static const long long QUANTUM = 16384; // bytes added to deficit of user, connection or download of priority 1 per turn
+
+  private:
+    struct UserClass
+    {
+        string name;
+        long long deficit;
+        std::deque<uint64_t> connections; // active connections of user in round robin order
+    };
+
+    struct ActiveConnection
+    {
+        std::list<UserClass>::iterator user;
+    };
+
+    ConnectionPool &pool;
+    Policy policy;
+    std::list<UserClass> users; // users with active connections in round robin order
+    std::unordered_map<string, std::list<UserClass>::iterator> user_index;
+    std::unordered_map<uint64_t, ActiveConnection> active; // by connection handle
+    std::unordered_map<string, long long> user_debt; // negative deficits of users which left the round
+
+  public:
+    DownloadScheduler(ConnectionPool &pool, Policy policy = POLICY_DRR): pool(pool), policy(policy) {}
+
+    DownloadScheduler(const DownloadScheduler&) = delete;
+    DownloadScheduler& operator=(const DownloadScheduler&) = delete;
+
+    // Returns policy for given name ("drr" or "srpt"), -1 when name is unknown
+    static int parsePolicy(const string &name)
+    {
+        if (name == "drr")
+            return POLICY_DRR;
+        if (name == "srpt")
+            return POLICY_SRPT;
+        return -1;
+    }
+
+    // True when some connection waits for download data, worker must not block in reactor then
+    bool isBusy() const {return !active.empty();}
+
+    //
+    // Put connection in active set, nothing is done when it is there already
+    //
+    void activate(uint64_t handle, Connection &conn)
+    {
+        if (active.find(handle) != active.end())
+            return;
+        string name = conn.getUser() != nullptr ? conn.getUser()->username : "";
+        auto found = user_index.find(name);
+        std::list<UserClass>::iterator user;
+        if (found == user_index.end())
+        {
+            long long deficit = 0;
+            auto debt = user_debt.find(name);
+            if (debt != user_debt.end())
+            {
+                deficit = debt->second;
+                user_debt.erase(debt);
+            }
+            user = users.insert(users.end(), UserClass{name, deficit, {}});
+            user_index[name] = user;
+        }
+        else
+            user = found->second;
+        user->connections.push_back(handle);
+        active[handle] = ActiveConnection{user};
+    }
+
+    //
+    // Hand out up to budget bytes of download data
+    // Handles of connections which got some data are appended to served, they have to be flushed
+    // Returns number of bytes queued
+    size_t run(size_t budget, std::vector<uint64_t> &served)
+    {
+        if (policy == POLICY_SRPT)
+            return runShortestFirst(budget, served);
+
+        size_t used = 0;
+        while (used < budget && !users.empty())
+        {
+            std::list<UserClass>::iterator user = users.begin();
+            user->deficit += QUANTUM;
+            while (user->deficit > 0 && !user->connections.empty() && used < budget)
+            {
+                uint64_t handle = user->connections.front();
+                user->connections.pop_front();
+                auto it = active.find(handle);
+                if (it == active.end())
+                    continue;
+                Connection *conn = pool.get(handle);
+                if (conn == nullptr)
+                {
+                    active.erase(it);
+                    continue;
+                }
+
+                long long deficit = conn->getSchedDeficit() + QUANTUM * conn->getDownloadWeight();
+                size_t produced = 0;
+                if (deficit > 0)
+                    produced = conn->serveDownloads(deficit < user->deficit ? deficit : user->deficit, QUANTUM);
+                deficit -= produced;
+                user->deficit -= produced;
+                used += produced;
+                if (produced > 0)
+                    served.push_back(handle);
+
+                if (conn->canTakeDownloadData())
+                    user->connections.push_back(handle);
+                else
+                {
+                    active.erase(it);
+                    if (deficit > 0)
+                        deficit = 0; // only debt is kept
+                }
+                conn->setSchedDeficit(deficit);
+            }
+
+            if (user->connections.empty())
+                removeUser(user);
+            else
+                users.splice(users.end(), users, user);
+        }
+        return used;
+    }
+
+  private:
+    //
+    // Serve the waiting download with the fewest bytes left, one package at a time
+    //
+    size_t runShortestFirst(size_t budget, std::vector<uint64_t> &served)
+    {
+        size_t used = 0;
+        while (used < budget)
+        {
+            uint64_t best_handle = 0;
+            Connection *best_conn = nullptr;
+            DownloadProcess *best = nullptr;
+            for (auto it = active.begin(); it != active.end(); )
+            {
+                Connection *conn = pool.get(it->first);
+                if (conn == nullptr || !conn->canTakeDownloadData())
+                {
+                    it = deactivate(it);
+                    continue;
+                }
+                DownloadProcess *dwlProc = conn->shortestWaitingDownload();
+                if (best == nullptr || dwlProc->getRemaining() < best->getRemaining())
+                {
+                    best = dwlProc;
+                    best_conn = conn;
+                    best_handle = it->first;
+                }
+                ++it;
+            }
+            if (best == nullptr)
+                break;
+            used += best_conn->serveDownload(best);
+            if (served.empty() || served.back() != best_handle)
+                served.push_back(best_handle);
+        }
+        return used;
+    }
+
+    std::unordered_map<uint64_t, ActiveConnection>::iterator deactivate(std::unordered_map<uint64_t, ActiveConnection>::iterator it)
+    {
+        std::list<UserClass>::iterator user = it->second.user;
+        for (size_t i = 0; i < user->connections.size(); i++)
+        {
+            if (user->connections[i] == it->first)
+            {
+                user->connections.erase(user->connections.begin() + i);
+                break;
+            }
+        }
+        if (user->connections.empty())
+            removeUser(user);
+        return active.erase(it);
+    }
+
+    // User without active connections leaves the round, its deficit is forgotten unless it is a debt
+    void removeUser(std::list<UserClass>::iterator user)
+    {
+        if (user->deficit < 0)
+            user_debt[user->name] = user->deficit;
+        user_index.erase(user->name);
+        users.erase(user);
+    }
+};
+
+#endif //DOWNLOADSCHEDULER_H
@@ -1,227 +1,366 @@
+#include <signal.h>
 #include "connection.h"
 #include "auth_strategy/authstrategy.hpp"
 #include "requestparser.h"
 #include "requestengine.hpp"
+#include "reactor.h"
+#include "uringreactor.h"
+#include "worker.h"
+#include "serverconfig.h"
+#include "utils/threadpool.h"
 #include <vector>
 #include <string>
 #include <iostream>
-#include <unordered_map>
+#include <thread>
 
 using string = std::string;
 
-#define DEFAULT_PORT 8888
-#define BACKLOG_SIZE 5 //maximum number of waiting connections, used in listen
 
-
-std::unordered_map<std::string, Connection*> activeUploads; // maps path to Connections witch uplad the file
-
-int parseCommandLineArgs(int argc, char **argv, int &port, string &data_root, string& auth_root);
+int parseCommandLineArgs(int argc, char **argv, ServerConfig &config);
+Reactor* createReactor(const string &backend);
 
 int main(int argc, char **argv)
 {
-    int sock;
-    socklen_t length;
-    struct sockaddr_in server;
-    fd_set ready, write_ready;
-    struct timeval to;
-    int msgsock = -1, nfds, nactive;
-
-    string data_root, auth_root;
-    int port;
-    parseCommandLineArgs(argc, argv,port, data_root, auth_root);
-    AuthStrategy auth = AuthStrategy(auth_root+"users.auth");
-    RequestEngine engine = RequestEngine(data_root, auth_root);
-    RequestParser parser = RequestParser(&engine, &auth);
-
-    std::vector<Connection> connections;
-
-    char buf[1024];
-    int rval = 0, i;
+    ServerConfig config;
+    parseCommandLineArgs(argc, argv, config);
+    signal(SIGPIPE, SIG_IGN); // sendfile() to closed socket must fail with EPIPE instead of killing server
+    stats.scheduler_policy = config.scheduler;
+    stats.setWorkers(config.threads);
+    AuthStrategy auth(config.auth_root+"users.auth");
+    RequestEngine engine(config.data_root, config.auth_root, &auth);
+    ThreadPool *pool = nullptr;
+    if (config.io_threads > 0)
+        pool = new ThreadPool(config.io_threads, config.io_queue);
+    bool mapped = config.source == "mmap";
+    if (mapped && MappedFile::installFaultHandler() != 0)
+        exit(1);
+    blockCache.setCapacity((size_t)config.cache_size << 20);
+    envelopeCache.setCapacity((size_t)config.envelope_cache_size << 20, config.chunk_size * 1024);
+    fanout.setWindow(config.fanout_window);
+    // Workers share the bucket, each of them could save up its scheduler budget before
+    rateLimiter.setRate(config.rate_limit, (long long)SCHED_BUDGET * config.threads, TimerWheel::nowMs());
+    RequestParser parser(&engine, &auth, pool, config.chunk_size * 1024, mapped, config.readahead);
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1)
+    std::vector<Worker*> workers;
+    for (int i = 0; i < config.threads; i++)
     {
-        perror("opening stream socket");
-        exit(1);
+        Reactor *reactor = createReactor(config.backend);
+        if (reactor == nullptr)
+            exit(1);
+        Worker *worker = new Worker(i, reactor, &parser, config);
+        if (worker->openListener() != 0)
+            exit(1);
+        workers.push_back(worker);
     }
-    nfds = sock + 1;
 
-    // zgub denerwuja ̨cy komunikat bł ̨edu "Address already in use"
-    int yes = 1;
-    if (setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(int)) == -1)
-    {
-        perror("setsockopt");
-        exit(1);
-      }
+    // Worker 0 runs on the main thread
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers.size(); i++)
+        threads.push_back(std::thread(&Worker::run, workers[i]));
+    workers[0]->run();
 
-    /* dowiaz adres do gniazda */
+    /*
+     * gniazdo sock nie zostanie nigdy zamkniete jawnie,
+     * jednak wszystkie deskryptory zostana zamkniete gdy proces
+     * zostanie zakonczony (np w wyniku wystapienia sygnalu)
+     */
 
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(port);
-    if (bind(sock, (struct sockaddr *)&server, sizeof server) == -1)
-    {
-        perror("binding stream socket");
-        exit(1);
-    }
-    /* wydrukuj na konsoli przydzielony port */
-    length = sizeof(server);
-    if (getsockname(sock, (struct sockaddr *)&server, &length) == -1)
+    exit(0);
+}
+
+//
+// Create reactor for given I/O backend name ("epoll" or "uring")
+// Falls back to epoll when io_uring is not available, returns nullptr on failure
+Reactor* createReactor(const string &backend)
+{
+    if (backend == "uring")
     {
-        perror("getting socket name");
-        exit(1);
+        Reactor *reactor = new UringReactor();
+        if (reactor->isValid())
+            return reactor;
+        printf("io_uring backend unavailable, falling back to epoll\n");
+        delete reactor;
     }
-    printf("Socket port #%d\n", ntohs(server.sin_port));
-    /* zacznij przyjmowaæ polaczenia... */
-    listen(sock, BACKLOG_SIZE);
+    else if (backend != "epoll")
+        printf("Unknown I/O backend: %s, using epoll\n", backend.c_str());
+
+    Reactor *reactor = new EpollReactor();
+    if (reactor->isValid())
+        return reactor;
+    delete reactor;
+    return nullptr;
+}
 
-    do
+//
+// Parse command line arguments and set port, listen backlog, path to data and auth root, I/O backend,
+// number of workers, size of blocking I/O thread pool, connection timeouts, send cap, download scheduling policy, rate, chunk size, download source, block cache and envelope cache size, fan-out window and read-ahead window
+// Return 0 on success
+int parseCommandLineArgs(int argc, char **argv, ServerConfig &config)
+{
+    if (argc < 3)
+        return -1; // setting any parameter requires at least 3 arguments
+    for (int i = 1; i < argc; ++i)
     {
-        FD_ZERO(&ready); FD_ZERO(&write_ready);
-        FD_SET(sock, &ready);
-        for(auto c = connections.begin(); c != connections.end(); ++c)
+        if (strcmp(argv[i],"-p")==0)
         {
-            if(c->getSocket() == -1)
-            { // Erase closed connection from connections vector
-                auto next = connections.erase(c);
-                if( next == connections.end())
-                    break; // erase returns iter to next element after erased
-                else
-                    c = next;
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.port = atoi(argv[i + 1]);
+            if (config.port < 0 || config.port > 65536)
+            {
+                perror("Incorrect port numer");
+                exit(-1);
             }
-            c->setReadReady();
-            c->setWriteReady();
+            i++;
+            continue;
         }
-
-        to.tv_sec = 5;
-        to.tv_usec = 0;
-        if ((nactive = select(nfds, &ready, &write_ready, (fd_set *)0, &to)) == -1)
+        else if (strcmp(argv[i],"-b")==0 || strcmp(argv[i],"-backlog")==0)
         {
-            perror("select");
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.backlog = atoi(argv[i + 1]);
+            if (config.backlog < 1)
+            {
+                perror("Incorrect backlog size");
+                exit(-1);
+            }
+            i++;
             continue;
         }
-        if (nactive == 0)
+        else if (strcmp(argv[i],"-d")==0 || strcmp(argv[i],"-data")==0)
         {
-            printf("Timeout, restarting select...\n");
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.data_root = argv[i+1];
+            i++;
             continue;
         }
-        if (FD_ISSET(sock, &ready))
+        else if (strcmp(argv[i], "-a")==0 || strcmp(argv[i],"-auth")==0)
         {
-            msgsock = accept(sock, (struct sockaddr *)0, (socklen_t *)0);
-            if (msgsock == -1)
-                perror("accept");
-            nfds = std::max(nfds, msgsock + 1); /* brak sprawdzenia czy msgsock>MAX_FDS */
-
-            // set SO_KEEPALIVE opt
-            /* Set the option active */
-            int optval = 1;
-            int optlen = sizeof(optval);
-            if(setsockopt(msgsock, SOL_SOCKET, SO_KEEPALIVE, &optval, optlen) < 0) {
-              perror("setsockopt()");
-              close(msgsock);
-              exit(EXIT_FAILURE);
-            }
-            printf("SO_KEEPALIVE set on socket\n");
-
-            socklen_t optlen_t = sizeof(optval);
-
-            if(getsockopt(msgsock, SOL_SOCKET, SO_KEEPALIVE, &optval, &optlen_t) < 0) {
-              perror("getsockopt()");
-              close(msgsock);
-              exit(EXIT_FAILURE);
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
             }
-            printf("SO_KEEPALIVE is %s\n", (optval ? "ON" : "OFF"));
-
-            connections.push_back( Connection(msgsock, nullptr, &ready, &write_ready) );
-            printf("accepted...(active connections = %d)\n", (int)connections.size());
+            config.auth_root = argv[i+1];
+            i++;
+            continue;
         }
-        for (i = 0; i < connections.size(); i++)
+        else if (strcmp(argv[i], "-e")==0 || strcmp(argv[i],"-engine")==0)
         {
-          //std::cout << "NOW CONN = " << connections.size() << std::endl;
-            if (connections[i].isReadReady())
+            if (i + 1 == argc)
             {
-                rval = connections[i].reciveMsg();
-                if (rval == 0)
-                {
-                    printf("Ending connection\n");
-                    connections[i].closeConnection();
-                }
+                perror("Too few arguments");
+                exit(-1);
             }
-
-            if(connections[i].isRequsetComplete())
+            config.backend = argv[i+1];
+            i++;
+            continue;
+        }
+        else if (strcmp(argv[i], "-t")==0 || strcmp(argv[i],"-threads")==0)
+        {
+            if (i + 1 == argc)
             {
-                parser.parseRequest(&connections[i]);
+                perror("Too few arguments");
+                exit(-1);
             }
-
-            if(connections[i].isWriteReady())
+            config.threads = atoi(argv[i+1]);
+            if (config.threads < 1)
             {
-                if (connections[i].responsesPending())
-                {
-                  connections[i].sendResponse();
-                }
-
+                perror("Incorrect number of threads");
+                exit(-1);
             }
+            i++;
+            continue;
         }
-        //sleep(1);
-
-    } while (true);
-    /*
-     * gniazdo sock nie zostanie nigdy zamkniete jawnie,
-     * jednak wszystkie deskryptory zostana zamkniete gdy proces
-     * zostanie zakonczony (np w wyniku wystapienia sygnalu)
-     */
-
-    exit(0);
-}
-
-//
-// Parse command line arguments and set port and path to data and auth root
-// Return 0 on success
-int parseCommandLineArgs(int argc, char **argv, int &port, string &data_root, string &auth_root)
-{
-    port = DEFAULT_PORT;
-    data_root = "data/";
-    auth_root = "auth/";
-
-    if (argc < 3)
-        return -1; // setting any parameter requires at least 3 arguments
-    for (int i = 1; i < argc; ++i)
-    {
-        if (strcmp(argv[i],"-p")==0)
+        else if (strcmp(argv[i], "-w")==0 || strcmp(argv[i],"-iothreads")==0)
         {
             if (i + 1 == argc)
             {
                 perror("Too few arguments");
                 exit(-1);
             }
-            port = atoi(argv[i + 1]);
-            if (port < 0 || port > 65536)
+            config.io_threads = atoi(argv[i+1]);
+            if (config.io_threads < 0)
             {
-                perror("Incorrect port numer");
+                perror("Incorrect number of I/O threads");
                 exit(-1);
             }
             i++;
             continue;
         }
-        else if (strcmp(argv[i],"-d")==0 || strcmp(argv[i],"-data")==0)
+        else if (strcmp(argv[i], "-idle")==0 || strcmp(argv[i], "-reqtimeout")==0 || strcmp(argv[i], "-stall")==0)
         {
             if (i + 1 == argc)
             {
                 perror("Too few arguments");
                 exit(-1);
             }
-            data_root = argv[i+1];
+            int timeout = atoi(argv[i+1]);
+            if (timeout < 0)
+            {
+                perror("Incorrect timeout");
+                exit(-1);
+            }
+            if (strcmp(argv[i], "-idle")==0)
+                config.idle_timeout = timeout;
+            else if (strcmp(argv[i], "-reqtimeout")==0)
+                config.request_timeout = timeout;
+            else
+                config.stall_timeout = timeout;
             i++;
             continue;
         }
-        else if (strcmp(argv[i], "-a")==0 || strcmp(argv[i],"-auth")==0)
+        else if (strcmp(argv[i], "-sendcap")==0)
         {
             if (i + 1 == argc)
             {
                 perror("Too few arguments");
                 exit(-1);
             }
-            auth_root = argv[i+1];
+            config.send_cap = atoi(argv[i+1]);
+            if (config.send_cap < 4)
+            {
+                perror("Incorrect send cap");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        else if (strcmp(argv[i], "-sched")==0)
+        {
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.scheduler = argv[i+1];
+            if (DownloadScheduler::parsePolicy(config.scheduler) == -1)
+            {
+                perror("Unknown scheduling policy");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        else if (strcmp(argv[i], "-rate")==0)
+        {
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.rate_limit = atoi(argv[i+1]);
+            if (config.rate_limit < 0)
+            {
+                perror("Incorrect rate limit");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        else if (strcmp(argv[i], "-chunk")==0)
+        {
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.chunk_size = atoi(argv[i+1]);
+            if (config.chunk_size < 1 || config.chunk_size * 1024LL > DownloadProcess::MAX_CHUNK_SIZE)
+            {
+                perror("Incorrect chunk size");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        else if (strcmp(argv[i], "-source")==0)
+        {
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.source = argv[i+1];
+            if (config.source != "pread" && config.source != "mmap")
+            {
+                perror("Unknown download source");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        else if (strcmp(argv[i], "-cache")==0)
+        {
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.cache_size = atoi(argv[i+1]);
+            if (config.cache_size < 0)
+            {
+                perror("Incorrect cache size");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        else if (strcmp(argv[i], "-envcache")==0)
+        {
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.envelope_cache_size = atoi(argv[i+1]);
+            if (config.envelope_cache_size < 0)
+            {
+                perror("Incorrect envelope cache size");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        else if (strcmp(argv[i], "-fanout")==0)
+        {
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.fanout_window = atoi(argv[i+1]);
+            if (config.fanout_window < 0)
+            {
+                perror("Incorrect fan-out window");
+                exit(-1);
+            }
+            i++;
+            continue;
+        }
+        else if (strcmp(argv[i], "-readahead")==0)
+        {
+            if (i + 1 == argc)
+            {
+                perror("Too few arguments");
+                exit(-1);
+            }
+            config.readahead = atoi(argv[i+1]);
+            if (config.readahead < 0)
+            {
+                perror("Incorrect read-ahead window");
+                exit(-1);
+            }
             i++;
             continue;
         }
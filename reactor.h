@@ -0,0 +1,141 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <vector>
+#include "utils/sendqueue.h"
+
+//
+// Reactor provides interface for readiness notification of sockets
+// Read interest is registered once per socket and stays armed,
+// write interest is toggled by the owner only while there is something to send.
+// Every socket is registered with a 64-bit token chosen by the owner which is reported back with its events.
+// Ready events are reported with EPOLL* flags regardless of the backend.
+// Completion-based backends (completesIo()) also carry out accepts, receives and sends on their own.
+// Their results come back as events too: listener's EPOLLIN event tells accepted socket in getResult(),
+// EPOLLIN event of attached socket tells number of bytes received into getData() (0 at end of stream)
+// and EPOLLOUT event result of send started with startSend(). Negative results are -errno.
+// They also write files: EPOLLPRI event tells bytes written by write started with startWrite().
+//
+class Reactor
+{
+  public:
+    static const int MAX_EVENTS = 256; // maximum number of events returned by single wait()
+
+  protected:
+    std::vector<struct epoll_event> events;
+    std::vector<int> results; // of completed operations, indexed like events
+    std::vector<const char*> data; // received data of EPOLLIN completions, valid until next wait()
+
+  public:
+    Reactor(): events(MAX_EVENTS), results(MAX_EVENTS, 0), data(MAX_EVENTS, nullptr) {}
+    virtual ~Reactor() {}
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    virtual bool isValid() const = 0;
+    virtual const char* getName() const = 0;
+
+    // Register socket with persistent read interest and optional write interest
+    virtual int add(int fd, uint64_t token, bool write = false) = 0;
+
+    // Change write interest of already registered socket
+    virtual int setWriteInterest(int fd, uint64_t token, bool write) = 0;
+
+    // Drop every registration of socket which has just been closed, its operations in flight are cancelled
+    virtual void forget(int fd) = 0;
+
+    // Wait for events, timeout in milliseconds (-1 blocks)
+    // Returns number of ready events which can be accessed with getToken()/getEvents()
+    virtual int wait(int timeout) = 0;
+
+    uint64_t getToken(int i) const {return events[i].data.u64;}
+    uint32_t getEvents(int i) const {return events[i].events;}
+
+    virtual bool completesIo() const {return false;}
+
+    // Accept connections on listening socket until it is forgotten, every accepted socket is reported by its own event
+    virtual int startAccept(int, uint64_t) {return -1;}
+
+    // Receive data from socket until it is forgotten, socket isn't registered with add()
+    virtual int attach(int, uint64_t) {return -1;}
+
+    // Send data described by batch, only one send of a socket may be in flight
+    virtual int startSend(int, uint64_t, SendQueue::Batch&&) {return -1;}
+
+    // Write data to file at offset, reactor keeps data and file until the write completes
+    virtual int startWrite(const SendQueue::File&, unsigned long long, std::string&&, uint64_t) {return -1;}
+
+    int getResult(int i) const {return results[i];}
+    const char* getData(int i) const {return data[i];}
+};
+
+//
+// EpollReactor is a thin wrapper around epoll instance
+//
+class EpollReactor : public Reactor
+{
+  private:
+    int epfd;
+
+  public:
+    EpollReactor()
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd == -1)
+            perror("epoll_create1");
+    }
+
+    ~EpollReactor()
+    {
+        if (epfd != -1)
+            close(epfd);
+    }
+
+    bool isValid() const {return epfd != -1;}
+    const char* getName() const {return "epoll";}
+
+    int add(int fd, uint64_t token, bool write = false)
+    {
+        return control(EPOLL_CTL_ADD, fd, token, write);
+    }
+
+    int setWriteInterest(int fd, uint64_t token, bool write)
+    {
+        return control(EPOLL_CTL_MOD, fd, token, write);
+    }
+
+    // Closing socket removes it from epoll set, nothing to do
+    void forget(int) {}
+
+    int wait(int timeout)
+    {
+        int n = epoll_wait(epfd, events.data(), (int)events.size(), timeout);
+        if (n == -1 && errno != EINTR)
+            perror("epoll_wait");
+        return n;
+    }
+
+  private:
+    int control(int op, int fd, uint64_t token, bool write)
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        if (write)
+            ev.events |= EPOLLOUT;
+        ev.data.u64 = token;
+        if (epoll_ctl(epfd, op, fd, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            return -1;
+        }
+        return 0;
+    }
+};
+
+#endif //REACTOR_H
@@ -4,6 +4,10 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "utils/base644.h"
 #include "auth_strategy/authstrategy.hpp"
 #include <boost/filesystem.hpp>
@@ -26,13 +30,24 @@ public:
   {
     this->data_root = data_root;
     this->auth_root = auth_root;
+    this->auth = nullptr;
   }
-  RequestEngine(const char *data_root, const char *auth_root) : data_root(data_root), auth_root(auth_root)
+  RequestEngine(const char *data_root, const char *auth_root) : data_root(data_root), auth_root(auth_root), auth(nullptr)
   {
   }
 
   string getDataRoot() const {return data_root;}
 
+  string uploadPath(const string &name, const string &path) const {return data_root + "/" + path + "/" + name;}
+
+  // Lock users file for the time of operation, the lock is shared with AuthStrategy
+  std::unique_lock<std::recursive_mutex> lockUsers()
+  {
+    if (auth == nullptr)
+      return std::unique_lock<std::recursive_mutex>();
+    return std::unique_lock<std::recursive_mutex>(auth->getMutex());
+  }
+
     RequestEngine(string& data_root, string& auth_root, AuthStrategy *auth)
     {
         this->data_root = data_root;
@@ -44,6 +59,7 @@ public:
 
     int createUser(const string &username, const string &password, const string &publicLimit, const string &privateLimit, const string& pubUsed = "0", const string privUsed = "0")
     {
+      std::unique_lock<std::recursive_mutex> lock = lockUsers();
       try
       {
         std::ofstream usersFile;
@@ -79,6 +95,7 @@ public:
 
     int deleteUser(const string &username)
     {
+      std::unique_lock<std::recursive_mutex> lock = lockUsers();
       try
       {
         std::ifstream usersFile;
@@ -127,6 +144,7 @@ public:
 
     int alterUser(const string &username, const string &password, const string &pubLimit, const string &privLimit)
     {
+      std::unique_lock<std::recursive_mutex> lock = lockUsers();
       try
       {
         // find user
@@ -191,7 +209,19 @@ public:
       {
         // Decode
         string decoded = base64_decode(dataEncoded);
+        return uploadRawFile(name, path, decoded);
+      }
+      catch (...)
+      {
+        return false;
+      }
+    }
 
+    // Append already decoded data to uploaded file
+    bool uploadRawFile(string &name, string path, const string &decoded)
+    {
+      try
+      {
         // Parse path
         string myPath = path;
         string directory;
@@ -213,7 +243,7 @@ public:
 
         // Save
         std::cout << "PATH UPL: " << data_root << path << "/temp_" << name << std::endl;
-        std::ofstream file(data_root + "/" + path + "/" + name, std::ios::binary | std::ios::app);
+        std::ofstream file(uploadPath(name, path), std::ios::binary | std::ios::app);
         file << decoded;
         file.close();
         return true;
@@ -225,6 +255,24 @@ public:
 
     }
 
+    // Open uploaded file for appending with writes at given offsets, size tells where data is appended
+    // Returns descriptor or -1
+    int openUpload(const string &name, const string &path, unsigned long long &size)
+    {
+      std::cout << "PATH UPL: " << data_root << path << "/temp_" << name << std::endl;
+      struct stat st;
+      int fd = open(uploadPath(name, path).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+      if (fd == -1 || fstat(fd, &st) == -1)
+      {
+        perror("open upload");
+        if (fd != -1)
+          close(fd);
+        return -1;
+      }
+      size = st.st_size;
+      return fd;
+    }
+
     bool finishUpload(string &path, string &name)
     {
       // rename file
@@ -362,6 +410,7 @@ public:
 
   User* findUser(const string &username)
   {
+    std::unique_lock<std::recursive_mutex> lock = lockUsers();
     std::ifstream usersFile;
     usersFile.open(auth_root + "users.auth");
 
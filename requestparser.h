@@ -9,16 +9,111 @@
 #include "auth_strategy/authstrategy.hpp"
 #include "requestengine.hpp"
 #include "connection.h"
+#include "completionqueue.h"
+#include "utils/threadpool.h"
+#include "utils/task.h"
 #include <exception>
 #include <stdio.h>
 #include <unordered_map>
 #include <utility>
+#include <functional>
+#include <coroutine>
+#include <memory>
+#include <sys/stat.h>
 
 #define RESPONSE_BAD_REQUEST "{ \"type\":\"RESPONSE\", \"code\":400, \"data\":\"Bad request\"}"
 #define RESPONSE_SERVER_ERROR "{ \"type\":\"RESPONSE\", \"code\":500, \"data\":\"Internal server error\"}"
 #define RESPONSE_UNAUTHORIZED "{ \"type\":\"RESPONSE\", \"command\":\"AUTH\", \"code\":401, \"data\":\"Unauthorized\"}"
+#define RESPONSE_SERVER_BUSY "{ \"type\":\"RESPONSE\", \"code\":503, \"data\":\"Server busy\"}"
+
+//
+// Awaitable which runs job on thread pool and resumes coroutine with its result
+// Result travels through connection's completion queue, so coroutine is always resumed on the event loop thread
+// Without pool (or completion queue) job runs inline and coroutine isn't suspended
+//
+class BlockingJob
+{
+  public:
+    using string = std::string;
+
+  private:
+    ThreadPool *pool;
+    Connection *conn;
+    std::function<string()> job;
+    bool queued;
+
+  public:
+    BlockingJob(ThreadPool *pool, Connection *conn, std::function<string()> job):
+      pool(pool), conn(conn), job(job), queued(false) {}
+
+    bool await_ready() const {return pool == nullptr || conn->getCompletionQueue() == nullptr;}
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        CompletionQueue *completions = conn->getCompletionQueue();
+        uint64_t id = conn->getId();
+        std::function<string()> job = this->job;
+        queued = pool->submit([job, completions, id]()
+        {
+            string res;
+            try
+            {
+                res = job();
+            }
+            catch (...)
+            {
+                res = RESPONSE_SERVER_ERROR;
+            }
+            completions->post(Completion(id, res));
+        });
+        if (!queued)
+            return false; // resume right away with busy response
+        conn->startJob(handle);
+        return true;
+    }
 
-extern std::unordered_map<std::string, Connection*> activeUploads;//maps path to Connections witch uplad the file
+    string await_resume() const
+    {
+        if (await_ready())
+            return job();
+        if (!queued)
+            return RESPONSE_SERVER_BUSY;
+        return conn->getJobResult();
+    }
+};
+
+//
+// Awaitable which appends data to uploaded file with write of completion-based reactor
+// Write completes on the event loop as EPOLLPRI event of the connection, it is awaited like blocking job
+// Resumes coroutine with bytes written or -errno
+//
+class FileWrite
+{
+  private:
+    Connection *conn;
+    Connection::Upload *upload;
+    std::string data;
+    bool started;
+
+  public:
+    FileWrite(Connection *conn, Connection::Upload *upload, std::string &&data):
+      conn(conn), upload(upload), data(std::move(data)), started(false) {}
+
+    bool await_ready() const {return false;}
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        size_t length = data.size();
+        started = conn->getReactor()->startWrite(upload->file, upload->offset, std::move(data), conn->getId()) == 0;
+        if (!started)
+            return false;
+        upload->offset += length;
+        conn->startJob(handle);
+        return true;
+    }
+
+    int await_resume() const {return started ? conn->getWriteResult() : -EIO;}
+};
 
 class RequestParser
 {
@@ -29,12 +124,21 @@ class RequestParser
   private:
     AuthStrategy *auth;
     RequestEngine *engine;
+    ThreadPool *pool; // runs blocking engine operations, nullptr runs them inline
+    int chunk_size; // bytes of file data in one base64 DWL response
+    bool mapped; // base64 downloads encode from shared file mappings
+    int readahead; // packages base64 downloads read ahead on the pool, 0 reads them on the event loop
 
   public:
-    RequestParser(RequestEngine *engine, AuthStrategy *auth_strategy)
+    RequestParser(RequestEngine *engine, AuthStrategy *auth_strategy, ThreadPool *pool = nullptr,
+                  int chunk_size = DownloadProcess::DEFAULT_CHUNK_SIZE, bool mapped = false, int readahead = 0)
     {
         this->engine = engine;
         this->auth = auth_strategy;
+        this->pool = pool;
+        this->chunk_size = chunk_size;
+        this->mapped = mapped;
+        this->readahead = readahead;
     }
 
     //
@@ -82,6 +186,195 @@ class RequestParser
     }
 
   private:
+    //
+    // Run blocking job on the pool, its result is queued as response when it completes
+    // Returns "" when job was handed to respondLater(), otherwise response to be sent right away
+    //
+    string runBlocking(Connection *conn, std::function<string()> job)
+    {
+        if (pool == nullptr || conn->getCompletionQueue() == nullptr)
+            return job();
+        respondLater(conn, job);
+        return "";
+    }
+
+    Task respondLater(Connection *conn, std::function<string()> job)
+    {
+        string res = co_await BlockingJob(pool, conn, job);
+        if (res != "")
+            conn->setResponse(res + "\n");
+    }
+
+    //
+    // Download coroutine: queues next package of chunks each time worker's scheduler gives it a turn,
+    // until whole file is queued or download is aborted. Priority is its weight in the scheduler
+    // Download process lives in coroutine frame, connection destroys suspended frame when it is closed
+    // File is opened on the pool first, unless source opened already is given
+    //
+    Task download(Connection *conn, string path, int priority, bool binary, uint32_t stream,
+                  unsigned long long offset, unsigned long long length, string version, int codec,
+                  int segment = -1, int segments = 1, std::shared_ptr<int> segments_left = nullptr,
+                  std::shared_ptr<DownloadProcess::Source> source = nullptr)
+    {
+        DownloadProcess dwlProc(path, conn, priority, binary, stream, chunk_size, mapped);
+        if (source == nullptr)
+        {
+            source = std::make_shared<DownloadProcess::Source>();
+            if (co_await openSource(conn, path, source) != "")
+            {
+                dwlProc.putErrorResponse(503, "Server busy.");
+                co_return;
+            }
+        }
+        dwlProc.setSource(source);
+        dwlProc.setRange(offset, length, version);
+        if (segment >= 0)
+            dwlProc.setSegment(segment, segments, segments_left);
+        dwlProc.setReadAhead(pool, readahead);
+        dwlProc.setCompression(codec);
+        conn->pushDownloadProcess(&dwlProc);
+
+        // Push first package of data
+        int more = dwlProc.putNextPackage();
+        while (more)
+        {
+            co_await conn->sendTurn(&dwlProc);
+            if (dwlProc.isAborted()) // already removed from connection
+                co_return;
+            more = dwlProc.putNextPackage();
+        }
+        conn->removeDownloadProcess(&dwlProc);
+    }
+
+    //
+    // Split range of file into up to count segments and start download coroutine for each of them
+    // Segments are served concurrently on the stream of DWL request and scheduled as separate downloads,
+    // chunks tell their offset and segment so client can write them in place. Segment boundaries are page
+    // aligned and ranges too small for count segments of MIN_SEGMENT_BYTES are split into fewer.
+    // File is opened once on the pool, every segment reads it through the same descriptor.
+    //
+    Task downloadSegments(Connection *conn, string path, int priority, bool binary, uint32_t stream,
+                          unsigned long long offset, unsigned long long length, string version, int codec, int count)
+    {
+        std::shared_ptr<DownloadProcess::Source> source = std::make_shared<DownloadProcess::Source>();
+        if (co_await openSource(conn, path, source) != "")
+        {
+            DownloadProcess(path, conn, priority, binary, stream, chunk_size, mapped).putErrorResponse(503, "Server busy.");
+            co_return;
+        }
+        unsigned long long size = source->file != nullptr ? source->st.st_size : 0;
+        unsigned long long end = (length > 0 && offset + length < size) ? offset + length : size;
+        unsigned long long total = end > offset ? end - offset : 0;
+        if ((unsigned long long)count > total / DownloadProcess::MIN_SEGMENT_BYTES)
+            count = total / DownloadProcess::MIN_SEGMENT_BYTES;
+        if (count < 1)
+            count = 1; // empty or missing file, one segment reports it
+
+        unsigned long long segment_length = (total / count + 4095) & ~4095ULL;
+        std::shared_ptr<int> segments_left = std::make_shared<int>(count);
+        for (int i = 0; i < count; i++)
+        {
+            unsigned long long start = offset + i * segment_length;
+            // Last segment takes the rest of requested range, 0 keeps it open to the end of file
+            unsigned long long part_length = (i + 1 < count) ? segment_length : (length > 0 ? offset + length - start : 0);
+            download(conn, path, priority, binary, stream, start, part_length, version, codec, i, count, segments_left, source);
+        }
+    }
+
+    //
+    // Awaitable opening file of download into source on the pool
+    // Resumes with "" when source is filled in, even for file which can't be opened, otherwise with busy response
+    //
+    BlockingJob openSource(Connection *conn, string path, std::shared_ptr<DownloadProcess::Source> source)
+    {
+        return BlockingJob(pool, conn, [path, source]() -> string
+        {
+            DownloadProcess::open(path, *source);
+            return "";
+        });
+    }
+
+    //
+    // Append chunk of UPL to its file with write of completion-based reactor, file stays open until UPLFIN
+    // File is opened and chunk decoded on the pool first when needed, raw chunks of open file go to the ring
+    // right away. Nothing is sent when chunk is written, like when it is saved by engine
+    //
+    Task uploadChunk(Connection *conn, string path, string name, string data, bool has_raw, int codec)
+    {
+        string key = path + "/" + name;
+        if (conn->findUpload(key) == nullptr || !has_raw || codec != Compression::CODEC_NONE)
+        {
+            struct Chunk
+            {
+                string data;
+                SendQueue::File file; // opened file, nullptr when it was open already
+                unsigned long long size = 0;
+            };
+            std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+            chunk->data = std::move(data);
+            bool open = conn->findUpload(key) != nullptr;
+            std::function<string()> job = [this, chunk, path, name, has_raw, codec, open]() -> string
+            {
+                if (codec != Compression::CODEC_NONE)
+                {
+                  string packed = has_raw ? std::move(chunk->data) : base64_decode(chunk->data);
+                  if (!Compression::decompress(codec, packed, DownloadProcess::MAX_CHUNK_SIZE, chunk->data))
+                    return RESPONSE_BAD_REQUEST;
+                  compressionStats.add(codec, true, chunk->data.size(), packed.size());
+                }
+                else if (!has_raw)
+                  chunk->data = base64_decode(chunk->data);
+                if (open)
+                  return "";
+                int fd = engine->openUpload(name, path, chunk->size);
+                if (fd == -1)
+                  return RESPONSE_SERVER_ERROR;
+                chunk->file = std::make_shared<FileHandle>(fd);
+                return "";
+            };
+            string res = co_await BlockingJob(pool, conn, job);
+            if (res != "")
+            {
+                conn->setResponse(res + "\n");
+                co_return;
+            }
+            if (chunk->file != nullptr)
+                conn->addUpload(key, chunk->file, chunk->size);
+            data = std::move(chunk->data);
+        }
+        if (data.empty())
+            co_return;
+        int written = co_await FileWrite(conn, conn->findUpload(key), std::move(data));
+        if (written < 0)
+        {
+            printf("UPL write: %s\n", strerror(-written));
+            conn->setResponse(string(RESPONSE_SERVER_ERROR) + "\n");
+        }
+    }
+
+    //
+    // Read optional non-negative integer field of request, given as number or as numeric string
+    // Returns false when field is present but malformed
+    //
+    static bool getOptionalNumber(const json &req, const char *name, unsigned long long &value)
+    {
+        auto it = req.find(name);
+        if (it == req.end())
+            return true;
+        if (it->is_number_unsigned())
+        {
+            value = it->get<unsigned long long>();
+            return true;
+        }
+        if (!it->is_string())
+            return false;
+        const string &str = it->get_ref<const string&>();
+        if (str.empty() || str.size() > 19 || str.find_first_not_of("0123456789") != string::npos)
+            return false;
+        value = std::stoull(str);
+        return true;
+    }
+
     //
     // Check if given permission is authorized to access path in given req
     // Success mean that req conatins "path" field
@@ -128,7 +421,23 @@ class RequestParser
     {
         try
         {
-            json req = json::parse(conn->popRequest());
+            std::string_view frame = conn->popRequest();
+            FrameHeader header = conn->getRequestHeader();
+            if (header.opcode != FrameHeader::REQUEST)
+                return RESPONSE_BAD_REQUEST;
+
+            // FRAME_RAW payload is JSON request, '\0' and raw data
+            std::string_view raw;
+            bool has_raw = (header.flags & FrameHeader::FRAME_RAW) != 0;
+            if (has_raw)
+            {
+                size_t end = frame.find('\0');
+                if (end == std::string_view::npos)
+                    return RESPONSE_BAD_REQUEST;
+                raw = frame.substr(end + 1);
+                frame = frame.substr(0, end);
+            }
+            json req = json::parse(frame.begin(), frame.end());
             string command = req["command"];
             string type = req["type"];
 
@@ -153,7 +462,18 @@ class RequestParser
                 else
                 { //Authorized
                     conn->setUser(user);
-                    return generateResponse(200,cmd, "Welcome "+user->username);
+                    string res = generateResponse(200,cmd, "Welcome "+user->username);
+
+                    // Client may ask for FRAMING_BINARY, this response is the last one in its current framing
+                    if (req.find("framing") != req.end() && req["framing"] == FRAMING_BINARY && conn->getFraming() != FRAMING_BINARY)
+                    {
+                        json res_json = json::parse(res);
+                        res_json["framing"] = FRAMING_BINARY;
+                        conn->setResponse(res_json.dump() + "\n");
+                        conn->setFraming(FRAMING_BINARY);
+                        return "";
+                    }
+                    return res;
                 }
             }
             else if (cmd == "TOUCH")
@@ -163,14 +483,17 @@ class RequestParser
                     return path_access;
                 if(req["name"] == nullptr)
                     return RESPONSE_BAD_REQUEST;
-                string err_msg;
                 string path = req["path"];
                 string name = req["name"];
-                int result  = engine->createFile(path, name, err_msg);
-                if(result < 0)
-                    generateResponse(409,cmd, err_msg);
-
-                return generateResponse(200,cmd, "File created");
+                return runBlocking(conn, [this, path, name]() -> string
+                {
+                    string err_msg;
+                    int result  = engine->createFile(path, name, err_msg);
+                    if(result < 0)
+                        return generateResponse(409, "TOUCH", err_msg);
+
+                    return generateResponse(200, "TOUCH", "File created");
+                });
             }
             else if (cmd == "MKDIR")
             {
@@ -179,44 +502,51 @@ class RequestParser
                     return path_access;
                 if(req["name"] == nullptr)
                     return RESPONSE_BAD_REQUEST;
-                string err_msg;
                 string path = req["path"];
                 string name = req["name"];
-                int result = engine->createDirectory(path, name, err_msg);
-                if(result < 0)
-                    return generateResponse(409, cmd, err_msg);
-                //OK
-                return generateResponse(200,cmd,"Direcory created");
+                return runBlocking(conn, [this, path, name]() -> string
+                {
+                    string err_msg;
+                    int result = engine->createDirectory(path, name, err_msg);
+                    if(result < 0)
+                        return generateResponse(409, "MKDIR", err_msg);
+                    //OK
+                    return generateResponse(200, "MKDIR", "Direcory created");
+                });
             }
             else if( cmd == "LS")
             {
                 string path_access = checkPathAuth(conn, req);
                 if (path_access != "")
                     return path_access;
-                std::vector<string> files, dirs; // containers for ls reult
-                string err_msg;
-
                 string path = req["path"];
-                int result = engine->listDirectory(path, files, dirs, err_msg);
-                if( result < 0)
-                    return generateResponse(409,cmd,err_msg);
-
-                return generateLSResponse(path, files, dirs);
+                return runBlocking(conn, [this, path]() -> string
+                {
+                    std::vector<string> files, dirs; // containers for ls reult
+                    string err_msg;
+                    int result = engine->listDirectory(path, files, dirs, err_msg);
+                    if( result < 0)
+                        return generateResponse(409, "LS", err_msg);
+
+                    return generateLSResponse(path, files, dirs);
+                });
             }
             else if( cmd == "RM")
             {
                 string path_access = checkPathAuth(conn, req);
                 if (path_access != "")
                     return path_access;
-                string err_msg;
-
                 string path = req["path"];
-                int result  = engine->deleteFile(path, err_msg);
-                if(result < 0)
-                    return  generateResponse(409, cmd, err_msg);
-                if(result == 0)
-                    return generateResponse(409, cmd, "Path not found");
-                return generateResponse(200, cmd, path + " deleted");
+                return runBlocking(conn, [this, path]() -> string
+                {
+                    string err_msg;
+                    int result  = engine->deleteFile(path, err_msg);
+                    if(result < 0)
+                        return  generateResponse(409, "RM", err_msg);
+                    if(result == 0)
+                        return generateResponse(409, "RM", "Path not found");
+                    return generateResponse(200, "RM", path + " deleted");
+                });
             }
             else if (cmd == "CREATEUSER")
             {
@@ -228,13 +558,16 @@ class RequestParser
                 string publicLimit = req["public"];
                 string privateLimit = req["private"];
 
-                if (auth->getUserLine(username) != "")
-                    return generateResponse(406, cmd, "Username is already used: " + username);
+                return runBlocking(conn, [this, username, password, publicLimit, privateLimit]() -> string
+                {
+                    if (auth->getUserLine(username) != "")
+                        return generateResponse(406, "CREATEUSER", "Username is already used: " + username);
 
-                if (engine->createUser(username, password, publicLimit, privateLimit) == 0)
-                    return generateResponse(200, cmd, "User created: " + username);
-                else
-                    return generateResponse(409, cmd, "Something went wrong.");
+                    if (engine->createUser(username, password, publicLimit, privateLimit) == 0)
+                        return generateResponse(200, "CREATEUSER", "User created: " + username);
+                    else
+                        return generateResponse(409, "CREATEUSER", "Something went wrong.");
+                });
 
             }
             else if (cmd == "DELETEUSER")
@@ -243,9 +576,12 @@ class RequestParser
                     return RESPONSE_UNAUTHORIZED;
                 // TODO: wylogowac go najpierw
                 string username = req["username"];
-                if (engine->deleteUser(username) == 0)
-                    return generateResponse(200, cmd, "User has been deleted: " + username);
-                return generateResponse(409, cmd, "User has NOT been deleted: " + username);
+                return runBlocking(conn, [this, username]() -> string
+                {
+                    if (engine->deleteUser(username) == 0)
+                        return generateResponse(200, "DELETEUSER", "User has been deleted: " + username);
+                    return generateResponse(409, "DELETEUSER", "User has NOT been deleted: " + username);
+                });
             }
             else if (cmd == "CHUSER")
             {
@@ -257,10 +593,13 @@ class RequestParser
                 string publicLimit = req["public"];
                 string privateLimit = req["private"];
 
-                if (engine->alterUser(username, password, publicLimit, privateLimit) == 0)
-                    return generateResponse(200,cmd, "User altered: " + username);
+                return runBlocking(conn, [this, username, password, publicLimit, privateLimit]() -> string
+                {
+                    if (engine->alterUser(username, password, publicLimit, privateLimit) == 0)
+                        return generateResponse(200, "CHUSER", "User altered: " + username);
 
-                return generateResponse(409, cmd,"User not altered: " + username);
+                    return generateResponse(409, "CHUSER", "User not altered: " + username);
+                });
             }
             else if (cmd == "USER")
             {
@@ -268,20 +607,23 @@ class RequestParser
                   return RESPONSE_UNAUTHORIZED;
 
               string username = req["username"];
-              User *user = engine->findUser(username);
-
-              std::cout << "USER\n";
-              if(user == nullptr)
-                return generateResponse(404, cmd, "User not found.");
-
-              json userJSON = user->toJson();
-              delete user;
-              json res_json;
-              res_json["type"] = "RESPONSE";
-              res_json["command"] = cmd;
-              res_json["code"] = 200;
-              res_json["data"] = userJSON;
-              return res_json.dump();
+              return runBlocking(conn, [this, username]() -> string
+              {
+                User *user = engine->findUser(username);
+
+                std::cout << "USER\n";
+                if(user == nullptr)
+                  return generateResponse(404, "USER", "User not found.");
+
+                json userJSON = user->toJson();
+                delete user;
+                json res_json;
+                res_json["type"] = "RESPONSE";
+                res_json["command"] = "USER";
+                res_json["code"] = 200;
+                res_json["data"] = userJSON;
+                return res_json.dump();
+              });
             }
             else if (cmd == "DWL")
             {
@@ -298,13 +640,53 @@ class RequestParser
               if (priorityInt > 10 || priorityInt < 1)
                 return RESPONSE_BAD_REQUEST;
 
-              // Create download process and push to the conn.activeDownloads list
-              string path2 = engine->getDataRoot() + path;
-              DownloadProcess *dwlProc = new DownloadProcess(path2, conn, priorityInt);
-              conn->pushDownloadProcess(dwlProc);
+              // Optional "mode": "binary" asks for raw file data following JSON headers, "base64" for chunks in JSON
+              // responses (each of them its own frame in FRAMING_BINARY). Default is binary in FRAMING_BINARY.
+              bool binary = conn->getFraming() == FRAMING_BINARY;
+              if (req.find("mode") != req.end())
+              {
+                if (req["mode"] != "binary" && req["mode"] != "base64")
+                  return RESPONSE_BAD_REQUEST;
+                binary = req["mode"] == "binary";
+              }
+
+              // Optional byte range: "offset" and "length" (to the end of file when missing), "version" reported
+              // in first response of previous download makes resumed download fail with 412 when file has changed
+              unsigned long long offset = 0, length = 0;
+              if (!getOptionalNumber(req, "offset", offset) || !getOptionalNumber(req, "length", length))
+                return RESPONSE_BAD_REQUEST;
+              if (req.find("length") != req.end() && length == 0)
+                return RESPONSE_BAD_REQUEST;
+              string version = "";
+              if (req.find("version") != req.end())
+              {
+                if (!req["version"].is_string())
+                  return RESPONSE_BAD_REQUEST;
+                version = req["version"];
+              }
+
+              // Optional "segments" splits range into that many segments served concurrently, see downloadSegments()
+              unsigned long long segments = 1;
+              bool segmented = req.find("segments") != req.end();
+              if (!getOptionalNumber(req, "segments", segments) || segments < 1 || segments > DownloadProcess::MAX_SEGMENTS)
+                return RESPONSE_BAD_REQUEST;
 
-              // Push first package of data
-              dwlProc->putNextPackage(5);
+              // Optional "compression" lists codecs in order of preference ("zstd,zlib"), the first one server has
+              // is used for chunks worth compressing, which tell it in "compression" field. None of them means no compression
+              // Chunks are compressed on the pool only, without I/O threads they are sent uncompressed
+              int codec = Compression::CODEC_NONE;
+              if (req.find("compression") != req.end())
+              {
+                if (!req["compression"].is_string())
+                  return RESPONSE_BAD_REQUEST;
+                codec = Compression::negotiate(req["compression"]);
+              }
+
+              // Start download coroutine, it pushes first package of data right away
+              if (segmented)
+                downloadSegments(conn, engine->getDataRoot() + path, priorityInt, binary, header.stream, offset, length, version, codec, segments);
+              else
+                download(conn, engine->getDataRoot() + path, priorityInt, binary, header.stream, offset, length, version, codec);
 
               std::cout << "DWL [" << path << "] RESPONSE\n";
               return ""; // empty string because there were repsponses pushed already
@@ -346,6 +728,22 @@ class RequestParser
               else
                 return generateResponse(409, cmd, path);
             }
+            else if (cmd == "STATS")
+            {
+              if (!checkAuth(conn))
+                return RESPONSE_UNAUTHORIZED;
+              json res_json;
+              res_json["type"] = "RESPONSE";
+              res_json["command"] = cmd;
+              res_json["code"] = 200;
+              res_json["data"] = stats.toJson();
+              res_json["data"]["cache"] = blockCache.toJson();
+              res_json["data"]["envelopes"] = envelopeCache.toJson();
+              res_json["data"]["fanout"] = fanout.toJson();
+              res_json["data"]["readahead"] = readAheadStats.toJson();
+              res_json["data"]["compression"] = compressionStats.toJson();
+              return res_json.dump();
+            }
             else if (cmd == "UPL")
             {
               // 1. Check permissons
@@ -356,16 +754,46 @@ class RequestParser
               // 2. Get details form request
               string path = req["path"];
               string name = req["name"];
-              string data = req["data"];
+              if (!has_raw && req["data"] == nullptr)
+                return RESPONSE_BAD_REQUEST;
+              string data = has_raw ? string(raw) : string(req["data"]); // raw data needs no decoding
+
+              // Optional "compression" tells codec chunk was compressed with, it is decompressed on the pool
+              int codec = Compression::CODEC_NONE;
+              if (req.find("compression") != req.end())
+              {
+                if (!req["compression"].is_string())
+                  return RESPONSE_BAD_REQUEST;
+                codec = Compression::parseCodec(req["compression"]);
+                if (codec == -1)
+                  return generateResponse(415, cmd, "Unsupported compression");
+              }
 
               // 3. Check if file already exists
               // TODO
 
 
-              if (engine->uploadFile(name, path, data))
+              if (conn->getReactor() != nullptr && conn->getReactor()->completesIo())
+              {
+                uploadChunk(conn, path, name, std::move(data), has_raw, codec);
                 return "";
-              else
-                return RESPONSE_SERVER_ERROR;
+              }
+              return runBlocking(conn, [this, name, path, data, has_raw, codec]() mutable -> string
+              {
+                if (codec != Compression::CODEC_NONE)
+                {
+                  string packed = has_raw ? data : base64_decode(data);
+                  if (!Compression::decompress(codec, packed, DownloadProcess::MAX_CHUNK_SIZE, data))
+                    return RESPONSE_BAD_REQUEST;
+                  compressionStats.add(codec, true, data.size(), packed.size());
+                  has_raw = true;
+                }
+                bool saved = has_raw ? engine->uploadRawFile(name, path, data) : engine->uploadFile(name, path, data);
+                if (saved)
+                  return "";
+                else
+                  return RESPONSE_SERVER_ERROR;
+              });
             }
             else if (cmd == "UPLFIN")
             {
@@ -377,10 +805,13 @@ class RequestParser
               // 2. Get details form request
               string path = req["path"];
               string name = req["name"];
-              if (engine->finishUpload(path, name))
-                return generateResponse(200, cmd, path + "/" + name);
-              else
-                return generateResponse(409, cmd, path + "/" + name);
+              conn->finishUpload(path + "/" + name); // file written by reactor is closed
+              return runBlocking(conn, [this, path, name]() mutable -> string
+              {
+                  if (engine->finishUpload(path, name))
+                    return generateResponse(200, "UPLFIN", path + "/" + name);
+                  return generateResponse(409, "UPLFIN", path + "/" + name);
+              });
             }
         }
         catch (json::parse_error)
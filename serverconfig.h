@@ -0,0 +1,61 @@
+#ifndef SERVERCONFIG_H
+#define SERVERCONFIG_H
+
+#include <string>
+#include <sys/socket.h>
+
+#define DEFAULT_PORT 8888
+#define DEFAULT_BACKEND "epoll"
+#define DEFAULT_BACKLOG SOMAXCONN // maximum number of waiting connections, used in listen
+#define DEFAULT_THREADS 1
+#define DEFAULT_IO_THREADS 4
+#define DEFAULT_IO_QUEUE 1024
+#define DEFAULT_IDLE_TIMEOUT 300 // seconds
+#define DEFAULT_REQUEST_TIMEOUT 30 // seconds
+#define DEFAULT_STALL_TIMEOUT 120 // seconds
+#define DEFAULT_SEND_CAP 64 // KB of queued responses per connection
+#define DEFAULT_SCHEDULER "drr"
+#define DEFAULT_CHUNK_SIZE 1 // KB of file data in one base64 DWL response
+#define DEFAULT_SOURCE "pread"
+#define DEFAULT_CACHE_SIZE 64 // MB of block cache shared by downloads
+#define DEFAULT_ENVELOPE_CACHE_SIZE 64 // MB of encoded DWL responses shared by downloads
+#define DEFAULT_FANOUT_WINDOW 16 // packages kept for downloads of the same file going in step
+#define DEFAULT_READAHEAD 4 // packages a base64 download reads ahead on I/O threads, window grows from it
+
+//
+// ServerConfig holds options given in command line
+//
+struct ServerConfig
+{
+    using string = std::string;
+
+    int port = DEFAULT_PORT;
+    int backlog = DEFAULT_BACKLOG;
+    string data_root = "data/"; // path to directory with users catalogues
+    string auth_root = "auth/"; // path to directory with auth files
+    string backend = DEFAULT_BACKEND; // I/O backend: "epoll" or "uring"
+    // Number of workers, each with its own listener and event loop
+    // Workers help only up to the number of CPU cores, more of them just share the same cores
+    int threads = DEFAULT_THREADS;
+    int io_threads = DEFAULT_IO_THREADS; // size of thread pool for blocking filesystem operations, 0 runs them inline
+    int io_queue = DEFAULT_IO_QUEUE; // maximum number of blocking operations waiting for the pool
+    // Timeouts in seconds, 0 disables given timeout
+    int idle_timeout = DEFAULT_IDLE_TIMEOUT; // connection without any reads or sends is closed
+    int request_timeout = DEFAULT_REQUEST_TIMEOUT; // time limit for reciving whole request once it started
+    int stall_timeout = DEFAULT_STALL_TIMEOUT; // connection with pending responses which can't be sent is closed
+    // Backpressure: production stops at send_cap KB of queued responses and resumes below a quarter of it
+    int send_cap = DEFAULT_SEND_CAP;
+    // Download scheduling policy: "drr" shares bandwidth between users, connections and priorities,
+    // "srpt" sends the download with the fewest bytes left first
+    // Every worker schedules only its own connections, shares are kept among connections of the same worker
+    string scheduler = DEFAULT_SCHEDULER;
+    int rate_limit = 0; // KB/s of download data of the whole server, workers take it from one shared bucket, 0 is unlimited
+    int chunk_size = DEFAULT_CHUNK_SIZE; // KB, from 1 to 16384
+    string source = DEFAULT_SOURCE; // base64 downloads read files with "pread" or encode from shared "mmap" mappings
+    int cache_size = DEFAULT_CACHE_SIZE; // MB of block cache used by "pread" source, 0 disables it
+    int envelope_cache_size = DEFAULT_ENVELOPE_CACHE_SIZE; // MB of cache of base64 DWL responses, 0 disables it
+    int fanout_window = DEFAULT_FANOUT_WINDOW; // packages of single-flight group of downloads, 0 disables it
+    int readahead = DEFAULT_READAHEAD; // packages read ahead by "pread" source on I/O threads, 0 reads on event loop
+};
+
+#endif //SERVERCONFIG_H
@@ -0,0 +1,69 @@
+import socket
+import sys
+from framing import FramedConnection, FLAG_FIN
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+PATH = 'root/public/medium.bin' # big enough not to be queued whole before DWLABORT arrives
+
+# Starts binary mode DWL of PATH in FRAMING_BINARY, aborts it and checks that the stream of the download
+# ends with FIN frame carrying response 410, while DWLABORT is answered on its own stream.
+# Then does the same with segmented DWL: every segment has to end (with 410 or 200 when it was
+# queued whole already) and only the last ending carries FIN.
+# Usage: python3 abort_dwl.py [addr] [port] [path]
+
+def check(name, cond):
+    print('%-40s %s' % (name, 'OK' if cond else 'FAILED'))
+    return cond
+
+def abort_binary_stream():
+    conn = FramedConnection(socket.create_connection((ADDR, PORT)))
+    if conn.auth(USER, PASS).get('code') != 200:
+        raise Exception('AUTH failed')
+    dwl = conn.request({'command':'DWL', 'path':PATH, 'priority':'5', 'mode':'binary'})
+    abort = conn.request({'command':'DWLABORT', 'path':PATH})
+    aborted = None
+    last = None
+    while last is None:
+        stream, flags, res, _ = conn.response()
+        if stream == abort:
+            aborted = res
+        elif stream == dwl and flags & FLAG_FIN:
+            last = res
+    conn.sock.close()
+    ok = check('DWLABORT answered 200', aborted is not None and aborted.get('code') == 200)
+    ok &= check('download stream ends with 410 FIN', last.get('code') == 410)
+    return ok
+
+def abort_segmented_stream(segments):
+    conn = FramedConnection(socket.create_connection((ADDR, PORT)))
+    if conn.auth(USER, PASS).get('code') != 200:
+        raise Exception('AUTH failed')
+    dwl = conn.request({'command':'DWL', 'path':PATH, 'priority':'5', 'mode':'binary', 'segments':segments})
+    conn.request({'command':'DWLABORT', 'path':PATH})
+    ended = set()
+    count = 0
+    fin = False
+    while not fin:
+        stream, flags, res, _ = conn.response()
+        if stream != dwl or res.get('code') == 206:
+            continue
+        ended.add(res.get('segment'))
+        count = res.get('segments', 1)
+        fin = flags & FLAG_FIN
+    conn.sock.close()
+    return check('every segment ended before FIN', len(ended) == count)
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        PATH = sys.argv[3]
+    ok = abort_binary_stream()
+    ok &= abort_segmented_stream(4)
+    print('ABORT OK' if ok else 'ABORT FAILED')
+    sys.exit(0 if ok else 1)
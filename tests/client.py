@@ -1,7 +1,13 @@
 import socket
 import sys
+import os
 import json # for request/response parsing
 import base64 # for file decoding
+import zlib # for compressed chunks
+try:
+    import zstandard # optional, only for servers built with zstd
+except ImportError:
+    zstandard = None
 
 REQERROR = -1
 DWLFIN = 0
@@ -17,6 +23,10 @@ class Client:
         self.username = ""
         self.id = id
         self.dwl_fname = "stress_dwl_"+str(id) # unique filename for DWL test
+        self.dwl_offset = 0 # file offset of next chunk, chunks which don't tell it follow previous one
+        self.dwl_ended = 0 # segments of segmented DWL which ended
+        self.bytes_received = 0 # bytes read from socket, i.e. on the wire
+        self.bytes_sent = 0
 
     def login(self, username, pwd):
         """Send AUTH request to sock"""
@@ -29,16 +39,46 @@ class Client:
         req += '\0'
         self.sock.sendall(req.encode())
 
-    def send_dwl_req(self,path, priority):
-        """Send AUTH request to sock"""
-        req = json.dumps(
-            {'type':'REQUEST',
+    def send_dwl_req(self,path, priority, offset = None, length = None, segments = None, compression = None):
+        """Send DWL request to sock, segments asks for file split into segments downloaded concurrently,
+        compression lists codecs client can decompress in order of preference (e.g. 'zstd,zlib')"""
+        req = {'type':'REQUEST',
             'command':'DWL',
             'path':path,
             'priority':str(priority)}
-        )
-        req+= '\0'
-        self.sock.sendall(req.encode())
+        if offset is not None:
+            req['offset'] = offset
+        if length is not None:
+            req['length'] = length
+        if segments is not None:
+            req['segments'] = segments
+        if compression is not None:
+            req['compression'] = compression
+        self.dwl_ended = 0
+        self.send(req)
+
+    def send_upl_req(self, path, name, chunk, compression = None):
+        """Send UPL request with one chunk of file, compressed with given codec when it shrinks by 1/8 at least"""
+        req = {'type':'REQUEST',
+            'command':'UPL',
+            'path':path,
+            'name':name}
+        if compression is not None and compression != 'none':
+            packed = compress(compression, chunk)
+            if len(packed) < len(chunk) - len(chunk) // 8:
+                req['compression'] = compression
+                chunk = packed
+        req['data'] = base64.b64encode(chunk).decode()
+        self.send(req)
+
+    def send_uplfin_req(self, path, name):
+        """Send UPLFIN request which moves uploaded file in place"""
+        self.send({'type':'REQUEST', 'command':'UPLFIN', 'path':path, 'name':name})
+
+    def send(self, req):
+        req = (json.dumps(req) + '\0').encode()
+        self.bytes_sent += len(req)
+        self.sock.sendall(req)
     
     def recive_msg(self):
         """ Recive message from sock"""
@@ -46,6 +86,7 @@ class Client:
         if msg is None:
             self.sock.close()
             return
+        self.bytes_received += len(msg)
         msg = msg.decode()
         for c in msg:
             if c=='\n':
@@ -66,13 +107,22 @@ class Client:
             return REQERROR
         if res.get('command') is not None:
             if res['command'] == 'DWL':
-                if res['code'] == 200:
+                if res['code'] != 206:
+                    # 200 ends download, other codes end it early (410 after DWLABORT)
+                    # Segmented DWL ends when all of its segments did
+                    self.dwl_ended += 1
+                    if self.dwl_ended < res.get('segments', 1):
+                        return DWL
                     return DWLFIN
                 encoded_chunk = res['data']
-                decoded_chunk = base64.b64decode(encoded_chunk)
-                f=open('dwl/'+self.dwl_fname, 'ab')
-                f.write(bytearray(decoded_chunk))
-                f.close()
+                decoded_chunk = decompress(res.get('compression'), base64.b64decode(encoded_chunk))
+                if res.get('offset') is not None:
+                    self.dwl_offset = res['offset']
+                # Chunks of segments come interleaved, each one is written at its offset
+                fd = os.open('dwl/'+self.dwl_fname, os.O_WRONLY | os.O_CREAT, 0o644)
+                os.pwrite(fd, decoded_chunk, self.dwl_offset)
+                os.close(fd)
+                self.dwl_offset += len(decoded_chunk)
                 return DWL
             elif res['command'] == 'AUTH':
                 return AUTH_OK
@@ -85,3 +135,21 @@ class Client:
                     
 
 
+
+def compress(codec, data):
+    """Compress chunk of UPL request, data of codecs client doesn't have is left as it is"""
+    if codec == 'zlib':
+        return zlib.compress(data, 1)
+    if codec == 'zstd' and zstandard is not None:
+        return zstandard.ZstdCompressor(level=1).compress(data)
+    return data
+
+def decompress(codec, data):
+    """Decompress chunk of DWL response, chunks without codec were sent as they are"""
+    if codec is None:
+        return data
+    if codec == 'zlib':
+        return zlib.decompress(data)
+    if codec == 'zstd':
+        return zstandard.ZstdDecompressor().decompress(data)
+    raise Exception('unknown codec ' + codec)
@@ -0,0 +1,114 @@
+import os
+import socket
+import sys
+import time
+import base64
+import hashlib
+import threading
+from dwl_bench import Responses, request, read_stats, report_percentiles
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+PATH = 'root/public/huge.bin'
+FILE = 'data/root/public/huge.bin' # local copy of PATH, evicted from page cache before downloads start
+CLIENTS = 4
+PING_INTERVAL = 0.01 # seconds between LS requests of probe connection
+
+# Cold-file downloads: FILE is evicted from page cache, then CLIENTS connections download PATH in base64
+# mode while another connection sends LS every PING_INTERVAL. Reports download throughput, LS latency
+# seen by the probe and server's loop lag percentiles and read-ahead counters from STATS.
+# Loop lag is counted since server start, so run it against a freshly started server and compare
+# server run with -readahead 0 (reads on event loop) with default read-ahead. Start server with
+# -cache 0 or a file bigger than block cache, otherwise blocks read before are in memory already.
+# Usage: python3 cold_dwl.py [addr] [port] [path] [local file] [clients]
+
+def login():
+    sock = socket.create_connection((ADDR, PORT))
+    responses = Responses(sock)
+    request(sock, {'command':'AUTH', 'username':USER, 'password':PASS})
+    if responses.next().get('code') != 200:
+        raise Exception('AUTH failed')
+    return sock, responses
+
+def evict(path):
+    fd = os.open(path, os.O_RDONLY)
+    os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    os.close(fd)
+
+class Download(threading.Thread):
+    def __init__(self):
+        threading.Thread.__init__(self, daemon=True)
+        self.sock, self.responses = login()
+        self.digest = hashlib.md5()
+        self.code = None
+
+    def run(self):
+        request(self.sock, {'command':'DWL', 'path':PATH, 'priority':'5'})
+        while True:
+            res = self.responses.next()
+            if res.get('command') != 'DWL':
+                continue
+            if res.get('code') != 206:
+                self.code = res.get('code')
+                break
+            self.digest.update(base64.b64decode(res['data']))
+        self.sock.close()
+
+def probe(stop, latencies):
+    sock, responses = login()
+    while not stop.is_set():
+        start = time.time()
+        request(sock, {'command':'LS', 'path':'root'})
+        while responses.next().get('command') != 'LS':
+            pass
+        latencies.append(time.time() - start)
+        time.sleep(PING_INTERVAL)
+    sock.close()
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        PATH = sys.argv[3]
+    if len(sys.argv) > 4:
+        FILE = sys.argv[4]
+    if len(sys.argv) > 5:
+        CLIENTS = int(sys.argv[5])
+    with open(FILE, 'rb') as f:
+        expected = hashlib.md5(f.read()).hexdigest()
+    size = os.path.getsize(FILE)
+    evict(FILE)
+
+    downloads = [Download() for i in range(CLIENTS)]
+    stop = threading.Event()
+    latencies = []
+    prober = threading.Thread(target=probe, args=(stop, latencies), daemon=True)
+    prober.start()
+    start = time.time()
+    for d in downloads:
+        d.start()
+    for d in downloads:
+        d.join()
+    elapsed = time.time() - start
+    stop.set()
+    prober.join()
+
+    sock, responses = login()
+    stats = read_stats(sock, responses)
+    sock.close()
+
+    ok = all(d.code == 200 and d.digest.hexdigest() == expected for d in downloads)
+    print('%d cold downloads of %.1f MB: %.2fs, %.2f MB/s' % (CLIENTS, size / 1e6, elapsed, CLIENTS * size / elapsed / 1e6))
+    if latencies:
+        report_percentiles('LS latency', latencies)
+    lag = stats.get('loop_lag_us', {})
+    print('loop lag      n=%d  p50<%dus  p90<%dus  p99<%dus  p999<%dus  max=%dus' % (lag.get('samples', 0),
+          lag.get('p50', 0), lag.get('p90', 0), lag.get('p99', 0), lag.get('p999', 0), lag.get('max', 0)))
+    if 'readahead' in stats:
+        print('readahead     %s' % ', '.join('%s %d' % (k, v) for k, v in stats['readahead'].items()))
+    print('COLD OK' if ok else 'COLD FAILED')
+    sys.exit(0 if ok else 1)
@@ -0,0 +1,73 @@
+import socket
+import threading
+import time
+import json
+import sys
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+CLIENTS = 200 # number of clients connecting at once
+
+# Opens CLIENTS connections at the same moment and measures for each of them:
+#  - connect time: until TCP handshake is completed (SYN landed in the backlog)
+#  - establishment time: until server accepted connection and answered AUTH request
+# Usage: python3 connect_storm.py [addr] [port] [clients]
+
+def percentile(values, p):
+    if len(values) == 0:
+        return 0.0
+    values = sorted(values)
+    idx = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[idx]
+
+def report(name, values):
+    ms = [v * 1000 for v in values]
+    print('%-14s n=%d  min=%.2fms  p50=%.2fms  p90=%.2fms  p99=%.2fms  max=%.2fms' % (
+        name, len(ms), min(ms), percentile(ms, 50), percentile(ms, 90), percentile(ms, 99), max(ms)))
+
+def run_client(cli_id, barrier, results, errors):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(30)
+    req = json.dumps({'type':'REQUEST', 'command':'AUTH', 'username':USER, 'password':PASS}) + '\0'
+    try:
+        barrier.wait()
+        start = time.time()
+        sock.connect((ADDR, PORT))
+        connected = time.time()
+        sock.sendall(req.encode())
+        res = b''
+        while b'\n' not in res:
+            chunk = sock.recv(1024)
+            if not chunk:
+                raise Exception('connection closed')
+            res += chunk
+        answered = time.time()
+        results[cli_id] = (connected - start, answered - start)
+    except Exception as e:
+        errors.append((cli_id, str(e)))
+    finally:
+        sock.close()
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        CLIENTS = int(sys.argv[3])
+
+    barrier = threading.Barrier(CLIENTS)
+    results = {}
+    errors = []
+    threads = [threading.Thread(target=run_client, args=(i, barrier, results, errors)) for i in range(CLIENTS)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    if len(results) > 0:
+        report('connect', [r[0] for r in results.values()])
+        report('established', [r[1] for r in results.values()])
+    print('failed connections: %d' % len(errors))
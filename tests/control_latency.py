@@ -0,0 +1,67 @@
+import socket
+import time
+import json
+import sys
+from dwl_bench import Responses, request, report_percentiles
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+PATH = 'root/big.bin' # downloaded over and over in the background
+LS_PATH = 'root'
+MODE = 'base64'
+DURATION = 10 # seconds
+INTERVAL = 0.05 # seconds between LS requests
+
+# Keeps a download of PATH running on a connection and measures latency of LS requests sent on the same
+# connection every INTERVAL, i.e. how long a control response waits behind queued download data
+# Usage: python3 control_latency.py [addr] [port] [path] [mode] [duration]
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        PATH = sys.argv[3]
+    if len(sys.argv) > 4:
+        MODE = sys.argv[4]
+    if len(sys.argv) > 5:
+        DURATION = int(sys.argv[5])
+
+    # Small receive buffer keeps data in flight low, so latency shows queueing on server rather than
+    # backlog of data this (slow, Python) client has already received but not parsed yet
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 32768)
+    sock.connect((ADDR, PORT))
+    responses = Responses(sock)
+    request(sock, {'command':'AUTH', 'username':USER, 'password':PASS})
+    if responses.next().get('code') != 200:
+        print('AUTH failed')
+        sys.exit(1)
+
+    request(sock, {'command':'DWL', 'path':PATH, 'priority':'10', 'mode':MODE})
+    latencies = []
+    downloaded = 0
+    sent_at = None
+    start = time.time()
+    next_ls = start
+    while time.time() - start < DURATION or sent_at is not None:
+        if sent_at is None and time.time() >= next_ls and time.time() - start < DURATION:
+            request(sock, {'command':'LS', 'path':LS_PATH})
+            sent_at = time.time()
+            next_ls = sent_at + INTERVAL
+        res = responses.next()
+        if res.get('command') == 'LS':
+            latencies.append(time.time() - sent_at)
+            sent_at = None
+        elif res.get('command') == 'DWL':
+            if res.get('code') == 206:
+                downloaded += 1
+            else:
+                request(sock, {'command':'DWL', 'path':PATH, 'priority':'10', 'mode':MODE})
+    sock.close()
+
+    print('%d download responses received while measuring' % downloaded)
+    report_percentiles('LS latency', latencies)
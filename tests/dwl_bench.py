@@ -0,0 +1,128 @@
+import socket
+import time
+import json
+import sys
+import os
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+PATH = 'root/big.bin'
+ROUNDS = 5 # number of downloads of PATH
+MODE = 'base64' # 'binary' requests raw file data sent with sendfile()
+
+# Downloads PATH ROUNDS times over one connection and reports server side syscalls per MB sent,
+# taken from STATS counters read before and after the downloads (server should be otherwise idle)
+# When pid of local server is given, its CPU time and file read syscalls per GB are reported too
+# Usage: python3 dwl_bench.py [addr] [port] [path] [rounds] [mode] [server pid]
+
+class Responses:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = b''
+
+    def next(self):
+        while b'\n' not in self.buf:
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise Exception('connection closed')
+            self.buf += chunk
+        line, self.buf = self.buf.split(b'\n', 1)
+        res = json.loads(line)
+        if res.get('mode') == 'binary' and 'length' in res:
+            self.skip(res['length']) # raw file data follows header
+        return res
+
+    def skip(self, length):
+        if len(self.buf) >= length:
+            self.buf = self.buf[length:]
+            return
+        length -= len(self.buf)
+        self.buf = b''
+        view = memoryview(bytearray(1 << 20))
+        while length > 0:
+            n = self.sock.recv_into(view, min(length, len(view)))
+            if n == 0:
+                raise Exception('connection closed')
+            length -= n
+
+def request(sock, req):
+    req['type'] = 'REQUEST'
+    sock.sendall((json.dumps(req) + '\0').encode())
+
+def percentile(values, p):
+    values = sorted(values)
+    idx = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[idx]
+
+def report_percentiles(name, values):
+    ms = [v * 1000 for v in values]
+    print('%-14s n=%d  p50=%.2fms  p90=%.2fms  p99=%.2fms  max=%.2fms' % (
+        name, len(ms), percentile(ms, 50), percentile(ms, 90), percentile(ms, 99), max(ms)))
+
+# CPU seconds, read syscalls and bytes read by process, from /proc
+def read_proc(pid):
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    cpu = (int(fields[11]) + int(fields[12])) / float(os.sysconf('SC_CLK_TCK'))
+    io = {}
+    with open('/proc/%d/io' % pid) as f:
+        for line in f:
+            key, value = line.split(':')
+            io[key] = int(value)
+    return {'cpu': cpu, 'syscr': io['syscr'], 'rchar': io['rchar']}
+
+def read_stats(sock, responses):
+    request(sock, {'command':'STATS'})
+    while True:
+        res = responses.next()
+        if res.get('command') == 'STATS':
+            return res['data']
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        PATH = sys.argv[3]
+    if len(sys.argv) > 4:
+        ROUNDS = int(sys.argv[4])
+    if len(sys.argv) > 5:
+        MODE = sys.argv[5]
+    pid = int(sys.argv[6]) if len(sys.argv) > 6 else None
+
+    sock = socket.create_connection((ADDR, PORT))
+    responses = Responses(sock)
+    request(sock, {'command':'AUTH', 'username':USER, 'password':PASS})
+    if responses.next().get('code') != 200:
+        print('AUTH failed')
+        sys.exit(1)
+
+    before = read_stats(sock, responses)
+    proc_before = read_proc(pid) if pid else None
+    start = time.time()
+    for i in range(ROUNDS):
+        request(sock, {'command':'DWL', 'path':PATH, 'priority':'5', 'mode':MODE})
+        while True:
+            res = responses.next()
+            if res.get('command') == 'DWL' and res.get('code') != 206:
+                break
+        if res.get('code') != 200:
+            print('DWL failed: %s' % res)
+            sys.exit(1)
+    elapsed = time.time() - start
+    proc_after = read_proc(pid) if pid else None
+    after = read_stats(sock, responses)
+    sock.close()
+
+    mb = (after['bytes_sent'] - before['bytes_sent']) / 1e6
+    diff = {k: after[k] - before[k] for k in after if isinstance(after[k], int)}
+    print('sent %.2f MB in %.2fs (%.2f MB/s)' % (mb, elapsed, mb / elapsed))
+    for k in ('send_calls', 'recv_calls', 'loop_wakeups'):
+        print('%-14s %8d  %8.1f per MB' % (k, diff[k], diff[k] / mb))
+    if pid:
+        gb = (after['bytes_sent'] - before['bytes_sent']) / 1e9
+        print('%-14s %8.2f  per GB sent' % ('cpu_seconds', (proc_after['cpu'] - proc_before['cpu']) / gb))
+        print('%-14s %8d  per GB sent' % ('read_syscalls', (proc_after['syscr'] - proc_before['syscr']) / gb))
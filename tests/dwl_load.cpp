@@ -0,0 +1,408 @@
+//
+// Load generator for segmented downloads
+// Downloads one file split into N segments for every N given with -s and reports throughput and speedup
+// against the first N. Segments go either over separate connections ("connections", each one asks for
+// its range with "offset" and "length") or as streams of one segmented DWL on a single connection
+// ("streams", "segments" field). Every chunk is written with pwrite() at its offset to output file,
+// which is compared with local copy of the file when -check is given.
+// Build: make loadgen
+// Usage: ./dwl_load [-h addr] [-p port] [-u user] [-pw password] [-f path] [-s 1,2,4,8] [-m connections|streams]
+//                   [-mode binary|base64] [-r rounds] [-o output file] [-check local file]
+//
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include "utils/json.hpp"
+#include "utils/base644.h"
+
+using json = nlohmann::json;
+using std::string;
+
+struct LoadConfig
+{
+    string addr = "127.0.0.1";
+    string port = "8888";
+    string user = "root";
+    string password = "root";
+    string path = "root/public/huge.bin";
+    std::vector<int> segments = {1, 2, 4, 8};
+    string spread = "connections"; // "connections" or "streams"
+    string mode = "binary";
+    int rounds = 3;
+    string output = "/tmp/dwl_load.out";
+    string check = "";
+};
+
+//
+// Connection to server which sends JSON requests and reads JSON responses, raw data of binary
+// chunks is read after their header
+//
+class LoadConnection
+{
+  private:
+    int sock;
+    string buf;
+    size_t pos;
+
+    // Read more data into buffer, returns false when connection is closed
+    bool fill()
+    {
+        if (pos > 0 && pos == buf.size())
+        {
+            buf.clear();
+            pos = 0;
+        }
+        char tmp[65536];
+        ssize_t n = recv(sock, tmp, sizeof(tmp), 0);
+        if (n <= 0)
+            return false;
+        buf.append(tmp, n);
+        return true;
+    }
+
+  public:
+    LoadConnection(): sock(-1), pos(0) {}
+
+    LoadConnection(const LoadConnection&) = delete;
+    LoadConnection& operator=(const LoadConnection&) = delete;
+
+    ~LoadConnection()
+    {
+        if (sock != -1)
+            close(sock);
+    }
+
+    // Returns 0 when connected and authenticated, -1 otherwise
+    int open(const LoadConfig &config)
+    {
+        struct addrinfo hints = {}, *res;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(config.addr.c_str(), config.port.c_str(), &hints, &res) != 0)
+        {
+            fprintf(stderr, "Can't resolve %s\n", config.addr.c_str());
+            return -1;
+        }
+        sock = socket(res->ai_family, res->ai_socktype, 0);
+        if (sock == -1 || connect(sock, res->ai_addr, res->ai_addrlen) == -1)
+        {
+            perror("connect");
+            freeaddrinfo(res);
+            return -1;
+        }
+        freeaddrinfo(res);
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        json req;
+        req["command"] = "AUTH";
+        req["username"] = config.user;
+        req["password"] = config.password;
+        json res_json;
+        if (request(req) == -1 || next(res_json) == -1 || res_json["code"] != 200)
+        {
+            fprintf(stderr, "AUTH failed\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    int request(json req)
+    {
+        req["type"] = "REQUEST";
+        string msg = req.dump();
+        msg.push_back('\0');
+        size_t sent = 0;
+        while (sent < msg.size())
+        {
+            ssize_t n = send(sock, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                perror("send");
+                return -1;
+            }
+            sent += n;
+        }
+        return 0;
+    }
+
+    //
+    // Read next response, raw data following header of binary chunk is stored in data
+    // Returns 0 on success, -1 when connection is closed
+    int next(json &res, string *data = nullptr)
+    {
+        size_t eol;
+        while ((eol = buf.find('\n', pos)) == string::npos)
+        {
+            if (!fill())
+                return -1;
+        }
+        res = json::parse(buf.begin() + pos, buf.begin() + eol);
+        pos = eol + 1;
+        if (res.value("mode", "") == "binary" && res.find("length") != res.end())
+        {
+            size_t length = res["length"];
+            while (buf.size() - pos < length)
+            {
+                if (!fill())
+                    return -1;
+            }
+            if (data != nullptr)
+                data->assign(buf, pos, length);
+            pos += length;
+        }
+        return 0;
+    }
+};
+
+//
+// Run one DWL on conn and write its chunks to fd until all of its segments end
+// Returns number of bytes received, -1 on error
+long long receiveDownload(LoadConnection &conn, const LoadConfig &config, int fd, json req)
+{
+    req["command"] = "DWL";
+    req["path"] = config.path;
+    req["priority"] = "5";
+    req["mode"] = config.mode;
+    if (conn.request(req) == -1)
+        return -1;
+
+    long long received = 0;
+    int ended = 0;
+    unsigned long long next_offset = 0; // chunks without offset follow previous one
+    json res;
+    string data;
+    while (conn.next(res, &data) == 0)
+    {
+        if (res.value("command", "") != "DWL")
+            continue;
+        int code = res["code"];
+        if (code != 206)
+        {
+            if (code != 200)
+            {
+                fprintf(stderr, "DWL failed: %s\n", res.dump().c_str());
+                return -1;
+            }
+            if (++ended < res.value("segments", 1))
+                continue;
+            return received;
+        }
+        if (config.mode != "binary")
+            data = base64_decode(res["data"].get<string>());
+        if (res.find("offset") != res.end())
+            next_offset = res["offset"];
+        if (pwrite(fd, data.data(), data.size(), next_offset) != (ssize_t)data.size())
+        {
+            perror("pwrite");
+            return -1;
+        }
+        next_offset += data.size();
+        received += data.size();
+    }
+    fprintf(stderr, "Connection closed during download\n");
+    return -1;
+}
+
+// Size of file as reported in first response of one byte DWL, -1 on error
+long long fileSize(const LoadConfig &config)
+{
+    LoadConnection conn;
+    if (conn.open(config) == -1)
+        return -1;
+    json req;
+    req["command"] = "DWL";
+    req["path"] = config.path;
+    req["priority"] = "5";
+    req["mode"] = config.mode;
+    req["length"] = 1;
+    if (conn.request(req) == -1)
+        return -1;
+    json res;
+    while (conn.next(res) == 0)
+    {
+        if (res.value("command", "") == "DWL" && res.find("size") != res.end())
+            return res["size"];
+        if (res.value("command", "") == "DWL" && res["code"] != 206)
+            break;
+    }
+    return -1;
+}
+
+//
+// Download whole file in given number of segments, returns bytes received or -1 on error
+long long segmentedDownload(const LoadConfig &config, int segments, long long size, int fd)
+{
+    if (config.spread == "streams")
+    {
+        LoadConnection conn;
+        if (conn.open(config) == -1)
+            return -1;
+        json req;
+        req["segments"] = segments;
+        return receiveDownload(conn, config, fd, req);
+    }
+
+    // One connection per segment, each of them asks for its own range
+    std::vector<LoadConnection> conns(segments);
+    for (int i = 0; i < segments; i++)
+    {
+        if (conns[i].open(config) == -1)
+            return -1;
+    }
+    std::atomic<long long> received{0};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads;
+    long long segment_length = (size + segments - 1) / segments;
+    for (int i = 0; i < segments; i++)
+    {
+        threads.emplace_back([&, i]()
+        {
+            long long offset = i * segment_length;
+            if (offset >= size)
+                return;
+            json req;
+            req["offset"] = offset;
+            req["length"] = (offset + segment_length < size) ? segment_length : size - offset;
+            long long n = receiveDownload(conns[i], config, fd, req);
+            if (n == -1)
+                failed = true;
+            else
+                received += n;
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    return failed ? -1 : received.load();
+}
+
+// Returns 0 when output file matches local copy of downloaded file
+int checkOutput(const LoadConfig &config)
+{
+    std::ifstream expected(config.check, std::ios::binary), output(config.output, std::ios::binary);
+    std::stringstream a, b;
+    a << expected.rdbuf();
+    b << output.rdbuf();
+    return a.str() == b.str() ? 0 : -1;
+}
+
+int parseArgs(int argc, char **argv, LoadConfig &config)
+{
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string opt = argv[i], value = argv[i + 1];
+        if (opt == "-h")
+            config.addr = value;
+        else if (opt == "-p")
+            config.port = value;
+        else if (opt == "-u")
+            config.user = value;
+        else if (opt == "-pw")
+            config.password = value;
+        else if (opt == "-f")
+            config.path = value;
+        else if (opt == "-m")
+            config.spread = value;
+        else if (opt == "-mode")
+            config.mode = value;
+        else if (opt == "-r")
+            config.rounds = atoi(value.c_str());
+        else if (opt == "-o")
+            config.output = value;
+        else if (opt == "-check")
+            config.check = value;
+        else if (opt == "-s")
+        {
+            config.segments.clear();
+            std::stringstream list(value);
+            string item;
+            while (std::getline(list, item, ','))
+                config.segments.push_back(atoi(item.c_str()));
+        }
+        else
+            return -1;
+    }
+    if ((argc - 1) % 2 != 0 || config.rounds < 1 || config.segments.empty()
+        || (config.spread != "connections" && config.spread != "streams")
+        || (config.mode != "binary" && config.mode != "base64"))
+        return -1;
+    for (int n : config.segments)
+    {
+        if (n < 1)
+            return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    LoadConfig config;
+    if (parseArgs(argc, argv, config) == -1)
+    {
+        fprintf(stderr, "Usage: %s [-h addr] [-p port] [-u user] [-pw password] [-f path] [-s 1,2,4,8] "
+                        "[-m connections|streams] [-mode binary|base64] [-r rounds] [-o output file] [-check local file]\n", argv[0]);
+        return 1;
+    }
+    long long size = fileSize(config);
+    if (size < 0)
+    {
+        fprintf(stderr, "Can't get size of %s\n", config.path.c_str());
+        return 1;
+    }
+    printf("%s: %.2f MB, %s mode, segments over %s, best of %d rounds\n",
+           config.path.c_str(), size / 1e6, config.mode.c_str(), config.spread.c_str(), config.rounds);
+
+    double base = 0;
+    bool ok = true;
+    for (int segments : config.segments)
+    {
+        double best = 0;
+        for (int round = 0; round < config.rounds; round++)
+        {
+            int fd = ::open(config.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1)
+            {
+                perror("open output");
+                return 1;
+            }
+            auto start = std::chrono::steady_clock::now();
+            long long received = segmentedDownload(config, segments, size, fd);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            close(fd);
+            if (received != size)
+            {
+                fprintf(stderr, "%d segments: received %lld of %lld bytes\n", segments, received, size);
+                ok = false;
+                break;
+            }
+            if (config.check != "" && checkOutput(config) != 0)
+            {
+                fprintf(stderr, "%d segments: output differs from %s\n", segments, config.check.c_str());
+                ok = false;
+                break;
+            }
+            double rate = size / 1e6 / seconds;
+            if (rate > best)
+                best = rate;
+        }
+        if (base == 0)
+            base = best;
+        printf("segments %2d  %9.1f MB/s  speedup %.2fx\n", segments, best, base > 0 ? best / base : 0);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,103 @@
+import socket
+import sys
+import time
+import base64
+import hashlib
+import threading
+from dwl_bench import Responses, request, read_stats, read_proc
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+PATH = 'root/public/medium.bin'
+FILE = 'data/root/public/medium.bin' # local copy of PATH, downloaded data is compared with it
+CLIENTS = 10
+SLOW_DELAY = 0.002 # seconds slow client sleeps after every response
+
+# "Release day": CLIENTS connections ask for PATH in base64 mode at the same moment, one more client reads
+# slowly. Every download must match FILE, fan-out counters from STATS show how many packages were
+# read and encoded once and shared, and how often the slow client was detached from the group.
+# When pid of local server is given, its CPU time is reported too (compare with server run with -fanout 0)
+# Usage: python3 fanout_dwl.py [addr] [port] [path] [local file] [clients] [server pid]
+
+class Download(threading.Thread):
+    def __init__(self, start_barrier, slow=False):
+        threading.Thread.__init__(self, daemon=True)
+        self.sock = socket.create_connection((ADDR, PORT))
+        if slow:
+            self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 16384)
+        self.responses = Responses(self.sock)
+        request(self.sock, {'command':'AUTH', 'username':USER, 'password':PASS})
+        if self.responses.next().get('code') != 200:
+            raise Exception('AUTH failed')
+        self.start_barrier = start_barrier
+        self.slow = slow
+        self.digest = hashlib.md5()
+        self.code = None
+        self.elapsed = None
+
+    def run(self):
+        self.start_barrier.wait()
+        start = time.time()
+        request(self.sock, {'command':'DWL', 'path':PATH, 'priority':'5'})
+        while True:
+            res = self.responses.next()
+            if res.get('command') != 'DWL':
+                continue
+            if res.get('code') != 206:
+                self.code = res.get('code')
+                break
+            self.digest.update(base64.b64decode(res['data']))
+            if self.slow:
+                time.sleep(SLOW_DELAY)
+        self.elapsed = time.time() - start
+        self.sock.close()
+
+def control():
+    sock = socket.create_connection((ADDR, PORT))
+    responses = Responses(sock)
+    request(sock, {'command':'AUTH', 'username':USER, 'password':PASS})
+    responses.next()
+    return sock, responses
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        PATH = sys.argv[3]
+    if len(sys.argv) > 4:
+        FILE = sys.argv[4]
+    if len(sys.argv) > 5:
+        CLIENTS = int(sys.argv[5])
+    pid = int(sys.argv[6]) if len(sys.argv) > 6 else None
+    with open(FILE, 'rb') as f:
+        expected = hashlib.md5(f.read()).hexdigest()
+
+    sock, responses = control()
+    before = read_stats(sock, responses)
+    proc_before = read_proc(pid) if pid else None
+    barrier = threading.Barrier(CLIENTS + 1)
+    fast = [Download(barrier) for i in range(CLIENTS)]
+    slow = Download(barrier, slow=True)
+    for d in fast + [slow]:
+        d.start()
+    for d in fast:
+        d.join()
+    proc_after = read_proc(pid) if pid else None
+    slow.join()
+    after = read_stats(sock, responses)
+    sock.close()
+
+    ok = all(d.code == 200 and d.digest.hexdigest() == expected for d in fast + [slow])
+    times = [d.elapsed for d in fast]
+    print('%d fast downloads: mean %.2fs, max %.2fs; slow download %.2fs' % (CLIENTS, sum(times) / len(times), max(times), slow.elapsed))
+    if proc_before:
+        print('server cpu while fast downloads ran: %.2fs' % (proc_after['cpu'] - proc_before['cpu']))
+    for section, keys in (('fanout', ('produced', 'shared', 'detached')), ('envelopes', ('hits', 'misses'))):
+        if section in after:
+            print('%-9s %s' % (section, ', '.join('%s %d' % (k, after[section][k] - before[section][k]) for k in keys)))
+    print('FANOUT OK' if ok else 'FANOUT FAILED')
+    sys.exit(0 if ok else 1)
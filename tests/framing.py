@@ -0,0 +1,66 @@
+import socket
+import struct
+import json
+
+# Client side of FRAMING_BINARY (see utils/frame.h), negotiated with "framing":2 in AUTH request
+# Frame header: opcode u8, flags u8, reserved u16, stream id u32, payload length u32 (big endian)
+
+HEADER = struct.Struct('>BBHII')
+OP_REQUEST = 1
+OP_RESPONSE = 2
+FLAG_FIN = 1
+FLAG_RAW = 2 # payload is JSON, '\0' and raw bytes
+FRAMING_BINARY = 2
+
+class FramedConnection:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = bytearray()
+        self.next_stream = 1
+
+    def auth(self, username, password):
+        """Send AUTH in JSON framing asking for binary framing, returns AUTH response"""
+        req = {'type':'REQUEST', 'command':'AUTH', 'username':username, 'password':password,
+               'framing':FRAMING_BINARY}
+        self.sock.sendall((json.dumps(req) + '\0').encode())
+        while b'\n' not in self.buf:
+            self._fill()
+        end = self.buf.index(b'\n')
+        res = json.loads(bytes(self.buf[:end]))
+        del self.buf[:end + 1]
+        return res
+
+    def request(self, req, raw=None):
+        """Send request in its own stream, returns stream id"""
+        stream = self.next_stream
+        self.next_stream += 1
+        req = dict(req)
+        req['type'] = 'REQUEST'
+        payload = json.dumps(req).encode()
+        flags = 0
+        if raw is not None:
+            payload += b'\0' + raw
+            flags |= FLAG_RAW
+        self.sock.sendall(HEADER.pack(OP_REQUEST, flags, 0, stream, len(payload)) + payload)
+        return stream
+
+    def response(self):
+        """Read next frame, returns (stream, flags, JSON response, raw bytes or None)"""
+        while len(self.buf) < HEADER.size:
+            self._fill()
+        opcode, flags, _, stream, length = HEADER.unpack_from(self.buf)
+        while len(self.buf) < HEADER.size + length:
+            self._fill()
+        payload = bytes(self.buf[HEADER.size:HEADER.size + length])
+        del self.buf[:HEADER.size + length]
+        raw = None
+        if flags & FLAG_RAW:
+            end = payload.index(b'\0')
+            payload, raw = payload[:end], payload[end + 1:]
+        return stream, flags, json.loads(payload), raw
+
+    def _fill(self):
+        chunk = self.sock.recv(1 << 20)
+        if not chunk:
+            raise Exception('connection closed')
+        self.buf += chunk
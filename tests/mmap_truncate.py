@@ -0,0 +1,77 @@
+import socket
+import time
+import sys
+import os
+import threading
+from dwl_bench import Responses, request
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+PATH = 'root/public/trunc.bin' # path of FILE as seen by server
+FILE = 'data/root/public/trunc.bin' # local path, server must run on this machine
+SIZE = 8 << 20
+DURATION = 10 # seconds
+
+# Truncates and rewrites FILE while clients keep downloading it in base64 mode
+# Run server with -source mmap: downloads share a mapping of the file, reads past the end of truncated
+# file must end the download (code 200 with fewer bytes or code 500) instead of killing the server
+# Usage: python3 mmap_truncate.py [addr] [port] [path] [local file]
+
+results = {}
+lock = threading.Lock()
+stop = False
+
+def client():
+    while not stop:
+        sock = socket.create_connection((ADDR, PORT))
+        responses = Responses(sock)
+        request(sock, {'command':'AUTH', 'username':USER, 'password':PASS})
+        responses.next()
+        request(sock, {'command':'DWL', 'path':PATH, 'priority':'5'})
+        while True:
+            res = responses.next()
+            if res.get('command') == 'DWL' and res.get('code') != 206:
+                break
+        sock.close()
+        with lock:
+            results[res['code']] = results.get(res['code'], 0) + 1
+
+def mutator():
+    data = os.urandom(SIZE)
+    while not stop:
+        with open(FILE, 'r+b') as f:
+            f.truncate(SIZE // 8)
+        time.sleep(0.05)
+        with open(FILE, 'r+b') as f:
+            f.seek(SIZE // 8)
+            f.write(data[SIZE // 8:])
+        time.sleep(0.05)
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        PATH = sys.argv[3]
+    if len(sys.argv) > 4:
+        FILE = sys.argv[4]
+
+    with open(FILE, 'wb') as f:
+        f.write(os.urandom(SIZE))
+    threads = [threading.Thread(target=client, daemon=True) for i in range(4)]
+    threads.append(threading.Thread(target=mutator, daemon=True))
+    for t in threads:
+        t.start()
+    time.sleep(DURATION)
+    stop = True
+    for t in threads:
+        t.join(10)
+
+    # Server must still serve requests
+    sock = socket.create_connection((ADDR, PORT))
+    responses = Responses(sock)
+    request(sock, {'command':'AUTH', 'username':USER, 'password':PASS})
+    print('downloads by final code: %s, server alive: %s' % (results, responses.next().get('code') == 200))
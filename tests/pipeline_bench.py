@@ -0,0 +1,70 @@
+import socket
+import time
+import json
+import sys
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+PATH = 'root'
+REQUESTS = 1000 # number of pipelined LS requests
+
+# Sends REQUESTS LS requests in one burst without waiting for responses and reports
+# request throughput and server loop wakeups per request taken from STATS counters
+# Usage: python3 pipeline_bench.py [addr] [port] [path] [requests]
+
+def request(req):
+    req['type'] = 'REQUEST'
+    return (json.dumps(req) + '\0').encode()
+
+def read_responses(sock, buf, count):
+    """Read count newline terminated responses, returns last one and rest of buffer"""
+    last = None
+    while count > 0:
+        while b'\n' not in buf:
+            chunk = sock.recv(65536)
+            if not chunk:
+                raise Exception('connection closed')
+            buf += chunk
+        lines = buf.split(b'\n')
+        buf = lines.pop()
+        count -= len(lines)
+        last = json.loads(lines[-1])
+    return last, buf
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        PATH = sys.argv[3]
+    if len(sys.argv) > 4:
+        REQUESTS = int(sys.argv[4])
+
+    sock = socket.create_connection((ADDR, PORT))
+    sock.sendall(request({'command':'AUTH', 'username':USER, 'password':PASS}))
+    res, buf = read_responses(sock, b'', 1)
+    if res.get('code') != 200:
+        print('AUTH failed')
+        sys.exit(1)
+
+    sock.sendall(request({'command':'STATS'}))
+    before, buf = read_responses(sock, buf, 1)
+    start = time.time()
+    sock.sendall(request({'command':'LS', 'path':PATH}) * REQUESTS)
+    res, buf = read_responses(sock, buf, REQUESTS)
+    elapsed = time.time() - start
+    sock.sendall(request({'command':'STATS'}))
+    after, buf = read_responses(sock, buf, 1)
+    sock.close()
+
+    if res.get('code') != 200:
+        print('LS failed: %s' % res)
+        sys.exit(1)
+    wakeups = after['data']['loop_wakeups'] - before['data']['loop_wakeups']
+    sends = after['data']['send_calls'] - before['data']['send_calls']
+    print('%d requests in %.3fs (%.0f req/s)' % (REQUESTS, elapsed, REQUESTS / elapsed))
+    print('loop wakeups %d (%.3f per request), send calls %d (%.3f per request)' % (
+        wakeups, wakeups / REQUESTS, sends, sends / REQUESTS))
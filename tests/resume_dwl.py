@@ -0,0 +1,110 @@
+import socket
+import sys
+import base64
+import json
+from dwl_bench import Responses, request
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+PATH = 'root/public/medium.bin'
+FILE = 'data/root/public/medium.bin' # local copy of PATH, downloaded bytes are compared with it
+
+# Interrupts download of PATH half way, resumes it on a new connection with "offset" and "version"
+# and checks that both parts together match FILE, in base64 and binary mode.
+# Then fetches a range from the middle, and checks 412 for a stale version and 416 for an offset past the end.
+# Usage: python3 resume_dwl.py [addr] [port] [path] [local file]
+
+class RangeResponses(Responses):
+    # Like Responses, but keeps raw data of binary packages
+    def next(self):
+        while b'\n' not in self.buf:
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise Exception('connection closed')
+            self.buf += chunk
+        line, self.buf = self.buf.split(b'\n', 1)
+        res = json.loads(line)
+        if res.get('mode') == 'binary' and 'length' in res:
+            while len(self.buf) < res['length']:
+                chunk = self.sock.recv(65536)
+                if not chunk:
+                    raise Exception('connection closed')
+                self.buf += chunk
+            res['raw'] = self.buf[:res['length']]
+            self.buf = self.buf[res['length']:]
+        return res
+
+def connect():
+    sock = socket.create_connection((ADDR, PORT))
+    responses = RangeResponses(sock)
+    request(sock, {'command':'AUTH', 'username':USER, 'password':PASS})
+    if responses.next().get('code') != 200:
+        raise Exception('AUTH failed')
+    return sock, responses
+
+#
+# Download range of PATH, stop after limit bytes when given
+# Returns (data, first response, last response)
+def fetch(mode, offset=None, length=None, version=None, limit=None):
+    sock, responses = connect()
+    req = {'command':'DWL', 'path':PATH, 'priority':'5', 'mode':mode}
+    if offset is not None:
+        req['offset'] = offset
+    if length is not None:
+        req['length'] = length
+    if version is not None:
+        req['version'] = version
+    request(sock, req)
+    data = b''
+    first = None
+    while True:
+        res = responses.next()
+        if res.get('command') != 'DWL':
+            continue
+        if first is None:
+            first = res
+        if res.get('code') != 206:
+            break
+        data += res['raw'] if mode == 'binary' else base64.b64decode(res['data'])
+        if limit is not None and len(data) >= limit:
+            break # connection drops
+    sock.close()
+    return data, first, res
+
+def check(name, cond):
+    print('%-40s %s' % (name, 'OK' if cond else 'FAILED'))
+    return cond
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        PATH = sys.argv[3]
+    if len(sys.argv) > 4:
+        FILE = sys.argv[4]
+    with open(FILE, 'rb') as f:
+        expected = f.read()
+
+    ok = True
+    for mode in ('base64', 'binary'):
+        part, first, last = fetch(mode, limit=len(expected) // 2)
+        ok &= check('%s: first response has size and version' % mode, first.get('size') == len(expected) and 'version' in first)
+        rest, first2, last2 = fetch(mode, offset=len(part), version=first['version'])
+        ok &= check('%s: resumed at offset %d' % (mode, len(part)), first2.get('offset') == len(part) and last2.get('code') == 200)
+        ok &= check('%s: parts match file' % mode, part + rest == expected)
+
+        middle, first3, last3 = fetch(mode, offset=1000, length=5000)
+        ok &= check('%s: range 1000+5000' % mode, middle == expected[1000:6000] and last3.get('code') == 200)
+
+        _, _, stale = fetch(mode, offset=10, version='0-0')
+        ok &= check('%s: stale version gets 412' % mode, stale.get('code') == 412 and stale.get('version') == first['version'])
+        _, _, past = fetch(mode, offset=len(expected) + 1)
+        ok &= check('%s: offset past end gets 416' % mode, past.get('code') == 416)
+        empty, _, end = fetch(mode, offset=len(expected))
+        ok &= check('%s: offset at end gets 200' % mode, empty == b'' and end.get('code') == 200 and end.get('size') == len(expected))
+    print('RESUME OK' if ok else 'RESUME FAILED')
+    sys.exit(0 if ok else 1)
@@ -0,0 +1,124 @@
+import socket
+import time
+import sys
+import threading
+from dwl_bench import Responses, request, read_stats
+
+ADDR = 'localhost'
+PORT = 8888
+USERS = [('root', 'root'), ('tiger', 'bonzo')]
+BIG = 'root/public/huge.bin'
+SMALL = 'root/public/big.bin'
+DURATION = 5 # seconds of competing downloads in share test
+MODE = 'base64'
+
+# Checks how download scheduler shares bandwidth (run server with -sched drr or -sched srpt)
+# share: first user downloads BIG over 3 connections (priorities 1, 1 and 4), second one over 1 connection;
+#        bytes received by every connection are compared with scheduler shares from STATS
+# mixed: 2 downloads of BIG run together with 20 downloads of SMALL started at once,
+#        mean completion time of SMALL shows the effect of shortest remaining first policy
+# Usage: python3 sched_share.py [addr] [port] [share|mixed] [mode] [big path] [small path]
+
+class Download(threading.Thread):
+    def __init__(self, user, path, priority, deadline=None):
+        threading.Thread.__init__(self, daemon=True)
+        self.sock = socket.create_connection((ADDR, PORT))
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 65536)
+        self.responses = Responses(self.sock)
+        request(self.sock, {'command':'AUTH', 'username':user[0], 'password':user[1]})
+        if self.responses.next().get('code') != 200:
+            raise Exception('AUTH failed')
+        self.name = '%s p%s' % (user[0], priority)
+        self.path = path
+        self.priority = priority
+        self.deadline = deadline
+        self.received = 0
+        self.elapsed = None
+
+    def run(self):
+        start = time.time()
+        request(self.sock, {'command':'DWL', 'path':self.path, 'priority':str(self.priority), 'mode':MODE})
+        while self.deadline is None or time.time() < self.deadline:
+            try:
+                res = self.responses.next()
+            except Exception: # closed by mixed test
+                break
+            if res.get('command') != 'DWL':
+                continue
+            if res.get('code') != 206:
+                if res.get('code') != 200:
+                    print('DWL failed: %s' % res)
+                self.elapsed = time.time() - start
+                break
+            self.received += res.get('length', 0) if MODE == 'binary' else len(res.get('data', '')) * 3 // 4
+        self.sock.close()
+
+def control():
+    sock = socket.create_connection((ADDR, PORT))
+    responses = Responses(sock)
+    request(sock, {'command':'AUTH', 'username':USERS[0][0], 'password':USERS[0][1]})
+    responses.next()
+    return sock, responses
+
+def share_test():
+    sock, responses = control()
+    before = read_stats(sock, responses)['scheduler']
+    deadline = time.time() + DURATION
+    downloads = [Download(USERS[0], BIG, 1, deadline), Download(USERS[0], BIG, 1, deadline),
+                 Download(USERS[0], BIG, 4, deadline), Download(USERS[1], BIG, 1, deadline)]
+    for d in downloads:
+        d.start()
+    for d in downloads:
+        d.join()
+    after = read_stats(sock, responses)['scheduler']
+    sock.close()
+
+    total = sum(d.received for d in downloads)
+    print('policy %s, received %.2f MB in %ds' % (after['policy'], total / 1e6, DURATION))
+    for d in downloads:
+        print('  %-10s %8.2f MB  %5.1f%%' % (d.name, d.received / 1e6, 100.0 * d.received / total))
+    print_shares('scheduler', before, after)
+    # Every worker schedules only its own connections, weights hold within each of them
+    workers = after.get('workers', [])
+    if len(workers) > 1:
+        for i, worker in enumerate(workers):
+            print_shares('worker %d' % i, before['workers'][i], worker)
+
+def print_shares(name, before, after):
+    for cls in ('users', 'priorities'):
+        diff = {k: v['bytes'] - before.get(cls, {}).get(k, {}).get('bytes', 0) for k, v in after.get(cls, {}).items()}
+        queued = sum(diff.values())
+        if queued > 0:
+            print('  %s %s: %s' % (name, cls, ', '.join('%s %.1f%%' % (k, 100.0 * v / queued) for k, v in sorted(diff.items()))))
+
+def mixed_test():
+    big = [Download(USERS[0], BIG, 5), Download(USERS[1], BIG, 5)]
+    for d in big:
+        d.start()
+    time.sleep(0.5)
+    small = [Download(USERS[i % 2], SMALL, 5) for i in range(20)]
+    for d in small:
+        d.start()
+    for d in small:
+        d.join()
+    times = [d.elapsed for d in small if d.elapsed is not None]
+    print('small downloads: n=%d  mean=%.3fs  max=%.3fs' % (len(times), sum(times) / len(times), max(times)))
+    for d in big:
+        d.sock.shutdown(socket.SHUT_RDWR)
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    test = sys.argv[3] if len(sys.argv) > 3 else 'share'
+    if len(sys.argv) > 4:
+        MODE = sys.argv[4]
+    if len(sys.argv) > 5:
+        BIG = sys.argv[5]
+    if len(sys.argv) > 6:
+        SMALL = sys.argv[6]
+    if test == 'mixed':
+        mixed_test()
+    else:
+        share_test()
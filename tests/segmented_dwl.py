@@ -0,0 +1,83 @@
+import os
+import sys
+import time
+import threading
+import client as cl
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+PATH = 'root/public/medium.bin'
+FILE = 'data/root/public/medium.bin' # local copy of PATH, downloaded file is compared with it
+SEGMENTS = [1, 2, 4, 8]
+
+# Downloads PATH in base64 mode split into segments, either as one segmented DWL on a single connection
+# ("streams") or over one connection per segment asking for its range ("connections"),
+# checks that reassembled file matches FILE and reports speedup versus segment count
+# Downloaded files go to dwl/ like in stress test
+# Usage: python3 segmented_dwl.py [addr] [port] [path] [local file] [streams|connections]
+
+def login():
+    cli = cl.Client(ADDR, PORT)
+    cli.login(USER, PASS)
+    if cli.digest_response() != cl.AUTH_OK:
+        raise Exception('AUTH failed')
+    return cli
+
+def receive(cli):
+    res_code = cli.digest_response()
+    while res_code != cl.DWLFIN:
+        if res_code == cl.REQERROR:
+            raise Exception('DWL failed')
+        res_code = cli.digest_response()
+
+def streams(segments, size):
+    cli = login()
+    cli.dwl_fname = 'segmented_dwl'
+    cli.send_dwl_req(PATH, 5, segments = segments)
+    receive(cli)
+
+def connections(segments, size):
+    clients = [login() for i in range(segments)]
+    length = (size + segments - 1) // segments
+    threads = []
+    for i, cli in enumerate(clients):
+        cli.dwl_fname = 'segmented_dwl'
+        cli.send_dwl_req(PATH, 5, offset = i * length, length = min(length, size - i * length))
+        threads.append(threading.Thread(target=receive, args=(cli,)))
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        ADDR = sys.argv[1]
+    if len(sys.argv) > 2:
+        PORT = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        PATH = sys.argv[3]
+    if len(sys.argv) > 4:
+        FILE = sys.argv[4]
+    spread = sys.argv[5] if len(sys.argv) > 5 else 'streams'
+    with open(FILE, 'rb') as f:
+        expected = f.read()
+    os.makedirs('dwl', exist_ok=True)
+
+    ok = True
+    base = None
+    for segments in SEGMENTS:
+        if os.path.exists('dwl/segmented_dwl'):
+            os.remove('dwl/segmented_dwl')
+        start = time.time()
+        (streams if spread == 'streams' else connections)(segments, len(expected))
+        elapsed = time.time() - start
+        with open('dwl/segmented_dwl', 'rb') as f:
+            match = f.read() == expected
+        ok &= match
+        base = base or elapsed
+        print('%s %2d segments  %6.2f MB/s  speedup %.2fx  %s' % (spread, segments, len(expected) / elapsed / 1e6,
+                                                                  base / elapsed, 'OK' if match else 'FAILED'))
+    print('SEGMENTED OK' if ok else 'SEGMENTED FAILED')
+    sys.exit(0 if ok else 1)
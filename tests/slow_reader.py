@@ -0,0 +1,91 @@
+import socket
+import selectors
+import time
+import json
+import sys
+
+ADDR = 'localhost'
+PORT = 8888
+USER = 'root'
+PASS = 'root'
+PATH = 'root/big.bin' # should be large enough not to fit in socket buffers
+CLIENTS = 1000
+DOWNLOADS = 3 # downloads started by every client
+READ_BYTES = 65536 # every client stops reading after this many bytes
+DURATION = 20 # seconds
+
+# Opens CLIENTS connections, every one starts DOWNLOADS downloads of PATH and stalls after READ_BYTES,
+# meanwhile samples resident memory of server process (read from /proc, so server must run on this host)
+# Usage: python3 slow_reader.py server_pid [addr] [port] [path] [clients] [duration]
+
+def rss_kb(pid):
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+    return 0
+
+def request(req):
+    req['type'] = 'REQUEST'
+    return (json.dumps(req) + '\0').encode()
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print('Usage: python3 slow_reader.py server_pid [addr] [port] [path] [clients] [duration]')
+        sys.exit(1)
+    pid = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        ADDR = sys.argv[2]
+    if len(sys.argv) > 3:
+        PORT = int(sys.argv[3])
+    if len(sys.argv) > 4:
+        PATH = sys.argv[4]
+    if len(sys.argv) > 5:
+        CLIENTS = int(sys.argv[5])
+    if len(sys.argv) > 6:
+        DURATION = int(sys.argv[6])
+
+    print('server RSS before: %d KB' % rss_kb(pid))
+    sel = selectors.DefaultSelector()
+    received = {}
+    burst = request({'command':'AUTH', 'username':USER, 'password':PASS})
+    for i in range(DOWNLOADS):
+        burst += request({'command':'DWL', 'path':PATH, 'priority':'10'})
+    for i in range(CLIENTS):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        sock.connect((ADDR, PORT))
+        sock.sendall(burst)
+        sock.setblocking(False)
+        received[sock] = 0
+        sel.register(sock, selectors.EVENT_READ)
+
+    start = time.time()
+    next_sample = start
+    samples = [] # taken after every client stalled
+    stalled = 0
+    while time.time() - start < DURATION:
+        for key, _ in sel.select(timeout=0.1):
+            sock = key.fileobj
+            try:
+                data = sock.recv(65536)
+            except BlockingIOError:
+                continue
+            received[sock] += len(data)
+            if not data or received[sock] >= READ_BYTES:
+                sel.unregister(sock) # stall: keep connection open but never read again
+                stalled += 1
+        if time.time() >= next_sample:
+            rss = rss_kb(pid)
+            if stalled == CLIENTS:
+                samples.append(rss)
+            print('t=%5.1fs  stalled clients %d  server RSS %d KB' % (time.time() - start, stalled, rss))
+            next_sample += 1
+
+    if len(samples) < 2:
+        print('Not every client stalled in time, run longer')
+    else:
+        print('RSS while all clients stalled: min %d KB, max %d KB, growth %d KB' % (
+            min(samples), max(samples), samples[-1] - samples[0]))
+    for sock in received:
+        sock.close()
@@ -1,5 +1,10 @@
 import client as cl
 import threading
+import socket
+import os
+import sys
+import json
+from dwl_bench import Responses, request, read_stats, read_proc
 
 ADDR = '168.63.56.27'
 PORT = 8888
@@ -7,7 +12,15 @@ USER = 'root'
 PASS = 'root'
 DWL_FILENAME = 'fot1.JPG'
 CLIENTS = 50 # number of clients to run
+CODECS = ['none'] # compression codecs to run the test with
+UPL_CHUNK = 4096 # bytes of file in one UPL request
 
+# All clients download the same public file at once, block cache counters from STATS read before and after
+# show how many times the file was read from disk (about once when the cache is on)
+# With codecs given (e.g. none,zlib) the test runs once per codec: clients download the file asking for
+# the codec, then one client uploads its copy back in chunks compressed with it. Bytes on the wire per MB
+# of file data are reported for both directions, with CPU time of local server per MB when its pid is given
+# Usage: python3 stress_test.py [addr] [port] [file name] [clients] [codecs] [server pid]
 
 
 # clients = []
@@ -30,7 +43,7 @@ CLIENTS = 50 # number of clients to run
 #     print('Download finished! ( cli.id = ',cli.id,')')
 
 
-def start_client(cli_id):
+def start_client(cli_id, codec, wire):
     cli = cl.Client(ADDR, PORT, cli_id)
     cli.login(USER, PASS)
     if cli.digest_response() != cl.AUTH_OK: #'AUTH OK'
@@ -38,22 +51,98 @@ def start_client(cli_id):
     else: #set user for cli
         cli.username = USER;
 
-    cli.send_dwl_req(USER+'/public/'+DWL_FILENAME, 5)
+    cli.send_dwl_req(USER+'/public/'+DWL_FILENAME, 5, compression = None if codec == 'none' else codec)
     res_code = cli.digest_response()
     while res_code not in [cl.DWLFIN, cl.REQERROR]: #DWLFIN
         res_code = cli.digest_response()
+    wire[cli_id] = cli.bytes_received
     print('Download finished! ( cli.id = ',cli.id,')')
 
-# # Run client threads
-threads = []
-for i in range(0, CLIENTS):
-    try:
-        thr = threading.Thread( target=start_client, args=( i, ) )
-        threads.append(thr)
-        thr.start()
-        print('Starting client ',i)
-    except:
-        print ("Error: unable to start thread: ",i)
-for t in threads:
-    if t.is_alive():
-        t.join()
+# Upload downloaded copy of the file back as a new file, returns bytes sent
+def upload(codec):
+    cli = cl.Client(ADDR, PORT)
+    cli.login(USER, PASS)
+    cli.digest_response()
+    name = 'stress_upl_' + codec
+    with open('dwl/stress_dwl_0', 'rb') as f:
+        data = f.read()
+    for pos in range(0, len(data), UPL_CHUNK):
+        cli.send_upl_req(USER+'/public', 'temp_' + name, data[pos:pos + UPL_CHUNK], codec)
+    cli.send_uplfin_req(USER+'/public', name)
+    wait_for(cli, 'UPLFIN')
+    cli.send({'type':'REQUEST', 'command':'RM', 'path':USER+'/public/'+name})
+    wait_for(cli, 'RM')
+    cli.sock.close()
+    return cli.bytes_sent
+
+# Read responses until the one to command, UPL sends response only when it fails
+def wait_for(cli, command):
+    while True:
+        while not cli.response_q:
+            cli.recive_msg()
+        res = json.loads(cli.response_q.pop(0))
+        if res.get('command') == command:
+            return res
+        print('%s failed: %s' % (res.get('command'), res))
+
+def cache_stats():
+    sock = socket.create_connection((ADDR, PORT))
+    responses = Responses(sock)
+    request(sock, {'command':'AUTH', 'username':USER, 'password':PASS})
+    responses.next()
+    stats = read_stats(sock, responses)
+    sock.close()
+    return stats.get('cache', {})
+
+if len(sys.argv) > 1:
+    ADDR = sys.argv[1]
+if len(sys.argv) > 2:
+    PORT = int(sys.argv[2])
+if len(sys.argv) > 3:
+    DWL_FILENAME = sys.argv[3]
+if len(sys.argv) > 4:
+    CLIENTS = int(sys.argv[4])
+if len(sys.argv) > 5:
+    CODECS = sys.argv[5].split(',')
+pid = int(sys.argv[6]) if len(sys.argv) > 6 else None
+before = cache_stats()
+
+report = []
+for codec in CODECS:
+    proc_before = read_proc(pid) if pid else None
+    # # Run client threads
+    wire = [0] * CLIENTS
+    threads = []
+    for i in range(0, CLIENTS):
+        try:
+            thr = threading.Thread( target=start_client, args=( i, codec, wire ) )
+            threads.append(thr)
+            thr.start()
+            print('Starting client ',i)
+        except:
+            print ("Error: unable to start thread: ",i)
+    for t in threads:
+        if t.is_alive():
+            t.join()
+    size = os.path.getsize('dwl/stress_dwl_0') if os.path.exists('dwl/stress_dwl_0') else 0
+    upl_wire = upload(codec) if len(CODECS) > 1 or codec != 'none' else 0
+    proc_after = read_proc(pid) if pid else None
+    report.append((codec, size, sum(wire), upl_wire, proc_after['cpu'] - proc_before['cpu'] if pid else None))
+
+if len(report) > 1 or report[0][0] != 'none':
+    for codec, size, dwl_wire, upl_wire, cpu in report:
+        mb = size / 1e6 if size else 1
+        line = '%-5s DWL %.2f MB on wire per MB, UPL %.2f MB on wire per MB' % (codec, dwl_wire / 1e6 / mb / CLIENTS, upl_wire / 1e6 / mb)
+        if cpu is not None:
+            line += ', server cpu %.1f ms per MB' % (cpu * 1000 / (mb * (CLIENTS + 1)))
+        print(line)
+
+after = cache_stats()
+if after.get('capacity', 0) == 0:
+    print('cache disabled, no disk read counters')
+else:
+    diff = {k: after[k] - before.get(k, 0) for k in ('hits', 'misses', 'evictions', 'rejections', 'bytes_read')}
+    size = os.path.getsize('dwl/stress_dwl_0') if os.path.exists('dwl/stress_dwl_0') else 0
+    print('cache: %d hits, %d misses, %d evictions, %d rejections' % (diff['hits'], diff['misses'], diff['evictions'], diff['rejections']))
+    print('read from disk: %.2f MB for %d downloads of %.2f MB (%.2f passes)' % (
+        diff['bytes_read'] / 1e6, CLIENTS, size / 1e6, float(diff['bytes_read']) / size if size else 0))
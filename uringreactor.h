@@ -0,0 +1,968 @@
+#ifndef URINGREACTOR_H
+#define URINGREACTOR_H
+
+#include "reactor.h"
+#include "utils/stats.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+
+//
+// UringReactor implements Reactor on top of io_uring
+// Sockets are driven by completions: listener has multishot accept armed, every attached socket
+// a multishot receive which picks buffers from a ring of provided buffers, and queued responses
+// go out as SENDMSG requests. Sockets are registered as fixed files, file segments of binary downloads
+// are read with READ_FIXED into registered buffers and sent from there, uploaded data is written with WRITE.
+// All requests are queued as SQEs and submitted together with waiting for completions, so every
+// loop iteration costs a single io_uring_enter() syscall no matter how many sockets received or
+// sent data. Kernels without provided buffer rings (older than 5.19) get the readiness mode instead.
+// Descriptors registered with add() (and all sockets in readiness mode) use one-shot polls which
+// are re-armed after they fire, that gives the same level-triggered semantics as EpollReactor.
+//
+class UringReactor : public Reactor
+{
+  public:
+    static const unsigned RING_ENTRIES = 1024;
+    static const unsigned RECV_BUFFERS = 512; // provided buffers multishot receives pick from, power of two
+    static const unsigned RECV_BUFFER_SIZE = 16384;
+    static const unsigned FILE_BUFFERS = 32; // registered buffers file segments are read into, one per send
+    static const unsigned FILE_BUFFER_SIZE = 65536;
+    static const unsigned MAX_FIXED_FILES = 65536; // sockets with higher descriptor are used as they are
+
+  private:
+    static const uint64_t CANCEL_TAG = ~0ULL; // user_data of requests whose completions are ignored
+    static const uint16_t BUFFER_GROUP = 0;
+    enum Kind { KIND_READ = 0, KIND_WRITE, KIND_ACCEPT, KIND_RECV, KIND_SEND, KIND_FILE_READ, KIND_FILE_WRITE };
+
+    struct FdState
+    {
+        uint32_t gen = 0; // incremented on every add/forget, stale completions are ignored
+        uint64_t token = 0; // reported with events of the socket
+        bool registered = false;
+        bool read_pending = false; // read poll submitted and not completed yet
+        bool write_pending = false;
+        bool write_wanted = false;
+        bool accepting = false; // listener with multishot accept
+        bool attached = false; // socket with multishot receive
+        bool op_pending = false; // multishot accept or receive is armed
+        bool fixed = false; // registered in fixed file table at index fd
+        int send_op = -1; // send in flight
+        uint32_t batch_seq = 0; // wait() call in which fd was last reported
+        int batch_idx = -1; // index in events reported by that wait()
+    };
+
+    // Send in flight, it keeps its data alive until its completion arrives even when socket is closed meanwhile
+    struct SendOp
+    {
+        int fd;
+        uint32_t gen;
+        int stage; // KIND_FILE_READ or KIND_SEND submitted, -1 while waiting for file buffer
+        int buffer; // registered buffer holding data read from file, -1 for memory segments
+        SendQueue::Batch batch;
+        struct msghdr msg;
+    };
+
+    // Write of file in flight, short writes are continued until all data is written
+    struct WriteOp
+    {
+        uint64_t token;
+        SendQueue::File file;
+        unsigned long long offset; // of data not written yet
+        std::string data;
+        size_t done; // bytes written so far
+    };
+
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+    unsigned to_submit; // SQEs queued since last io_uring_enter
+
+    std::vector<FdState> fds; // indexed by socket
+    std::vector<int> rearm; // sockets which polls fired or multishot requests ended, they have to be submitted again
+    uint32_t batch_seq;
+    bool woken; // last enter() returned because of completion rather than timeout
+
+    bool completion; // sockets are driven by completions
+    // Provided buffer ring, its tail overlays resv field of the first entry
+    // (bufs member of io_uring_buf_ring is shifted by the flexible array wrapper in C++, so it's not used)
+    struct io_uring_buf *buf_ring;
+    char *recv_memory; // RECV_BUFFERS buffers of provided buffer ring
+    uint16_t buf_tail;
+    std::vector<uint16_t> recycle; // buffers reported by last wait(), returned to ring by the next one
+    char *file_memory; // FILE_BUFFERS registered buffers
+    bool fixed_buffers; // file_memory is registered, READ_FIXED is used
+    std::vector<int> free_file_buffers;
+    std::deque<int> file_waiting; // sends of file segments waiting for a free file buffer
+    unsigned fixed_files; // size of sparse fixed file table, 0 when it couldn't be registered
+    std::vector<int> slot_values; // values of FILES_UPDATE requests, read by kernel when they are submitted
+    std::vector<std::unique_ptr<SendOp>> send_ops;
+    std::vector<int> free_send_ops;
+    std::vector<std::unique_ptr<WriteOp>> write_ops;
+    std::vector<int> free_write_ops;
+
+  public:
+    UringReactor(): ring_fd(-1), sqes(nullptr), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), to_submit(0), batch_seq(0), woken(false),
+      completion(false), buf_ring(nullptr), recv_memory(nullptr), buf_tail(0), file_memory(nullptr), fixed_buffers(false), fixed_files(0)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof params);
+        ring_fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+        if (ring_fd == -1)
+        {
+            perror("io_uring_setup");
+            return;
+        }
+        if (!(params.features & IORING_FEAT_EXT_ARG))
+        { // wait with timeout needs IORING_ENTER_EXT_ARG
+            printf("io_uring: kernel does not support IORING_FEAT_EXT_ARG\n");
+            close(ring_fd);
+            ring_fd = -1;
+            return;
+        }
+
+        sq_entries = params.sq_entries;
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+        {
+            perror("mmap(sq ring)");
+            return;
+        }
+        if (single_mmap)
+            cq_ptr = sq_ptr;
+        else
+        {
+            cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED)
+            {
+                perror("mmap(cq ring)");
+                return;
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        void *sqes_ptr = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED)
+        {
+            perror("mmap(sqes)");
+            return;
+        }
+        sqes = (struct io_uring_sqe *)sqes_ptr;
+
+        char *sq = (char *)sq_ptr;
+        sq_head = (unsigned *)(sq + params.sq_off.head);
+        sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned *)(sq + params.sq_off.array);
+        char *cq = (char *)cq_ptr;
+        cq_head = (unsigned *)(cq + params.cq_off.head);
+        cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        setupCompletion();
+    }
+
+    ~UringReactor()
+    {
+        if (sqes != nullptr)
+            munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED)
+            munmap(sq_ptr, sq_size);
+        if (ring_fd != -1)
+            close(ring_fd); // kernel drops registered buffers and files with the ring
+        if (buf_ring != nullptr)
+            munmap(buf_ring, RECV_BUFFERS * sizeof(struct io_uring_buf));
+        if (recv_memory != nullptr)
+            munmap(recv_memory, (size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+        if (file_memory != nullptr)
+            munmap(file_memory, (size_t)FILE_BUFFERS * FILE_BUFFER_SIZE);
+    }
+
+    bool isValid() const {return ring_fd != -1 && sqes != nullptr;}
+    const char* getName() const {return completion ? "io_uring" : "io_uring (polls)";}
+    bool completesIo() const {return completion;}
+
+    int add(int fd, uint64_t token, bool write = false)
+    {
+        if (fd < 0)
+            return -1;
+        FdState &st = track(fd, token);
+        st.write_wanted = write;
+        armRead(fd);
+        if (write)
+            armWrite(fd);
+        return 0;
+    }
+
+    // Token given to add() is kept, polls re-armed later report it too
+    int setWriteInterest(int fd, uint64_t, bool write)
+    {
+        if (fd < 0 || (size_t)fd >= fds.size() || !fds[fd].registered)
+            return -1;
+        FdState &st = fds[fd];
+        st.write_wanted = write;
+        if (write && !st.write_pending)
+            armWrite(fd);
+        else if (!write && st.write_pending)
+        { // cancel poll so that it won't wake the loop up for nothing
+            queueRemove(userData(fd, st.gen, KIND_WRITE));
+            st.write_pending = false;
+        }
+        return 0;
+    }
+
+    int startAccept(int fd, uint64_t token)
+    {
+        if (!completion || fd < 0)
+            return -1;
+        FdState &st = track(fd, token);
+        st.accepting = true;
+        return armAccept(fd);
+    }
+
+    int attach(int fd, uint64_t token)
+    {
+        if (!completion || fd < 0)
+            return -1;
+        FdState &st = track(fd, token);
+        st.attached = true;
+        if ((unsigned)fd < fixed_files)
+        {
+            // Receive is linked to registration, it fails together with it
+            slot_values[fd] = fd;
+            st.fixed = queueFilesUpdate(fd, IOSQE_IO_LINK);
+        }
+        return armRecv(fd);
+    }
+
+    int startSend(int fd, uint64_t, SendQueue::Batch &&batch)
+    {
+        if (!completion || fd < 0 || (size_t)fd >= fds.size() || !fds[fd].attached || fds[fd].send_op != -1)
+            return -1;
+        int id = allocSendOp();
+        SendOp &op = *send_ops[id];
+        op.fd = fd;
+        op.gen = fds[fd].gen;
+        op.stage = -1;
+        op.buffer = -1;
+        op.batch = std::move(batch);
+        if (op.batch.file == nullptr)
+        {
+            memset(&op.msg, 0, sizeof op.msg);
+            op.msg.msg_iov = op.batch.iov.data();
+            op.msg.msg_iovlen = op.batch.iov.size();
+            if (!queueSend(id, IORING_OP_SENDMSG))
+            {
+                releaseSendOp(id);
+                return -1;
+            }
+        }
+        else
+        {
+            file_waiting.push_back(id);
+            startFileReads();
+        }
+        fds[fd].send_op = id;
+        return 0;
+    }
+
+    //
+    // Descriptor of file isn't in fixed file table, its slot would be left behind when the file is closed
+    // and the number reused by a socket
+    int startWrite(const SendQueue::File &file, unsigned long long offset, std::string &&data, uint64_t token)
+    {
+        if (!completion || file == nullptr)
+            return -1;
+        int id;
+        if (free_write_ops.empty())
+        {
+            write_ops.push_back(std::make_unique<WriteOp>());
+            id = (int)write_ops.size() - 1;
+        }
+        else
+        {
+            id = free_write_ops.back();
+            free_write_ops.pop_back();
+        }
+        WriteOp &op = *write_ops[id];
+        op.token = token;
+        op.file = file;
+        op.offset = offset;
+        op.data = std::move(data);
+        op.done = 0;
+        if (!queueFileWrite(id))
+        {
+            releaseWriteOp(id);
+            return -1;
+        }
+        return 0;
+    }
+
+    void forget(int fd)
+    {
+        if (fd < 0 || (size_t)fd >= fds.size() || !fds[fd].registered)
+            return;
+        FdState &st = fds[fd];
+        // Pending requests hold reference to the socket, cancel them so it gets released
+        if (st.read_pending)
+            queueRemove(userData(fd, st.gen, KIND_READ));
+        if (st.write_pending)
+            queueRemove(userData(fd, st.gen, KIND_WRITE));
+        if (st.op_pending)
+            queueCancel(userData(fd, st.gen, st.attached ? KIND_RECV : KIND_ACCEPT));
+        if (st.send_op != -1 && send_ops[st.send_op]->stage == KIND_SEND)
+            queueCancel(opData(st.send_op, KIND_SEND));
+        if (st.fixed)
+        {
+            slot_values[fd] = -1;
+            queueFilesUpdate(fd, 0);
+        }
+        st.gen++;
+        st.registered = false;
+        st.read_pending = st.write_pending = st.write_wanted = false;
+        st.accepting = st.attached = st.op_pending = st.fixed = false;
+        st.send_op = -1; // its completion frees it
+    }
+
+    int wait(int timeout)
+    {
+        provideBuffers(); // data of events reported by last wait() was handled
+        startFileReads(); // sends which didn't get submission queue entry last time
+        for (size_t i = 0; i < rearm.size(); i++)
+        {
+            int fd = rearm[i];
+            FdState &st = fds[fd];
+            if (!st.registered)
+                continue;
+            if (st.attached || st.accepting)
+            {
+                if (!st.op_pending)
+                    st.attached ? armRecv(fd) : armAccept(fd);
+                continue;
+            }
+            if (!st.read_pending)
+                armRead(fd);
+            if (st.write_wanted && !st.write_pending)
+                armWrite(fd);
+        }
+        rearm.clear();
+
+        int n = 0;
+        while (true)
+        {
+            if (enter(timeout) == -1)
+                return -1;
+            n = reap();
+            // completions of cancelled requests and of file reads wake the ring up without reporting anything
+            if (n > 0 || timeout == 0 || !lastWaitWoken())
+                break;
+        }
+        return n;
+    }
+
+  private:
+    bool lastWaitWoken() const {return woken;}
+
+    static uint64_t userData(int fd, uint32_t gen, int kind)
+    {
+        return ((uint64_t)gen << 32) | ((uint64_t)fd << 3) | (uint64_t)kind;
+    }
+
+    static uint64_t opData(int id, int kind)
+    {
+        return ((uint64_t)id << 3) | (uint64_t)kind;
+    }
+
+    int registerRing(unsigned opcode, void *arg, unsigned nr_args)
+    {
+        return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+    }
+
+    //
+    // Provided buffer ring for receives, sparse fixed file table for sockets and registered buffers for file data
+    // Without provided buffer ring sockets fall back to polls, the other two are optional
+    //
+    void setupCompletion()
+    {
+        size_t ring_size = RECV_BUFFERS * sizeof(struct io_uring_buf);
+        void *ring = mmap(0, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void *recv = mmap(0, (size_t)RECV_BUFFERS * RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void *file = mmap(0, (size_t)FILE_BUFFERS * FILE_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring != MAP_FAILED)
+            buf_ring = (struct io_uring_buf *)ring;
+        if (recv != MAP_FAILED)
+            recv_memory = (char *)recv;
+        if (file != MAP_FAILED)
+            file_memory = (char *)file;
+        if (buf_ring == nullptr || recv_memory == nullptr || file_memory == nullptr)
+        {
+            perror("mmap(io_uring buffers)");
+            return;
+        }
+
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof reg);
+        reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+        reg.ring_entries = RECV_BUFFERS;
+        reg.bgid = BUFFER_GROUP;
+        if (registerRing(IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        {
+            perror("io_uring_register(PBUF_RING)");
+            return;
+        }
+        for (unsigned i = 0; i < RECV_BUFFERS; i++)
+            recycle.push_back(i);
+        provideBuffers();
+
+        struct rlimit limit;
+        unsigned files = MAX_FIXED_FILES;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < files)
+            files = limit.rlim_cur;
+        struct io_uring_rsrc_register table;
+        memset(&table, 0, sizeof table);
+        table.nr = files;
+        table.flags = IORING_RSRC_REGISTER_SPARSE;
+        if (registerRing(IORING_REGISTER_FILES2, &table, sizeof table) == 0)
+        {
+            fixed_files = files;
+            slot_values.assign(files, -1);
+        }
+        else
+            perror("io_uring_register(FILES2)");
+
+        std::vector<struct iovec> iov(FILE_BUFFERS);
+        for (unsigned i = 0; i < FILE_BUFFERS; i++)
+        {
+            iov[i].iov_base = file_memory + (size_t)i * FILE_BUFFER_SIZE;
+            iov[i].iov_len = FILE_BUFFER_SIZE;
+            free_file_buffers.push_back(i);
+        }
+        fixed_buffers = registerRing(IORING_REGISTER_BUFFERS, iov.data(), FILE_BUFFERS) == 0;
+        if (!fixed_buffers)
+            perror("io_uring_register(BUFFERS)");
+        completion = true;
+    }
+
+    // Return recycled buffers to provided buffer ring
+    void provideBuffers()
+    {
+        if (recycle.empty())
+            return;
+        unsigned mask = RECV_BUFFERS - 1;
+        for (size_t i = 0; i < recycle.size(); i++)
+        {
+            struct io_uring_buf &buf = buf_ring[(buf_tail + i) & mask];
+            buf.addr = (uint64_t)(uintptr_t)(recv_memory + (size_t)recycle[i] * RECV_BUFFER_SIZE);
+            buf.len = RECV_BUFFER_SIZE;
+            buf.bid = recycle[i];
+        }
+        buf_tail += recycle.size();
+        __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+        recycle.clear();
+    }
+
+    FdState& track(int fd, uint64_t token)
+    {
+        if ((size_t)fd >= fds.size())
+            fds.resize(fd + 1);
+        FdState &st = fds[fd];
+        st.gen++;
+        st.token = token;
+        st.registered = true;
+        st.read_pending = st.write_pending = st.write_wanted = false;
+        st.accepting = st.attached = st.op_pending = st.fixed = false;
+        st.send_op = -1;
+        return st;
+    }
+
+    int allocSendOp()
+    {
+        if (free_send_ops.empty())
+        {
+            send_ops.push_back(std::make_unique<SendOp>());
+            return (int)send_ops.size() - 1;
+        }
+        int id = free_send_ops.back();
+        free_send_ops.pop_back();
+        return id;
+    }
+
+    //
+    // Start file reads of waiting sends while there are free file buffers
+    // When submission queue is full, send keeps waiting and its read is started by next wait()
+    void startFileReads()
+    {
+        while (!file_waiting.empty() && !free_file_buffers.empty())
+        {
+            int id = file_waiting.front();
+            if (!isCurrent(*send_ops[id]))
+            {
+                file_waiting.pop_front(); // socket was forgotten meanwhile
+                releaseSendOp(id);
+                continue;
+            }
+            if (!queueFileRead(id, free_file_buffers.back()))
+                return;
+            file_waiting.pop_front();
+            free_file_buffers.pop_back();
+        }
+    }
+
+    // Free send op and its data, its file buffer goes to send waiting for one
+    void releaseSendOp(int id)
+    {
+        SendOp &op = *send_ops[id];
+        if (op.fd < (int)fds.size() && fds[op.fd].gen == op.gen && fds[op.fd].send_op == id)
+            fds[op.fd].send_op = -1;
+        int buffer = op.buffer;
+        op.batch = SendQueue::Batch();
+        op.buffer = -1;
+        free_send_ops.push_back(id);
+        if (buffer == -1)
+            return;
+        free_file_buffers.push_back(buffer);
+        startFileReads();
+    }
+
+    // True when socket of send op wasn't forgotten since the send started
+    bool isCurrent(const SendOp &op) const
+    {
+        return op.fd < (int)fds.size() && fds[op.fd].registered && fds[op.fd].gen == op.gen;
+    }
+
+    void armRead(int fd)
+    {
+        FdState &st = fds[fd];
+        queuePoll(fd, POLLIN | POLLRDHUP, userData(fd, st.gen, KIND_READ));
+        st.read_pending = true;
+    }
+
+    void armWrite(int fd)
+    {
+        FdState &st = fds[fd];
+        queuePoll(fd, POLLOUT, userData(fd, st.gen, KIND_WRITE));
+        st.write_pending = true;
+    }
+
+    int armAccept(int fd)
+    {
+        FdState &st = fds[fd];
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+            return -1;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = userData(fd, st.gen, KIND_ACCEPT);
+        pushSqe();
+        st.op_pending = true;
+        return 0;
+    }
+
+    int armRecv(int fd)
+    {
+        FdState &st = fds[fd];
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+            return -1;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd; // index in fixed file table is the descriptor itself
+        sqe->flags = IOSQE_BUFFER_SELECT | (st.fixed ? IOSQE_FIXED_FILE : 0);
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = userData(fd, st.gen, KIND_RECV);
+        pushSqe();
+        st.op_pending = true;
+        return 0;
+    }
+
+    // Send gathered segments (IORING_OP_SENDMSG) or data read into file buffer (IORING_OP_SEND)
+    bool queueSend(int id, int opcode, unsigned length = 0)
+    {
+        SendOp &op = *send_ops[id];
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = opcode;
+        sqe->fd = op.fd;
+        sqe->flags = fds[op.fd].fixed ? IOSQE_FIXED_FILE : 0;
+        if (opcode == IORING_OP_SENDMSG)
+            sqe->addr = (uint64_t)(uintptr_t)&op.msg;
+        else
+        {
+            sqe->addr = (uint64_t)(uintptr_t)(file_memory + (size_t)op.buffer * FILE_BUFFER_SIZE);
+            sqe->len = length;
+        }
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = opData(id, KIND_SEND);
+        pushSqe();
+        op.stage = KIND_SEND;
+        return true;
+    }
+
+    // Read next part of file segment into buffer, buffer is owned by send op only when read is queued
+    bool queueFileRead(int id, int buffer)
+    {
+        SendOp &op = *send_ops[id];
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+            return false;
+        op.buffer = buffer;
+        sqe->opcode = fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = op.batch.file->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(file_memory + (size_t)buffer * FILE_BUFFER_SIZE);
+        sqe->len = op.batch.length < FILE_BUFFER_SIZE ? op.batch.length : FILE_BUFFER_SIZE;
+        sqe->off = op.batch.offset;
+        if (fixed_buffers)
+            sqe->buf_index = buffer;
+        sqe->user_data = opData(id, KIND_FILE_READ);
+        pushSqe();
+        op.stage = KIND_FILE_READ;
+        return true;
+    }
+
+    bool queueFileWrite(int id)
+    {
+        WriteOp &op = *write_ops[id];
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = op.file->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(op.data.data() + op.done);
+        sqe->len = op.data.size() - op.done;
+        sqe->off = op.offset;
+        sqe->user_data = opData(id, KIND_FILE_WRITE);
+        pushSqe();
+        return true;
+    }
+
+    void releaseWriteOp(int id)
+    {
+        WriteOp &op = *write_ops[id];
+        op.file = nullptr;
+        std::string().swap(op.data);
+        free_write_ops.push_back(id);
+    }
+
+    // Set fixed file slot to slot_values[slot] (-1 removes socket from the table)
+    bool queueFilesUpdate(int slot, int flags)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->flags = flags;
+        sqe->addr = (uint64_t)(uintptr_t)&slot_values[slot];
+        sqe->len = 1;
+        sqe->off = slot;
+        sqe->user_data = CANCEL_TAG;
+        pushSqe();
+        return true;
+    }
+
+    void queueCancel(uint64_t target)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = CANCEL_TAG;
+        pushSqe();
+    }
+
+    struct io_uring_sqe* getSqe()
+    {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        unsigned tail = *sq_tail;
+        if (tail - head >= sq_entries)
+        { // submission queue is full, flush it without waiting
+            submit(0, 0, nullptr);
+            head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if (tail - head >= sq_entries)
+            {
+                printf("io_uring: submission queue full\n");
+                return nullptr;
+            }
+        }
+        unsigned idx = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[idx] = idx;
+        return sqe;
+    }
+
+    void pushSqe()
+    {
+        __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+    }
+
+    void queuePoll(int fd, unsigned mask, uint64_t user_data)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = mask;
+        sqe->user_data = user_data;
+        pushSqe();
+    }
+
+    void queueRemove(uint64_t target)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = CANCEL_TAG;
+        pushSqe();
+    }
+
+    int submit(unsigned min_complete, unsigned flags, struct io_uring_getevents_arg *arg)
+    {
+        ServerStats::add(stats.ring_enters);
+        int ret = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, arg ? sizeof(*arg) : 0);
+        if (ret >= 0)
+            to_submit -= std::min((unsigned)ret, to_submit);
+        return ret;
+    }
+
+    // Submit queued SQEs and wait up to timeout milliseconds for at least one completion
+    int enter(int timeout)
+    {
+        woken = false;
+        unsigned head = *cq_head;
+        if (timeout == 0 || head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        { // completions are already waiting, just submit
+            if (to_submit > 0 && submit(0, 0, nullptr) == -1 && errno != EINTR)
+            {
+                perror("io_uring_enter");
+                return -1;
+            }
+            woken = true;
+            return 0;
+        }
+
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof arg);
+        if (timeout > 0)
+        {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        if (submit(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg) == -1)
+        {
+            if (errno == ETIME)
+                return 0;
+            if (errno != EINTR)
+            {
+                perror("io_uring_enter");
+                return -1;
+            }
+        }
+        woken = true;
+        return 0;
+    }
+
+    // Report result of operation as event of socket, data of received bytes stays valid until next wait()
+    void report(uint64_t token, uint32_t mask, int result, const char *received = nullptr)
+    {
+        int n = reported;
+        events[n].data.u64 = token;
+        events[n].events = mask;
+        results[n] = result;
+        data[n] = received;
+        reported++;
+    }
+
+    void reportSend(const SendOp &op, int result)
+    {
+        if (isCurrent(op))
+            report(fds[op.fd].token, result < 0 ? EPOLLOUT | EPOLLERR : EPOLLOUT, result);
+    }
+
+    int reported; // events filled by reap() so far
+
+    // Move completions to events array, merging read and write readiness of polls of the same socket
+    int reap()
+    {
+        reported = 0;
+        batch_seq++;
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        // one socket yields at most two poll completions, keep room for both
+        while (head != tail && reported < (int)events.size() - 1)
+        {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            head++;
+            uint64_t ud = cqe->user_data;
+            if (ud == CANCEL_TAG)
+                continue;
+            int kind = (int)(ud & 7);
+            if (kind == KIND_SEND || kind == KIND_FILE_READ)
+            {
+                completeSend((int)(ud >> 3), kind, cqe->res);
+                continue;
+            }
+            if (kind == KIND_FILE_WRITE)
+            {
+                completeWrite((int)(ud >> 3), cqe->res);
+                continue;
+            }
+            int fd = (int)((ud & 0xffffffffULL) >> 3);
+            uint32_t gen = (uint32_t)(ud >> 32);
+            if (kind == KIND_RECV && (cqe->flags & IORING_CQE_F_BUFFER))
+                recycle.push_back(cqe->flags >> IORING_CQE_BUFFER_SHIFT); // returned to ring by next wait()
+            bool current = (size_t)fd < fds.size() && fds[fd].registered && fds[fd].gen == gen;
+            if (kind == KIND_ACCEPT || kind == KIND_RECV)
+            {
+                if (!current)
+                {
+                    if (kind == KIND_ACCEPT && cqe->res >= 0)
+                        close(cqe->res); // listener was forgotten meanwhile
+                    continue;
+                }
+                completeMultishot(fd, kind, cqe);
+                continue;
+            }
+            if (!current || cqe->res == -ECANCELED)
+                continue; // poll of socket which was closed in the meantime, or write poll which was removed
+            FdState &st = fds[fd];
+
+            uint32_t mask;
+            if (cqe->res < 0)
+                mask = EPOLLERR;
+            else
+                mask = (uint32_t)cqe->res & (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLRDHUP);
+
+            if (kind == KIND_READ)
+            {
+                st.read_pending = false;
+                mask &= ~EPOLLOUT;
+            }
+            else
+            {
+                st.write_pending = false;
+                if (!st.write_wanted)
+                    continue;
+                mask &= ~(EPOLLIN | EPOLLRDHUP);
+            }
+            rearm.push_back(fd);
+
+            if (st.batch_seq == batch_seq)
+                events[st.batch_idx].events |= mask;
+            else
+            {
+                st.batch_seq = batch_seq;
+                st.batch_idx = reported;
+                report(st.token, mask, 0);
+            }
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return reported;
+    }
+
+    //
+    // Report accepted socket or received data, multishot request which ended is armed again by next wait()
+    // Receive which ran out of provided buffers ends with ENOBUFS, it goes on once buffers are returned
+    void completeMultishot(int fd, int kind, const struct io_uring_cqe *cqe)
+    {
+        FdState &st = fds[fd];
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            st.op_pending = false;
+            if (kind == KIND_ACCEPT || cqe->res > 0 || cqe->res == -ENOBUFS)
+                rearm.push_back(fd);
+        }
+        if (kind == KIND_ACCEPT)
+        {
+            if (cqe->res >= 0)
+                report(st.token, EPOLLIN, cqe->res);
+            else if (cqe->res != -EAGAIN && cqe->res != -ECONNABORTED && cqe->res != -EINTR)
+                printf("io_uring accept: %s\n", strerror(-cqe->res));
+            return;
+        }
+        if (cqe->res == -ENOBUFS)
+            return;
+        const char *received = nullptr;
+        if (cqe->res > 0)
+            received = recv_memory + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * RECV_BUFFER_SIZE;
+        report(st.token, cqe->res >= 0 ? EPOLLIN : EPOLLIN | EPOLLERR, cqe->res, received);
+    }
+
+    //
+    // File segment read into file buffer is sent from there, other completions of sends are reported
+    // Empty read means file shrank below queued segment, it is reported as ENODATA
+    void completeSend(int id, int kind, int res)
+    {
+        SendOp &op = *send_ops[id];
+        if (kind == KIND_FILE_READ && res > 0 && isCurrent(op))
+        {
+            if (queueSend(id, IORING_OP_SEND, res))
+                return;
+            res = -EAGAIN;
+        }
+        if (kind == KIND_FILE_READ && res == 0)
+            res = -ENODATA;
+        reportSend(op, res);
+        releaseSendOp(id);
+    }
+
+    //
+    // Report bytes written once all data is written, the rest of short write is written again
+    // Write which wrote nothing is reported as ENOSPC
+    void completeWrite(int id, int res)
+    {
+        WriteOp &op = *write_ops[id];
+        if (res > 0)
+        {
+            op.done += res;
+            op.offset += res;
+            if (op.done < op.data.size())
+            {
+                if (queueFileWrite(id))
+                    return;
+                res = -EAGAIN;
+            }
+            else
+                res = (int)op.done;
+        }
+        else if (res == 0)
+            res = -ENOSPC;
+        report(op.token, res < 0 ? EPOLLPRI | EPOLLERR : EPOLLPRI, res);
+        releaseWriteOp(id);
+    }
+};
+
+#endif //URINGREACTOR_H
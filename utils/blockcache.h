@@ -0,0 +1,153 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include "tinylfucache.h"
+#include "json.hpp"
+
+//
+// Identity of one version of a file: blocks of a file which changed get new keys and old ones age out
+//
+struct FileVersion
+{
+    dev_t dev = 0;
+    ino_t ino = 0;
+    off_t size = 0;
+    unsigned long long mtime = 0; // ns
+
+    FileVersion() {}
+    FileVersion(const struct stat &st):
+      dev(st.st_dev), ino(st.st_ino), size(st.st_size),
+      mtime(st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec) {}
+
+    bool operator==(const FileVersion &other) const
+    {
+        return dev == other.dev && ino == other.ino && size == other.size && mtime == other.mtime;
+    }
+
+    uint64_t hash() const
+    {
+        uint64_t h = ino * 0x9E3779B97F4A7C15ULL;
+        h ^= dev + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+        h ^= mtime + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+        return h;
+    }
+};
+
+//
+// BlockCache keeps blocks of file data read by downloads, it is shared by all workers
+// Blocks are keyed by file version and block number, TinyLFU admission keeps blocks of hot files
+// when big cold files are read through the cache. Blocks are immutable and shared, readers copy
+// from them outside of the lock.
+//
+class BlockCache
+{
+  public:
+    static const size_t BLOCK_SIZE = 65536;
+
+  private:
+    struct Key
+    {
+        FileVersion file;
+        unsigned long long block;
+
+        bool operator==(const Key &other) const {return file == other.file && block == other.block;}
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const
+        {
+            uint64_t h = key.file.hash();
+            return h ^ (key.block + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2));
+        }
+    };
+
+    using Block = TinyLfuCache<Key, KeyHash>::Value;
+
+    TinyLfuCache<Key, KeyHash> blocks;
+    std::atomic<unsigned long long> bytes_read{0}; // file data read from disk on misses
+
+    // Read block from file, returns nullptr on error
+    Block load(int fd, const Key &key, size_t length)
+    {
+        std::shared_ptr<std::string> data = std::make_shared<std::string>(length, '\0');
+        size_t done = 0;
+        while (done < length)
+        {
+            ssize_t rval = pread(fd, &(*data)[done], length - done, key.block * BLOCK_SIZE + done);
+            if (rval == -1 && errno == EINTR)
+                continue;
+            if (rval == -1)
+            {
+                perror("pread");
+                return nullptr;
+            }
+            if (rval == 0)
+                break; // file shrank
+            done += rval;
+        }
+        bytes_read.fetch_add(done, std::memory_order_relaxed);
+        data->resize(done);
+        return data;
+    }
+
+  public:
+    // Set size of cache in bytes, must be called before workers start
+    void setCapacity(size_t bytes) {blocks.setCapacity(bytes, BLOCK_SIZE);}
+
+    bool isEnabled() const {return blocks.isEnabled();}
+
+    //
+    // Read length bytes at offset of file open as fd, whose version is file, into dest through cache
+    // Returns number of bytes read, less than length at the end of file, or -1 on error
+    ssize_t read(int fd, const FileVersion &file, unsigned long long offset, size_t length, char *dest)
+    {
+        size_t done = 0;
+        while (done < length && offset + done < (unsigned long long)file.size)
+        {
+            Key key{file, (offset + done) / BLOCK_SIZE};
+            unsigned long long block_start = key.block * BLOCK_SIZE;
+            size_t block_length = file.size - block_start < BLOCK_SIZE ? file.size - block_start : BLOCK_SIZE;
+            Block block = blocks.lookup(key);
+            if (block == nullptr)
+            {
+                block = load(fd, key, block_length);
+                if (block == nullptr)
+                    return -1;
+                if (block->size() == block_length) // short block of a file that shrank is not cached
+                    blocks.insert(key, block);
+            }
+
+            size_t skip = offset + done - block_start;
+            if (block->size() <= skip)
+                break;
+            size_t part = block->size() - skip < length - done ? block->size() - skip : length - done;
+            memcpy(dest + done, block->data() + skip, part);
+            done += part;
+            if (block->size() < block_length)
+                break;
+        }
+        return done;
+    }
+
+    nlohmann::json toJson()
+    {
+        nlohmann::json res = blocks.toJson();
+        res["bytes_read"] = bytes_read.load();
+        return res;
+    }
+};
+
+BlockCache blockCache;
+
+#endif //BLOCKCACHE_H
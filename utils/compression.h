@@ -0,0 +1,197 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "json.hpp"
+
+//
+// Compression of chunks of DWL and UPL data, codec is negotiated per request
+// zlib is always built in, zstd only when server is built with HAVE_ZSTD (make ZSTD=1)
+// Chunks which don't shrink enough are sent as they are, so incompressible files (JPEGs, archives)
+// cost only one trial compression of a small sample per block.
+//
+class Compression
+{
+  public:
+    enum Codec { CODEC_NONE = 0, CODEC_ZLIB, CODEC_ZSTD, CODEC_COUNT };
+    static const int LEVEL = 1; // fastest level of both codecs, data is compressed while it is being sent
+    static const size_t SAMPLE_BYTES = 4096; // start of block compressed on trial before the rest of it
+    static const size_t MIN_BYTES = 64; // smaller chunks are never compressed
+
+    // Returns codec of given name, -1 when it is unknown or not built in
+    static int parseCodec(const std::string &name)
+    {
+        if (name == "none")
+            return CODEC_NONE;
+        if (name == "zlib")
+            return CODEC_ZLIB;
+#ifdef HAVE_ZSTD
+        if (name == "zstd")
+            return CODEC_ZSTD;
+#endif
+        return -1;
+    }
+
+    // Returns first known codec of comma separated list in client's order of preference, "none" counts as one,
+    // so "none,zlib" keeps data uncompressed. CODEC_NONE when no entry is known
+    static int negotiate(const std::string &offer)
+    {
+        size_t start = 0;
+        while (start <= offer.size())
+        {
+            size_t comma = offer.find(',', start);
+            if (comma == std::string::npos)
+                comma = offer.size();
+            int codec = parseCodec(offer.substr(start, comma - start));
+            if (codec != -1)
+                return codec;
+            start = comma + 1;
+        }
+        return CODEC_NONE;
+    }
+
+    static const char* name(int codec)
+    {
+        static const char *names[CODEC_COUNT] = {"none", "zlib", "zstd"};
+        return (codec >= 0 && codec < CODEC_COUNT) ? names[codec] : "none";
+    }
+
+    //
+    // Compress length bytes of data with codec into out
+    // Returns false when compressed data wouldn't be at least 1/8 smaller, data is sent as it is then
+    static bool compress(int codec, const char *data, size_t length, std::string &out)
+    {
+        if (length < MIN_BYTES)
+            return false;
+        size_t limit = length - length / 8;
+        if (codec == CODEC_ZLIB)
+        {
+            uLongf size = compressBound(length);
+            out.resize(size);
+            if (compress2(reinterpret_cast<Bytef*>(&out[0]), &size, reinterpret_cast<const Bytef*>(data), length, LEVEL) != Z_OK)
+                return false;
+            out.resize(size);
+        }
+#ifdef HAVE_ZSTD
+        else if (codec == CODEC_ZSTD)
+        {
+            out.resize(ZSTD_compressBound(length));
+            size_t size = ZSTD_compress(&out[0], out.size(), data, length, LEVEL);
+            if (ZSTD_isError(size))
+                return false;
+            out.resize(size);
+        }
+#endif
+        else
+            return false;
+        return out.size() < limit;
+    }
+
+    // True when sample at the start of block shrinks, so its chunks are worth compressing
+    static bool worthCompressing(int codec, const char *data, size_t length)
+    {
+        std::string sample;
+        return compress(codec, data, length < SAMPLE_BYTES ? length : SAMPLE_BYTES, sample);
+    }
+
+    //
+    // Decompress data compressed with codec into out, which may grow to limit bytes at most
+    // Returns false when data is corrupt or decompresses to more than limit bytes
+    static bool decompress(int codec, std::string_view data, size_t limit, std::string &out)
+    {
+        if (codec == CODEC_NONE)
+        {
+            out.assign(data);
+            return true;
+        }
+        if (codec == CODEC_ZLIB)
+        {
+            z_stream stream = {};
+            if (inflateInit(&stream) != Z_OK)
+                return false;
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+            stream.avail_in = data.size();
+            out.clear();
+            int rval = Z_OK;
+            while (rval == Z_OK && out.size() < limit) // truncated input ends with Z_BUF_ERROR
+            {
+                size_t done = out.size();
+                size_t grow = data.size() * 4 + 4096;
+                out.resize(done + grow < limit ? done + grow : limit);
+                stream.next_out = reinterpret_cast<Bytef*>(&out[done]);
+                stream.avail_out = out.size() - done;
+                rval = inflate(&stream, Z_NO_FLUSH);
+                out.resize(out.size() - stream.avail_out);
+            }
+            inflateEnd(&stream);
+            return rval == Z_STREAM_END;
+        }
+#ifdef HAVE_ZSTD
+        if (codec == CODEC_ZSTD)
+        {
+            unsigned long long size = ZSTD_getFrameContentSize(data.data(), data.size());
+            if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN || size > limit)
+                return false;
+            out.resize(size);
+            size_t rval = ZSTD_decompress(&out[0], size, data.data(), data.size());
+            return !ZSTD_isError(rval) && rval == size;
+        }
+#endif
+        return false;
+    }
+};
+
+//
+// Counters of compressed DWL and UPL data per codec, reported by STATS request
+//
+struct CompressionStats
+{
+    struct Counters
+    {
+        std::atomic<unsigned long long> chunks{0}; // chunks read by downloads or received by uploads with codec negotiated
+        std::atomic<unsigned long long> compressed{0}; // chunks which went over the wire compressed
+        std::atomic<unsigned long long> bytes_in{0}; // bytes of file data
+        std::atomic<unsigned long long> bytes_out{0}; // bytes of the same data on the wire, before base64
+    };
+
+    Counters codecs[Compression::CODEC_COUNT];
+
+    void add(int codec, bool compressed, unsigned long long bytes_in, unsigned long long bytes_out)
+    {
+        Counters &counters = codecs[codec];
+        counters.chunks.fetch_add(1, std::memory_order_relaxed);
+        if (compressed)
+            counters.compressed.fetch_add(1, std::memory_order_relaxed);
+        counters.bytes_in.fetch_add(bytes_in, std::memory_order_relaxed);
+        counters.bytes_out.fetch_add(bytes_out, std::memory_order_relaxed);
+    }
+
+    nlohmann::json toJson() const
+    {
+        nlohmann::json res;
+        for (int i = Compression::CODEC_ZLIB; i < Compression::CODEC_COUNT; i++)
+        {
+            if (Compression::parseCodec(Compression::name(i)) != i)
+                continue; // not built in
+            const Counters &counters = codecs[i];
+            nlohmann::json codec;
+            codec["chunks"] = counters.chunks.load();
+            codec["compressed"] = counters.compressed.load();
+            codec["bytes_in"] = counters.bytes_in.load();
+            codec["bytes_out"] = counters.bytes_out.load();
+            res[Compression::name(i)] = codec;
+        }
+        return res;
+    }
+};
+
+CompressionStats compressionStats;
+
+#endif //COMPRESSION_H
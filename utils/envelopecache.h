@@ -0,0 +1,77 @@
+#ifndef ENVELOPECACHE_H
+#define ENVELOPECACHE_H
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include "blockcache.h"
+#include "tinylfucache.h"
+#include "json.hpp"
+
+//
+// EnvelopeCache keeps wire-ready DWL responses with base64 encoded chunks, it is shared by all workers
+// Responses are keyed by file version, path, codec, chunk offset and length, so downloads of a hot file
+// queue the same immutable buffers instead of encoding and dumping every chunk again.
+// Only chunks whose response doesn't depend on the download are cached: not the first one of a
+// download (it tells offset, size and version) and none of segmented downloads.
+//
+class EnvelopeCache
+{
+  public:
+    using Envelope = std::shared_ptr<const std::string>;
+
+  private:
+    struct Key
+    {
+        FileVersion file;
+        std::string path;
+        int codec; // compression negotiated by downloads sharing the response
+        unsigned long long offset;
+        size_t length;
+
+        bool operator==(const Key &other) const
+        {
+            return file == other.file && offset == other.offset && length == other.length && codec == other.codec &&
+                   path == other.path;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const
+        {
+            uint64_t h = key.file.hash();
+            h ^= std::hash<std::string>()(key.path) + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+            h ^= key.offset + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+            h ^= key.length + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+            h ^= key.codec + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+            return h * 0x9E3779B97F4A7C15ULL;
+        }
+    };
+
+    TinyLfuCache<Key, KeyHash> envelopes;
+
+  public:
+    // Set size of cache in bytes for chunks of chunk_size bytes, must be called before workers start
+    void setCapacity(size_t bytes, size_t chunk_size) {envelopes.setCapacity(bytes, chunk_size * 4 / 3 + 128);}
+
+    bool isEnabled() const {return envelopes.isEnabled();}
+
+    // Returns response with chunk of file at offset, nullptr when it isn't cached
+    Envelope find(const FileVersion &file, const std::string &path, int codec, unsigned long long offset, size_t length)
+    {
+        return envelopes.lookup(Key{file, path, codec, offset, length});
+    }
+
+    void add(const FileVersion &file, const std::string &path, int codec, unsigned long long offset, size_t length,
+             const Envelope &envelope)
+    {
+        envelopes.insert(Key{file, path, codec, offset, length}, envelope, true);
+    }
+
+    nlohmann::json toJson() {return envelopes.toJson();}
+};
+
+EnvelopeCache envelopeCache;
+
+#endif //ENVELOPECACHE_H
@@ -0,0 +1,213 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "blockcache.h"
+#include "json.hpp"
+
+//
+// Package of DWL responses of consecutive chunks of a file, read and encoded once for all downloads in a group
+//
+struct FanoutPackage
+{
+    std::vector<std::shared_ptr<const std::string>> envelopes; // wire-ready responses of chunks
+    std::string first_data; // base64 data of first chunk, download starting here describes file in its own response
+    bool first_compressed = false; // first_data is compressed
+    unsigned long long length = 0; // bytes of file data
+    bool last = false; // package ends the file
+};
+
+//
+// FanoutRegistry lets concurrent downloads of the same file version share one producer, it is used by all workers
+// Downloads which go through the file in step form a group, each package is produced by the first download
+// asking for it, and the last window packages stay available for downloads a bit behind. Package is produced
+// without holding any lock, it is only marked in flight, so download asking for it meanwhile doesn't wait
+// and makes its own copy instead. Download which falls behind the window, or which the group left behind
+// because another download asked for packages past its end, is detached and reads the file on its own
+// (mostly from envelope cache the producer filled), so a slow subscriber never stalls the group.
+// Groups nobody asked for in GROUP_IDLE_MS are dropped by sweep() which owner calls periodically while hasGroups().
+//
+class FanoutRegistry
+{
+  public:
+    using Package = std::shared_ptr<const FanoutPackage>;
+    static constexpr int GROUP_IDLE_MS = 10000; // group nobody asked for so long is dropped
+
+  private:
+    struct Key
+    {
+        FileVersion file;
+        std::string path;
+        int chunk_size;
+        int codec;
+
+        bool operator==(const Key &other) const
+        {
+            return file == other.file && chunk_size == other.chunk_size && codec == other.codec && path == other.path;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const
+        {
+            uint64_t h = key.file.hash();
+            h ^= std::hash<std::string>()(key.path) + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+            h ^= key.chunk_size + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+            return h ^ (key.codec + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2));
+        }
+    };
+
+    struct Group
+    {
+        std::mutex mtx; // guards group, never held while package is produced
+        std::deque<Package> window; // last produced packages
+        unsigned long long first = 0; // index of window.front()
+        bool complete = false; // last package of the file was produced
+        bool in_flight = false; // package following the window is being produced
+        unsigned long long round = 0; // incremented when group starts over, producer of older round doesn't publish
+        std::chrono::steady_clock::time_point last_used; // guarded by registry lock
+    };
+
+    std::unordered_map<Key, std::shared_ptr<Group>, KeyHash> groups;
+    std::mutex mtx;
+    size_t window_size = 0; // packages kept by group, 0 disables fan-out
+    std::atomic<size_t> group_count{0}; // size of groups, read without registry lock
+
+    std::atomic<unsigned long long> produced{0}; // packages read and encoded
+    std::atomic<unsigned long long> shared{0}; // packages served from window of a group
+    std::atomic<unsigned long long> detached{0}; // requests for packages which left the window
+    std::atomic<unsigned long long> overlapped{0}; // packages produced again because another download was producing them
+
+    std::shared_ptr<Group> findGroup(const Key &key)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::shared_ptr<Group> &group = groups[key];
+        if (group == nullptr)
+        {
+            group = std::make_shared<Group>();
+            group_count.store(groups.size(), std::memory_order_relaxed);
+        }
+        group->last_used = std::chrono::steady_clock::now();
+        return group;
+    }
+
+  public:
+    // Set number of packages kept by every group, must be called before workers start
+    void setWindow(size_t packages) {window_size = packages;}
+
+    bool isEnabled() const {return window_size > 0;}
+
+    // True when there are groups for sweep() to drop once they go idle
+    bool hasGroups() const {return group_count.load(std::memory_order_relaxed) > 0;}
+
+    // Drop groups nobody asked for in GROUP_IDLE_MS, downloads still holding them finish their package
+    void sweep()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = groups.begin(); it != groups.end(); )
+        {
+            if (now - it->second->last_used > std::chrono::milliseconds(GROUP_IDLE_MS))
+                it = groups.erase(it);
+            else
+                ++it;
+        }
+        group_count.store(groups.size(), std::memory_order_relaxed);
+    }
+
+    //
+    // Return package number index of file, produce is called when nobody made it yet
+    // Starting is true for first package of download, it may start a new round of group which went through the file
+    // Returns nullptr when package left the window, download has to read the file on its own then
+    Package get(const FileVersion &file, const std::string &path, int chunk_size, int codec, unsigned long long index,
+                bool starting, const std::function<Package()> &produce)
+    {
+        std::shared_ptr<Group> group = findGroup(Key{file, path, chunk_size, codec});
+        std::unique_lock<std::mutex> lock(group->mtx);
+        if (group->window.empty() && !group->in_flight)
+            group->first = index;
+        unsigned long long next = group->first + group->window.size(); // package in flight, if there is one
+        bool restart = index > next + (group->in_flight ? 1 : 0); // download ahead of the group
+        if (index < group->first)
+        {
+            if (!group->complete || !starting)
+            {
+                detached.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            restart = true; // new wave of downloads after the group went through whole file
+        }
+        else if (index < next)
+        {
+            shared.fetch_add(1, std::memory_order_relaxed);
+            return group->window[index - group->first];
+        }
+        if (restart)
+        {
+            // Group starts over from package of this download, ones left behind get detached
+            group->window.clear();
+            group->first = index;
+            group->complete = false;
+            group->in_flight = false;
+            group->round++;
+        }
+        else if (group->in_flight)
+        {
+            // Another download is producing this package or the one before, make own copy instead of waiting
+            lock.unlock();
+            Package package = produce();
+            if (package != nullptr)
+                overlapped.fetch_add(1, std::memory_order_relaxed);
+            return package;
+        }
+
+        group->in_flight = true;
+        unsigned long long round = group->round;
+        lock.unlock();
+        Package package = produce();
+        lock.lock();
+        if (group->round != round)
+            return package; // group started over meanwhile, package doesn't follow its window
+        group->in_flight = false;
+        if (package == nullptr)
+            return nullptr;
+        produced.fetch_add(1, std::memory_order_relaxed);
+        group->window.push_back(package);
+        group->complete = package->last;
+        while (group->window.size() > window_size)
+        {
+            group->window.pop_front();
+            group->first++;
+        }
+        return package;
+    }
+
+    nlohmann::json toJson()
+    {
+        nlohmann::json res;
+        res["window"] = window_size;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            res["groups"] = groups.size();
+        }
+        res["produced"] = produced.load();
+        res["shared"] = shared.load();
+        res["detached"] = detached.load();
+        res["overlapped"] = overlapped.load();
+        return res;
+    }
+};
+
+FanoutRegistry fanout;
+
+#endif //FANOUT_H
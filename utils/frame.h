@@ -0,0 +1,60 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#define FRAMING_JSON 1 // '\0' terminated JSON requests, '\n' terminated JSON responses
+#define FRAMING_BINARY 2 // length prefixed frames, negotiated with "framing":2 in AUTH request
+
+//
+// Header of a frame in FRAMING_BINARY, followed by length bytes of payload
+// Wire layout (big endian): opcode u8, flags u8, reserved u16, stream id u32, payload length u32
+// Payload is JSON message, with FRAME_RAW flag it is JSON message, '\0' and raw bytes (UPL data, DWL file data).
+// Responses carry stream id of the request they answer, last response of a request has FRAME_FIN flag.
+//
+struct FrameHeader
+{
+    static const size_t SIZE = 12;
+    static const uint32_t MAX_LENGTH = (16 << 20) + 16384; // longest payload: 16 MB of raw data and its JSON message
+
+    enum Opcode { REQUEST = 1, RESPONSE = 2 };
+    enum Flags { FRAME_FIN = 1, FRAME_RAW = 2 };
+
+    uint8_t opcode = REQUEST;
+    uint8_t flags = 0;
+    uint32_t stream = 0;
+    uint32_t length = 0;
+
+    FrameHeader() {}
+    FrameHeader(uint8_t opcode, uint8_t flags, uint32_t stream, uint32_t length):
+      opcode(opcode), flags(flags), stream(stream), length(length) {}
+
+    static FrameHeader decode(const char *in)
+    {
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(in);
+        FrameHeader header;
+        header.opcode = p[0];
+        header.flags = p[1];
+        header.stream = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) | ((uint32_t)p[6] << 8) | p[7];
+        header.length = ((uint32_t)p[8] << 24) | ((uint32_t)p[9] << 16) | ((uint32_t)p[10] << 8) | p[11];
+        return header;
+    }
+
+    std::string encode() const
+    {
+        char out[SIZE];
+        out[0] = (char)opcode;
+        out[1] = (char)flags;
+        out[2] = out[3] = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            out[4 + i] = (char)(stream >> (24 - 8 * i));
+            out[8 + i] = (char)(length >> (24 - 8 * i));
+        }
+        return std::string(out, SIZE);
+    }
+};
+
+#endif //FRAME_H
@@ -0,0 +1,156 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+//
+// MappedFile is a read-only shared mapping of a whole file
+// Downloads of the same file version (inode, size and mtime) share one mapping through MappedFiles registry,
+// mapping is unmapped when the last download holding it ends.
+// Access past the end of a file truncated while mapped raises SIGBUS. Readers guard their accesses with
+// Guard, the handler then maps a zero page over the faulting one and marks the mapping damaged,
+// so reader can discard what it read instead of the whole server being killed.
+//
+struct MappedFile
+{
+    char *data;
+    size_t length;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    std::atomic<bool> damaged{false}; // set by SIGBUS handler, file shrank under the mapping
+
+    MappedFile(char *data, size_t length, const struct stat &st):
+      data(data), length(length), dev(st.st_dev), ino(st.st_ino), mtime(st.st_mtim) {}
+
+    ~MappedFile()
+    {
+        munmap(data, length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isDamaged() const {return damaged.load();}
+
+    bool sameVersion(const struct stat &st) const
+    {
+        return (st.st_size == (off_t)length && st.st_mtim.tv_sec == mtime.tv_sec && st.st_mtim.tv_nsec == mtime.tv_nsec);
+    }
+
+    //
+    // Marks mapping read by this thread, SIGBUS inside it is survived
+    //
+    class Guard
+    {
+      public:
+        Guard(MappedFile *file) {guarded = file;}
+        ~Guard() {guarded = nullptr;}
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    static thread_local MappedFile *guarded;
+
+    // Install SIGBUS handler, must be called before first mapping is read
+    static int installFaultHandler()
+    {
+        struct sigaction sa = {};
+        sa.sa_sigaction = onFault;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGBUS, &sa, nullptr) == -1)
+        {
+            perror("sigaction(SIGBUS)");
+            return -1;
+        }
+        return 0;
+    }
+
+  private:
+    static void onFault(int, siginfo_t *info, void *)
+    {
+        MappedFile *file = guarded;
+        char *addr = static_cast<char*>(info->si_addr);
+        if (file == nullptr || addr < file->data || addr >= file->data + file->length)
+        {
+            // Not ours, faulting instruction runs again and default action kills process
+            signal(SIGBUS, SIG_DFL);
+            return;
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        char *page_addr = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(addr) & ~(uintptr_t)(page - 1));
+        if (mmap(page_addr, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            signal(SIGBUS, SIG_DFL);
+            return;
+        }
+        file->damaged.store(true);
+    }
+};
+
+thread_local MappedFile *MappedFile::guarded = nullptr;
+
+//
+// MappedFiles shares mappings between downloads of the same file, it is used by all workers
+// Registry holds weak references only, so it never keeps a mapping alive
+//
+class MappedFiles
+{
+  private:
+    std::map<std::pair<dev_t, ino_t>, std::weak_ptr<MappedFile>> files;
+    std::mutex mtx;
+
+  public:
+    //
+    // Return mapping of file open as fd with given stat, current mapping is reused when file hasn't changed
+    // Returns nullptr when file is empty or can't be mapped
+    std::shared_ptr<MappedFile> acquire(int fd, const struct stat &st)
+    {
+        if (st.st_size <= 0)
+            return nullptr;
+        std::pair<dev_t, ino_t> key(st.st_dev, st.st_ino);
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = files.find(key);
+        if (it != files.end())
+        {
+            std::shared_ptr<MappedFile> file = it->second.lock();
+            if (file != nullptr && file->sameVersion(st) && !file->isDamaged())
+                return file;
+        }
+
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            perror("mmap");
+            return nullptr;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(static_cast<char*>(data), st.st_size, st);
+        files[key] = file;
+
+        // Drop entries of mappings which are gone, so registry doesn't grow with every file ever downloaded
+        for (auto jt = files.begin(); jt != files.end(); )
+        {
+            if (jt->second.expired())
+                jt = files.erase(jt);
+            else
+                ++jt;
+        }
+        return file;
+    }
+};
+
+MappedFiles mappedFiles;
+
+#endif //MAPPEDFILE_H
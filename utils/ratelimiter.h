@@ -0,0 +1,84 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <stdint.h>
+#include <atomic>
+
+//
+// RateLimiter is token bucket of download bytes shared by all workers, so -rate limits the whole server
+// Worker takes a grant of tokens before its scheduler runs and gives back what it didn't use,
+// debt of last package which overshot the grant is paid from following refills.
+// Bucket is updated with atomic operations only, the worker which moves refill time forward adds
+// tokens for that interval, so concurrent refills never count the same time twice.
+//
+class RateLimiter
+{
+  private:
+    std::atomic<long long> tokens{0}; // bytes which may be handed out, negative while debt is paid
+    std::atomic<uint64_t> refill_time{0}; // time in ms of last refill
+    long long per_ms = 0; // bytes added per ms, 0 disables limit
+    long long burst = 0; // most tokens saved up while workers are idle
+
+  public:
+    // Set rate in KB/s (0 disables limit) and most bytes saved up, called before workers start
+    void setRate(int kb_per_s, long long burst, uint64_t now)
+    {
+        per_ms = kb_per_s > 0 ? kb_per_s * 1024LL / 1000 : 0;
+        if (kb_per_s > 0 && per_ms == 0)
+            per_ms = 1;
+        this->burst = burst;
+        tokens.store(0);
+        refill_time.store(now);
+    }
+
+    bool isEnabled() const {return per_ms > 0;}
+
+    // Add tokens for time passed since last refill, at most burst of them
+    void refill(uint64_t now)
+    {
+        uint64_t last = refill_time.load(std::memory_order_relaxed);
+        if (now <= last || !refill_time.compare_exchange_strong(last, now, std::memory_order_relaxed))
+            return; // other worker refilled meanwhile
+        long long add = (long long)(now - last) * per_ms;
+        long long cur = tokens.load(std::memory_order_relaxed);
+        long long next;
+        do
+        {
+            next = cur + add > burst ? burst : cur + add;
+        } while (next > cur && !tokens.compare_exchange_weak(cur, next, std::memory_order_relaxed));
+    }
+
+    // Take up to max tokens, returns 0 when there are none
+    long long acquire(long long max)
+    {
+        long long cur = tokens.load(std::memory_order_relaxed);
+        long long grant;
+        do
+        {
+            if (cur <= 0)
+                return 0;
+            grant = cur < max ? cur : max;
+        } while (!tokens.compare_exchange_weak(cur, cur - grant, std::memory_order_relaxed));
+        return grant;
+    }
+
+    // Give back unused part of grant, negative value is overshoot which becomes debt
+    void release(long long unused)
+    {
+        if (unused != 0)
+            tokens.fetch_add(unused, std::memory_order_relaxed);
+    }
+
+    // Milliseconds until refills pay the debt off, 0 when tokens are available
+    int waitMs() const
+    {
+        long long cur = tokens.load(std::memory_order_relaxed);
+        if (cur > 0)
+            return 0;
+        return (int)(-cur / per_ms) + 1;
+    }
+};
+
+RateLimiter rateLimiter;
+
+#endif //RATELIMITER_H
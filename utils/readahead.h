@@ -0,0 +1,249 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "threadpool.h"
+#include "stats.h"
+#include "completionqueue.h"
+#include "json.hpp"
+
+//
+// Block of file data read on an I/O thread, download and the job reading it share it
+// Job sets ready after filling data, so download never touches a block which is still being read
+//
+struct ReadBlock
+{
+    unsigned long long offset = 0;
+    size_t length = 0; // bytes asked for
+    std::vector<char> data;
+    ssize_t result = 0; // bytes read, less than length at the end of file, -1 on error
+    std::vector<std::string> packed; // compressed chunks made by encoder, empty ones are sent as they are
+    std::atomic<bool> ready{false};
+};
+
+//
+// Counters of read-ahead of all downloads, reported by STATS request
+//
+struct ReadAheadStats
+{
+    std::atomic<unsigned long long> blocks{0}; // blocks read on I/O threads
+    std::atomic<unsigned long long> bytes{0};
+    std::atomic<unsigned long long> stalls{0}; // times download wanted block which wasn't read yet
+    std::atomic<unsigned long long> grows{0}; // times window of a download was doubled
+    std::atomic<unsigned long long> deferred{0}; // times download waited for room in full pool queue
+    std::atomic<unsigned long long> max_window{0}; // largest window in blocks any download has grown to
+
+    void reachWindow(unsigned long long window)
+    {
+        unsigned long long seen = max_window.load(std::memory_order_relaxed);
+        while (seen < window && !max_window.compare_exchange_weak(seen, window, std::memory_order_relaxed))
+            ;
+    }
+
+    nlohmann::json toJson() const
+    {
+        nlohmann::json res;
+        res["blocks"] = blocks.load();
+        res["bytes"] = bytes.load();
+        res["stalls"] = stalls.load();
+        res["grows"] = grows.load();
+        res["deferred"] = deferred.load();
+        res["max_window"] = max_window.load();
+        return res;
+    }
+};
+
+ReadAheadStats readAheadStats;
+
+//
+// ReadAhead keeps window of blocks following download's offset read on thread pool, so the event loop
+// encodes only data which is in memory already. Every finished block posts a completion for the
+// connection and worker wakes downloads waiting for it. Window starts at given number of blocks
+// and doubles (up to max_window) whenever download asks for a block which isn't read yet, that is
+// when client takes data faster than reads of the window complete.
+// Reader and optional encoder, which prepares data of block for sending once it is read (compresses it),
+// run on pool threads, they must not refer to the download which can end while blocks are read.
+// Nothing is read or encoded on the event loop: when pool queue is full and none of download's blocks
+// is being read, download waits until pool posts completion telling there is room in the queue.
+// Downloads which send data from page cache (shared mapping, sendfile()) don't keep blocks, reader only
+// pages the range in on pool thread, dest is then scratch buffer of the thread.
+//
+class ReadAhead
+{
+  public:
+    using Block = std::shared_ptr<ReadBlock>;
+    using Reader = std::function<ssize_t(unsigned long long at, size_t length, char *dest)>;
+    using Encoder = std::function<void(ReadBlock &block)>;
+    static const size_t MAX_WINDOW = 32; // blocks, unless initial window is bigger
+
+  private:
+    ThreadPool *pool;
+    CompletionQueue *completions;
+    uint64_t conn_id;
+    Reader reader; // empty until start(), read-ahead is disabled then
+    Encoder encoder;
+    std::deque<Block> blocks; // consecutive blocks, the first one holds or follows download's offset
+    unsigned long long next; // offset of first block not asked for yet
+    unsigned long long end; // blocks are not read past it
+    size_t block_size;
+    size_t window; // blocks read ahead
+    size_t max_window;
+    bool keep; // blocks hold data read, otherwise read only brings it into page cache
+
+    static void read(ReadBlock &block, const Reader &reader, const Encoder &encoder, bool keep)
+    {
+        static thread_local std::vector<char> scratch;
+        char *dest;
+        if (keep)
+        {
+            block.data.resize(block.length);
+            dest = block.data.data();
+        }
+        else
+        {
+            if (scratch.size() < block.length)
+                scratch.resize(block.length);
+            dest = scratch.data();
+        }
+        try
+        {
+            block.result = reader(block.offset, block.length, dest);
+            if (block.result > 0 && encoder)
+                encoder(block);
+        }
+        catch (...)
+        {
+            block.result = -1;
+        }
+        if (block.result > 0)
+            ServerStats::add(readAheadStats.bytes, block.result);
+    }
+
+    Block makeBlock()
+    {
+        Block block = std::make_shared<ReadBlock>();
+        block->offset = next;
+        block->length = end - next < block_size ? end - next : block_size;
+        return block;
+    }
+
+    // Start reads of blocks until window is full, stops when pool queue is full
+    // If it refuses the first block, pool posts completion once there is room for it
+    void fill()
+    {
+        while (blocks.size() < window && next < end)
+        {
+            Block block = makeBlock();
+            Reader reader = this->reader;
+            Encoder encoder = this->encoder;
+            CompletionQueue *completions = this->completions;
+            uint64_t id = conn_id;
+            bool keep = this->keep;
+            ThreadPool::Job job = [block, reader, encoder, completions, id, keep]()
+            {
+                read(*block, reader, encoder, keep);
+                block->ready.store(true, std::memory_order_release);
+                ServerStats::add(readAheadStats.blocks);
+                completions->post(Completion(id, "", Completion::READ_AHEAD));
+            };
+            bool queued;
+            if (blocks.empty())
+                queued = pool->submit(job, [completions, id]() {completions->post(Completion(id, "", Completion::READ_AHEAD));});
+            else
+                queued = pool->submit(job);
+            if (!queued)
+                break;
+            blocks.push_back(block);
+            next += block->length;
+        }
+    }
+
+  public:
+    ReadAhead(): pool(nullptr), completions(nullptr), conn_id(0), next(0), end(0), block_size(0), window(0), max_window(0), keep(true) {}
+
+    ReadAhead(const ReadAhead&) = delete;
+    ReadAhead& operator=(const ReadAhead&) = delete;
+
+    //
+    // Enable read-ahead of file up to end in blocks of block_size read on pool, completions of blocks
+    // are posted to given queue for connection conn_id. Blocks started with keep false hold no data.
+    void start(ThreadPool *pool, CompletionQueue *completions, uint64_t conn_id, Reader reader, Encoder encoder,
+               size_t block_size, unsigned long long end, size_t window, bool keep = true)
+    {
+        this->keep = keep;
+        this->pool = pool;
+        this->completions = completions;
+        this->conn_id = conn_id;
+        this->reader = reader;
+        this->encoder = encoder;
+        this->block_size = block_size;
+        this->end = end;
+        this->window = window;
+        readAheadStats.reachWindow(window);
+        max_window = window > MAX_WINDOW ? window : MAX_WINDOW;
+        blocks.clear();
+        next = 0;
+    }
+
+    bool isEnabled() const {return (bool)reader;}
+
+    //
+    // Return block holding offset when it is in memory and start reads of blocks which follow it
+    // Returns nullptr when block is still being read or pool queue is full, completion is posted to the
+    // connection when the block is read or when there is room in the queue
+    Block get(unsigned long long offset)
+    {
+        while (!blocks.empty() && blocks.front()->offset + blocks.front()->length <= offset)
+            blocks.pop_front(); // download went past it, job still owns block being read
+        if (!blocks.empty() && blocks.front()->offset > offset)
+            blocks.clear(); // download moved back, start over from its offset
+        bool fresh = blocks.empty();
+        if (fresh)
+            next = offset;
+        fill();
+
+        if (blocks.empty())
+        {
+            ServerStats::add(readAheadStats.deferred); // queue is full, pool tells when to ask again
+            return nullptr;
+        }
+        if (!blocks.front()->ready.load(std::memory_order_acquire))
+        {
+            if (!fresh) // block was asked for earlier and still isn't there, read further ahead
+            {
+                ServerStats::add(readAheadStats.stalls);
+                if (window < max_window)
+                {
+                    window = window * 2 < max_window ? window * 2 : max_window;
+                    ServerStats::add(readAheadStats.grows);
+                    readAheadStats.reachWindow(window);
+                    fill();
+                }
+            }
+            return nullptr;
+        }
+        return blocks.front();
+    }
+
+    // True when block holding offset is in memory, or when no block is being read and it should be asked for again
+    bool isReady(unsigned long long offset) const
+    {
+        if (blocks.empty())
+            return true;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (blocks[i]->offset <= offset && offset < blocks[i]->offset + blocks[i]->length)
+                return blocks[i]->ready.load(std::memory_order_acquire);
+        }
+        return false;
+    }
+};
+
+#endif //READAHEAD_H
@@ -0,0 +1,220 @@
+#ifndef RECVBUFFER_H
+#define RECVBUFFER_H
+
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <vector>
+#include <deque>
+#include <string_view>
+#include "frame.h"
+
+//
+// RecvBuffer collects bytes read from socket and splits them into delimiter terminated frames
+// Data is read straight into one contiguous buffer, consumed space at the front is reclaimed by moving
+// the unconsumed tail back to the beginning, so a frame is never split and can be handed out as a view.
+// Read size adapts to the traffic: it grows while reads fill it up and shrinks when they come back short.
+// Delimiters are searched with memchr which scans whole words/vectors at once.
+// After setLengthPrefixed() frames are FrameHeader prefixed instead, payloads are located from headers.
+// Frames over limits given to setLimits() mark buffer oversize: delimited frame or JSON message of length
+// prefixed frame once it is longer than max_message, length prefixed frame as soon as its header is in.
+//
+class RecvBuffer
+{
+  public:
+    static const size_t MIN_READ = 2048;
+    static const size_t MAX_READ = 65536;
+    static const size_t MAX_IDLE_CAPACITY = 4 * MAX_READ; // larger buffer is freed when it becomes empty
+
+  private:
+    struct Frame
+    {
+        size_t offset; // of payload
+        size_t length;
+        FrameHeader header; // default request header for delimited frames
+    };
+
+    std::vector<char> data; // allocated on first read
+    size_t head; // start of first unconsumed frame
+    size_t frame_start; // start of frame which is not complete yet
+    size_t scan; // bytes before scan are already searched for delimiter
+    size_t tail; // end of received data
+    size_t read_size; // size of next read
+    char delim;
+    bool length_prefixed;
+    size_t max_message; // longest delimited frame or JSON message of length prefixed frame, 0 is unlimited
+    size_t max_frame; // longest payload of FRAME_RAW frame, 0 is unlimited
+    bool oversize; // frame over limits was received, no frames are split after it
+    std::deque<Frame> frames; // complete frames, not consumed yet
+
+  public:
+    RecvBuffer(char delim = '\0'):
+      head(0), frame_start(0), scan(0), tail(0), read_size(MIN_READ), delim(delim), length_prefixed(false),
+      max_message(0), max_frame(0), oversize(false) {}
+
+    void setLimits(size_t max_message, size_t max_frame)
+    {
+        this->max_message = max_message;
+        this->max_frame = max_frame;
+    }
+
+    bool isOversize() const {return oversize;}
+
+    //
+    // Read once from fd into buffer and split received data into frames
+    // Returns read() result, views returned by front() before this call are invalidated
+    //
+    ssize_t readFrom(int fd)
+    {
+        reserve(read_size);
+        ssize_t rval = read(fd, data.data() + tail, read_size);
+        if (rval <= 0)
+            return rval;
+        tail += rval;
+        if ((size_t)rval == read_size && read_size < MAX_READ)
+            read_size *= 2;
+        else if ((size_t)rval < read_size / 4 && read_size > MIN_READ)
+            read_size /= 2;
+        scanFrames();
+        return rval;
+    }
+
+    //
+    // Append len bytes received by completion-based backend and split them into frames
+    // Views returned by front() before this call are invalidated
+    //
+    void append(const char *src, size_t len)
+    {
+        reserve(len);
+        memcpy(data.data() + tail, src, len);
+        tail += len;
+        scanFrames();
+    }
+
+    size_t framesQueued() const {return frames.size();}
+
+    // Number of bytes of frame which is not complete yet
+    size_t partialSize() const {return tail - frame_start;}
+
+    //
+    // View of first complete frame without delimiter
+    // Stays valid after pop() until next readFrom(), append() or clear()
+    std::string_view front() const
+    {
+        return std::string_view(data.data() + frames.front().offset, frames.front().length);
+    }
+
+    FrameHeader frontHeader() const {return frames.front().header;}
+
+    //
+    // Switch to length prefixed frames for data following frames popped so far
+    // Frames queued after them were split by delimiter, they are dropped and data is split again
+    void setLengthPrefixed()
+    {
+        length_prefixed = true;
+        frames.clear();
+        frame_start = scan = head;
+        scanFrames();
+    }
+
+    void pop()
+    {
+        frames.pop_front();
+        head = frames.empty() ? frame_start : frames.front().offset;
+    }
+
+    void clear()
+    {
+        frames.clear();
+        head = frame_start = scan = tail = 0;
+        read_size = MIN_READ;
+        oversize = false;
+        std::vector<char>().swap(data);
+    }
+
+  private:
+    // Make room for len bytes after tail, compacting or growing the buffer
+    void reserve(size_t len)
+    {
+        if (head == tail && frames.empty())
+        {
+            head = frame_start = scan = tail = 0;
+            if (data.size() > MAX_IDLE_CAPACITY)
+                std::vector<char>().swap(data);
+        }
+        else if (head > 0 && (tail + len > data.size() || head >= data.size() / 2))
+        {
+            memmove(data.data(), data.data() + head, tail - head);
+            for (size_t i = 0; i < frames.size(); i++)
+                frames[i].offset -= head;
+            frame_start -= head;
+            scan -= head;
+            tail -= head;
+            head = 0;
+        }
+        if (tail + len > data.size())
+        {
+            size_t capacity = data.size() * 2;
+            if (capacity < tail + len)
+                capacity = tail + len;
+            data.resize(capacity);
+        }
+    }
+
+    // True when limit is set and length exceeds it
+    static bool exceeds(size_t length, size_t limit) {return limit > 0 && length > limit;}
+
+    void scanFrames()
+    {
+        if (oversize)
+            return;
+        if (length_prefixed)
+        {
+            while (tail - frame_start >= FrameHeader::SIZE)
+            {
+                FrameHeader header = FrameHeader::decode(data.data() + frame_start);
+                bool raw = header.flags & FrameHeader::FRAME_RAW;
+                if (exceeds(header.length, raw ? max_frame : max_message))
+                {
+                    oversize = true;
+                    return;
+                }
+                size_t offset = frame_start + FrameHeader::SIZE;
+                if (tail - offset < header.length)
+                    break;
+                // JSON message of FRAME_RAW frame ends with '\0', it is looked for only within the limit
+                if (raw && max_message > 0 && header.length > max_message &&
+                    memchr(data.data() + offset, '\0', max_message + 1) == nullptr)
+                {
+                    oversize = true;
+                    return;
+                }
+                frames.push_back(Frame{offset, header.length, header});
+                frame_start = offset + header.length;
+            }
+            scan = tail;
+            return;
+        }
+        while (scan < tail)
+        {
+            char *found = static_cast<char*>(memchr(data.data() + scan, delim, tail - scan));
+            if (found == nullptr)
+            {
+                scan = tail;
+                break;
+            }
+            size_t end = found - data.data();
+            if (exceeds(end - frame_start, max_message))
+            {
+                oversize = true;
+                return;
+            }
+            frames.push_back(Frame{frame_start, end - frame_start, FrameHeader()});
+            frame_start = scan = end + 1;
+        }
+        if (exceeds(tail - frame_start, max_message))
+            oversize = true;
+    }
+};
+
+#endif //RECVBUFFER_H
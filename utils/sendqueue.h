@@ -0,0 +1,227 @@
+#ifndef SENDQUEUE_H
+#define SENDQUEUE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string>
+#include <deque>
+#include <memory>
+#include <vector>
+
+//
+// Open file descriptor closed when last segment referring to it is destroyed
+//
+struct FileHandle
+{
+    int fd;
+
+    explicit FileHandle(int fd): fd(fd) {}
+    ~FileHandle()
+    {
+        if (fd != -1)
+            close(fd);
+    }
+
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+};
+
+//
+// SendQueue holds responses waiting to be sent as a list of immutable segments
+// Memory segments are shared pointers, so one buffer can be queued on many connections without copying.
+// File segments are ranges of an open file, they are sent with sendfile() straight from the page cache.
+// flush() gathers up to IOV_MAX consecutive memory segments into single sendmsg() call or sends
+// front file segment, partially sent front segment is tracked with a byte cursor instead of erasing sent bytes.
+// Message (frame) may span several segments, inMessage() tells when the queue stopped inside one,
+// so owner can switch to another queue only at message boundaries.
+// Completion-based backends send on their own: prepare() describes the same data flush() would send
+// and consume() accounts for the bytes they sent.
+//
+class SendQueue
+{
+  public:
+    using string = std::string;
+    using Segment = std::shared_ptr<const string>;
+    using File = std::shared_ptr<FileHandle>;
+    static const int MAX_IOV = IOV_MAX;
+
+    //
+    // One send prepared by prepare(): gathered memory segments or range of front file segment
+    // It holds references to queued buffers and file, so they outlive the send even when queue is cleared meanwhile
+    //
+    struct Batch
+    {
+        std::vector<struct iovec> iov; // empty when front segment is a file
+        std::vector<Segment> hold;
+        File file;
+        off_t offset = 0; // of data in file
+        size_t length = 0;
+    };
+
+  private:
+    struct Entry
+    {
+        Segment data; // nullptr for file segment
+        File file;
+        off_t offset; // offset in file
+        size_t length;
+        bool message_end; // last segment of a message
+    };
+
+    std::deque<Entry> segments;
+    size_t cursor; // bytes of front segment already sent
+    size_t queued; // bytes not sent yet
+    bool in_message; // part of front message has been sent
+
+  public:
+    SendQueue(): cursor(0), queued(0), in_message(false) {}
+
+    // message_end is false for segments followed by the rest of the same message
+    void push(string data, bool message_end = true)
+    {
+        if (data.empty())
+            return;
+        push(std::make_shared<const string>(std::move(data)), message_end);
+    }
+
+    void push(const Segment &segment, bool message_end = true)
+    {
+        if (segment == nullptr || segment->empty())
+            return;
+        queued += segment->size();
+        segments.push_back(Entry{segment, nullptr, 0, segment->size(), message_end});
+    }
+
+    // Queue length bytes of file starting at offset
+    void push(const File &file, off_t offset, size_t length, bool message_end = true)
+    {
+        if (length == 0)
+            return;
+        queued += length;
+        segments.push_back(Entry{nullptr, file, offset, length, message_end});
+    }
+
+    bool empty() const {return segments.empty();}
+    size_t size() const {return segments.size();}
+    size_t bytes() const {return queued;}
+    bool inMessage() const {return in_message;}
+
+    void clear()
+    {
+        segments.clear();
+        cursor = 0;
+        queued = 0;
+        in_message = false;
+    }
+
+    //
+    // Send as much as possible with one sendmsg() or sendfile() call
+    // With message_only set the call doesn't go past the end of front message
+    // Returns result of the call, completed is set to number of segments sent completely
+    // File which got shorter than its queued segment is reported as -1 with errno set to ENODATA
+    //
+    ssize_t flush(int fd, int &completed, bool message_only = false)
+    {
+        completed = 0;
+        if (segments.empty())
+            return 0;
+
+        ssize_t sent;
+        if (segments.front().file != nullptr)
+        {
+            Entry &front = segments.front();
+            off_t offset = front.offset + cursor;
+            sent = sendfile(fd, front.file->fd, &offset, front.length - cursor);
+            if (sent == 0)
+            {
+                errno = ENODATA;
+                return -1;
+            }
+        }
+        else
+        {
+            struct iovec iov[MAX_IOV];
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = gather(iov, nullptr, message_only);
+            sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        if (sent <= 0)
+            return sent;
+        completed = consume(sent);
+        return sent;
+    }
+
+    //
+    // Describe data flush() would send in batch, returns false when there is nothing to send
+    //
+    bool prepare(Batch &batch, bool message_only = false)
+    {
+        if (segments.empty())
+            return false;
+        if (segments.front().file != nullptr)
+        {
+            const Entry &front = segments.front();
+            batch.file = front.file;
+            batch.offset = front.offset + cursor;
+            batch.length = front.length - cursor;
+            return true;
+        }
+        batch.iov.resize(segments.size() < (size_t)MAX_IOV ? segments.size() : MAX_IOV);
+        batch.iov.resize(gather(batch.iov.data(), &batch.hold, message_only));
+        return true;
+    }
+
+    //
+    // Account sent bytes of front segments, returns number of segments sent completely
+    //
+    int consume(size_t sent)
+    {
+        int completed = 0;
+        queued -= sent;
+        size_t left = sent;
+        while (left > 0)
+        {
+            size_t rest = segments.front().length - cursor;
+            if (left < rest)
+            {
+                cursor += left;
+                in_message = true;
+                break;
+            }
+            left -= rest;
+            in_message = !segments.front().message_end;
+            segments.pop_front();
+            cursor = 0;
+            completed++;
+        }
+        return completed;
+    }
+
+  private:
+    // Fill iov with consecutive memory segments from the front, their buffers are added to hold when it is given
+    int gather(struct iovec *iov, std::vector<Segment> *hold, bool message_only)
+    {
+        int count = 0;
+        for (size_t i = 0; i < segments.size() && count < MAX_IOV && segments[i].data != nullptr; i++)
+        {
+            size_t skip = (i == 0) ? cursor : 0;
+            iov[count].iov_base = const_cast<char*>(segments[i].data->data()) + skip;
+            iov[count].iov_len = segments[i].length - skip;
+            if (hold != nullptr)
+                hold->push_back(segments[i].data);
+            count++;
+            if (message_only && segments[i].message_end)
+                break;
+        }
+        return count;
+    }
+};
+
+#endif //SENDQUEUE_H
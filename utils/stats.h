@@ -0,0 +1,170 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "json.hpp"
+
+//
+// Histogram of durations in microseconds with power of two buckets, safe to update from all workers
+// Percentiles are reported as upper bound of the bucket they fall in
+//
+struct LatencyHistogram
+{
+    static const int BUCKETS = 32; // bucket i counts durations below 2^i us, the last one everything longer
+
+    std::atomic<unsigned long long> counts[BUCKETS] = {};
+    std::atomic<unsigned long long> max_us{0};
+
+    void record(unsigned long long us)
+    {
+        int bucket = 0;
+        while (bucket + 1 < BUCKETS && (1ULL << bucket) <= us)
+            bucket++;
+        counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        unsigned long long seen = max_us.load(std::memory_order_relaxed);
+        while (us > seen && !max_us.compare_exchange_weak(seen, us, std::memory_order_relaxed))
+            ;
+    }
+
+    nlohmann::json toJson() const
+    {
+        static const double percentiles[] = {50, 90, 99, 99.9};
+        static const char *names[] = {"p50", "p90", "p99", "p999"};
+        unsigned long long snapshot[BUCKETS];
+        unsigned long long total = 0;
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            snapshot[i] = counts[i].load();
+            total += snapshot[i];
+        }
+        nlohmann::json res;
+        res["samples"] = total;
+        for (int p = 0; p < 4; p++)
+        {
+            unsigned long long rank = (unsigned long long)(total * percentiles[p] / 100);
+            unsigned long long seen = 0;
+            int bucket = 0;
+            while (bucket + 1 < BUCKETS && seen + snapshot[bucket] <= rank)
+                seen += snapshot[bucket++];
+            res[names[p]] = total > 0 ? (1ULL << bucket) : 0;
+        }
+        res["max"] = max_us.load();
+        return res;
+    }
+};
+
+//
+// Download bytes queued by scheduler summed per user and per priority,
+// so achieved share of every class can be compared with its weight
+//
+struct ShareCounters
+{
+    static const int PRIORITY_LEVELS = 10;
+
+    std::atomic<unsigned long long> priority_bytes[PRIORITY_LEVELS + 1] = {}; // indexed by download priority
+    std::map<std::string, unsigned long long> user_bytes; // guarded by mtx
+    mutable std::mutex mtx;
+
+    void add(const std::string &username, int priority, unsigned long long value)
+    {
+        if (priority >= 0 && priority <= PRIORITY_LEVELS)
+            priority_bytes[priority].fetch_add(value, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mtx);
+        user_bytes[username] += value;
+    }
+
+    // Add "priorities" and "users" objects with bytes and share of every class to res
+    void toJson(nlohmann::json &res) const
+    {
+        unsigned long long total = 0;
+        for (int i = 0; i <= PRIORITY_LEVELS; i++)
+            total += priority_bytes[i].load();
+        for (int i = 0; i <= PRIORITY_LEVELS; i++)
+        {
+            unsigned long long value = priority_bytes[i].load();
+            if (value > 0)
+                res["priorities"][std::to_string(i)] = {{"bytes", value}, {"share", (double)value / total}};
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        unsigned long long users_total = 0;
+        for (auto it = user_bytes.begin(); it != user_bytes.end(); ++it)
+            users_total += it->second;
+        for (auto it = user_bytes.begin(); it != user_bytes.end(); ++it)
+            res["users"][it->first] = {{"bytes", it->second}, {"share", (double)it->second / users_total}};
+    }
+};
+
+//
+// Process-wide counters shared by all workers, reported by STATS request
+// Counters are only summed up, so relaxed increments are enough
+// Every worker schedules only its own connections, so scheduler shares are kept for each worker, where
+// they follow weights, besides the sum over all workers, which doesn't have to when load of workers differs
+//
+struct ServerStats
+{
+    std::atomic<unsigned long long> loop_wakeups{0}; // reactor waits which returned
+    std::atomic<unsigned long long> ring_enters{0}; // io_uring_enter calls, they submit and wait in one
+    LatencyHistogram loop_lag; // time event loops spent handling one wakeup, other connections wait that long
+    std::atomic<unsigned long long> recv_calls{0};
+    std::atomic<unsigned long long> bytes_received{0};
+    std::atomic<unsigned long long> send_calls{0};
+    std::atomic<unsigned long long> bytes_sent{0};
+    ShareCounters shares; // all workers
+    std::unique_ptr<ShareCounters[]> worker_shares; // indexed by worker id
+    int workers = 0;
+    std::string scheduler_policy; // set once before workers start
+
+    static void add(std::atomic<unsigned long long> &counter, unsigned long long value = 1)
+    {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // Must be called before workers start
+    void setWorkers(int count)
+    {
+        workers = count;
+        worker_shares.reset(new ShareCounters[count]);
+    }
+
+    void addShare(int worker, const std::string &username, int priority, unsigned long long value)
+    {
+        if (value == 0)
+            return;
+        shares.add(username, priority, value);
+        if (worker >= 0 && worker < workers)
+            worker_shares[worker].add(username, priority, value);
+    }
+
+    nlohmann::json toJson() const
+    {
+        nlohmann::json res;
+        res["loop_wakeups"] = loop_wakeups.load();
+        res["ring_enters"] = ring_enters.load();
+        res["recv_calls"] = recv_calls.load();
+        res["bytes_received"] = bytes_received.load();
+        res["send_calls"] = send_calls.load();
+        res["bytes_sent"] = bytes_sent.load();
+        res["loop_lag_us"] = loop_lag.toJson();
+
+        nlohmann::json scheduler;
+        scheduler["policy"] = scheduler_policy;
+        scheduler["scope"] = "worker"; // fairness holds among connections of one worker
+        shares.toJson(scheduler);
+        for (int i = 0; i < workers; i++)
+        {
+            nlohmann::json worker = nlohmann::json::object();
+            worker_shares[i].toJson(worker);
+            scheduler["workers"].push_back(worker);
+        }
+        res["scheduler"] = scheduler;
+        return res;
+    }
+};
+
+ServerStats stats;
+
+#endif //STATS_H
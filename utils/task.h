@@ -0,0 +1,40 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+#include <iostream>
+
+//
+// Task is a fire-and-forget coroutine used by request handlers
+// It starts running immediately and its frame is freed when it finishes.
+// A suspended task is owned by whatever it waits on (connection), which resumes it
+// or destroys it when it goes away.
+//
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() {return Task();}
+        std::suspend_never initial_suspend() noexcept {return {};}
+        std::suspend_never final_suspend() noexcept {return {};}
+        void return_void() {}
+        void unhandled_exception()
+        {
+            try
+            {
+                std::rethrow_exception(std::current_exception());
+            }
+            catch (const std::exception &ex)
+            {
+                std::cout << "Unhandled exception in task: " << ex.what() << std::endl;
+            }
+            catch (...)
+            {
+                std::cout << "Unhandled exception in task" << std::endl;
+            }
+        }
+    };
+};
+
+#endif //TASK_H
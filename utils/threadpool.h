@@ -0,0 +1,104 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+
+//
+// ThreadPool runs blocking jobs (filesystem operations) outside of event loops
+// Queue of waiting jobs is bounded, submit() refuses new jobs when it is full
+// Caller which can't go on without its job may leave a notification, it is run on pool thread once a job
+// leaves the full queue, so the caller can submit again instead of doing the work itself.
+//
+class ThreadPool
+{
+  public:
+    using Job = std::function<void()>;
+
+  private:
+    std::vector<std::thread> threads;
+    std::deque<Job> jobs;
+    std::vector<Job> notifications; // run when queue has room again
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t max_queued; // maximum number of jobs waiting for a thread
+    bool stopping;
+
+  public:
+    ThreadPool(int thread_count, size_t max_queued): max_queued(max_queued), stopping(false)
+    {
+        for (int i = 0; i < thread_count; i++)
+            threads.push_back(std::thread(&ThreadPool::loop, this));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (size_t i = 0; i < threads.size(); i++)
+            threads[i].join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Queue job for execution, returns false when queue is full
+    bool submit(Job job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (jobs.size() >= max_queued)
+                return false;
+            jobs.push_back(std::move(job));
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    // Queue job, when queue is full keep notify to be run once there is room for it
+    bool submit(Job job, Job notify)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (jobs.size() >= max_queued)
+            {
+                notifications.push_back(std::move(notify));
+                return false;
+            }
+            jobs.push_back(std::move(job));
+        }
+        cv.notify_one();
+        return true;
+    }
+
+  private:
+    void loop()
+    {
+        while (true)
+        {
+            Job job;
+            std::vector<Job> notify;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (stopping && jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                notify.swap(notifications);
+            }
+            for (size_t i = 0; i < notify.size(); i++)
+                notify[i]();
+            job();
+        }
+    }
+};
+
+#endif //THREADPOOL_H
@@ -0,0 +1,204 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <time.h>
+
+class TimerWheel;
+
+//
+// TimerNode is embedded in the object which owns the timer, so arming and cancelling never allocates
+// Destroying armed node removes it from the wheel
+//
+struct TimerNode
+{
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    TimerWheel *wheel = nullptr; // wheel node is armed in, nullptr when not armed
+    uint64_t expires = 0; // tick in which timer expires
+    int kind = 0; // set by owner to tell its timers apart
+    void *owner = nullptr;
+
+    TimerNode() {}
+    ~TimerNode();
+
+    TimerNode(const TimerNode&) = delete;
+    TimerNode& operator=(const TimerNode&) = delete;
+
+    bool isArmed() const {return wheel != nullptr;}
+
+    void unlink()
+    {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = nullptr;
+        wheel = nullptr;
+    }
+};
+
+//
+// Hierarchical timer wheel: LEVELS wheels of SLOTS slots, each level SLOTS times coarser than previous one
+// Scheduling and cancelling is O(1), advancing costs O(1) per elapsed tick plus expired timers,
+// timers from coarser levels are cascaded down when lower level wraps around.
+// Delays longer than the whole wheel are clamped to its range and owner is expected to re-arm.
+//
+class TimerWheel
+{
+  public:
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int LEVELS = 4;
+
+  private:
+    TimerNode slots[LEVELS][SLOTS]; // sentinels of circular lists
+    unsigned tick_ms;
+    uint64_t current; // last processed tick
+    uint64_t start_ms;
+    int armed; // number of armed timers
+
+  public:
+    TimerWheel(unsigned tick_ms): tick_ms(tick_ms), current(0), armed(0)
+    {
+        start_ms = nowMs();
+        for (int l = 0; l < LEVELS; l++)
+            for (int s = 0; s < SLOTS; s++)
+                slots[l][s].prev = slots[l][s].next = &slots[l][s];
+    }
+
+    ~TimerWheel()
+    {
+        for (int l = 0; l < LEVELS; l++)
+            for (int s = 0; s < SLOTS; s++)
+                while (slots[l][s].next != &slots[l][s])
+                    slots[l][s].next->unlink();
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    static uint64_t nowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    bool empty() const {return armed == 0;}
+
+    // Arm timer to expire after delay_ms, re-arms it when already armed
+    void schedule(TimerNode *node, uint64_t delay_ms)
+    {
+        if (node->isArmed())
+            cancel(node);
+        uint64_t ticks = (delay_ms + tick_ms - 1) / tick_ms;
+        if (ticks == 0)
+            ticks = 1;
+        node->expires = current + ticks;
+        insert(node);
+        armed++;
+    }
+
+    void cancel(TimerNode *node)
+    {
+        if (!node->isArmed())
+            return;
+        node->unlink();
+        armed--;
+    }
+
+    //
+    // Process ticks elapsed until now, on_expire(TimerNode*) is called for each expired timer
+    // Timer is disarmed before callback, so callback may schedule it again
+    //
+    template <typename Callback>
+    void advance(Callback on_expire)
+    {
+        uint64_t target = (nowMs() - start_ms) / tick_ms;
+        while (current < target && armed > 0)
+        {
+            current++;
+            int idx = current & (SLOTS - 1);
+            if (idx == 0)
+                cascade(1);
+
+            TimerNode *head = &slots[0][idx];
+            while (head->next != head)
+            {
+                TimerNode *node = head->next;
+                node->unlink();
+                armed--;
+                on_expire(node);
+            }
+        }
+        if (armed == 0)
+            current = target; // nothing to expire, jump straight to now
+    }
+
+    // Milliseconds until next tick when timers are armed, max_ms otherwise
+    int nextTimeout(int max_ms) const
+    {
+        if (armed == 0)
+            return max_ms;
+        uint64_t next_tick_ms = start_ms + (current + 1) * tick_ms;
+        uint64_t now = nowMs();
+        int timeout = next_tick_ms > now ? (int)(next_tick_ms - now) : 0;
+        return timeout < max_ms ? timeout : max_ms;
+    }
+
+  private:
+    void insert(TimerNode *node)
+    {
+        uint64_t delta = node->expires - current;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))
+            level++;
+        uint64_t max_delta = ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
+        if (delta > max_delta)
+            node->expires = current + max_delta;
+        int idx = (node->expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+        TimerNode *head = &slots[level][idx];
+        node->prev = head->prev;
+        node->next = head;
+        head->prev->next = node;
+        head->prev = node;
+        node->wheel = this;
+    }
+
+    // Move timers from current slot of given level to finer levels
+    void cascade(int level)
+    {
+        if (level >= LEVELS)
+            return;
+        int idx = (current >> (SLOT_BITS * level)) & (SLOTS - 1);
+        if (idx == 0)
+            cascade(level + 1);
+
+        TimerNode *head = &slots[level][idx];
+        TimerNode list; // detach whole slot first, nodes are re-inserted into lower levels
+        list.next = head->next;
+        list.prev = head->prev;
+        if (head->next == head)
+            return;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head->next = head->prev = head;
+
+        while (list.next != &list)
+        {
+            TimerNode *node = list.next;
+            node->unlink();
+            if (node->expires < current)
+                node->expires = current;
+            insert(node);
+        }
+    }
+};
+
+inline TimerNode::~TimerNode()
+{
+    if (wheel != nullptr)
+        wheel->cancel(this);
+}
+
+#endif //TIMERWHEEL_H
@@ -0,0 +1,199 @@
+#ifndef TINYLFUCACHE_H
+#define TINYLFUCACHE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "json.hpp"
+
+//
+// Count-min sketch of 4-bit saturating counters, estimates how often a key was asked for recently
+// All counters are halved every sample_limit increments, so old popularity fades away
+//
+class FrequencySketch
+{
+  private:
+    static const int ROWS = 4;
+    static const uint8_t MAX_COUNT = 15;
+    std::vector<uint8_t> counters; // ROWS rows of width counters
+    size_t width; // power of two
+    unsigned long long samples;
+    unsigned long long sample_limit;
+
+    size_t index(int row, uint64_t hash) const
+    {
+        static const uint64_t seeds[ROWS] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+                                             0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL};
+        uint64_t h = (hash ^ seeds[row]) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+        return row * width + (h & (width - 1));
+    }
+
+  public:
+    FrequencySketch(): width(0), samples(0), sample_limit(0) {}
+
+    // Size sketch for cache of given number of entries
+    void resize(size_t entries)
+    {
+        width = 1024;
+        while (width < entries * 4)
+            width <<= 1;
+        counters.assign(ROWS * width, 0);
+        samples = 0;
+        sample_limit = 10 * (entries > 0 ? entries : 1);
+    }
+
+    void increment(uint64_t hash)
+    {
+        if (width == 0)
+            return;
+        for (int i = 0; i < ROWS; i++)
+        {
+            uint8_t &counter = counters[index(i, hash)];
+            if (counter < MAX_COUNT)
+                counter++;
+        }
+        if (++samples >= sample_limit)
+        {
+            for (size_t i = 0; i < counters.size(); i++)
+                counters[i] >>= 1;
+            samples /= 2;
+        }
+    }
+
+    int estimate(uint64_t hash) const
+    {
+        if (width == 0)
+            return 0;
+        int count = MAX_COUNT;
+        for (int i = 0; i < ROWS; i++)
+        {
+            if (counters[index(i, hash)] < count)
+                count = counters[index(i, hash)];
+        }
+        return count;
+    }
+};
+
+//
+// TinyLfuCache is a memory-bounded cache of immutable shared strings, safe to use from all workers
+// Entries are evicted in LRU order when the cache is full, but a new entry is admitted only when
+// it was asked for more often than the entry it would evict (TinyLFU), so a single pass over cold
+// data doesn't flush hot entries. Hash must map Key to well mixed 64-bit value, sketch uses it too.
+//
+template<class Key, class Hash>
+class TinyLfuCache
+{
+  public:
+    using Value = std::shared_ptr<const std::string>;
+
+  private:
+    struct Entry
+    {
+        Key key;
+        Value value;
+    };
+
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> index;
+    FrequencySketch sketch;
+    size_t capacity; // bytes, 0 disables cache
+    size_t used;
+    std::mutex mtx;
+
+    std::atomic<unsigned long long> hits{0};
+    std::atomic<unsigned long long> misses{0};
+    std::atomic<unsigned long long> evictions{0};
+    std::atomic<unsigned long long> rejections{0}; // entries not admitted, less popular than LRU victim
+
+    // Bytes taken by entry, with rough size of its key and list and index nodes
+    static size_t footprint(const Value &value) {return value->size() + sizeof(Entry) + 64;}
+
+  public:
+    TinyLfuCache(): capacity(0), used(0) {}
+
+    TinyLfuCache(const TinyLfuCache&) = delete;
+    TinyLfuCache& operator=(const TinyLfuCache&) = delete;
+
+    // Set size of cache in bytes and typical size of entry, must be called before workers start
+    void setCapacity(size_t bytes, size_t entry_size)
+    {
+        capacity = bytes;
+        sketch.resize(bytes / entry_size);
+    }
+
+    bool isEnabled() const {return capacity > 0;}
+
+    // Returns cached value and counts the access, nullptr when it isn't cached
+    Value lookup(const Key &key)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        sketch.increment(Hash()(key));
+        auto it = index.find(key);
+        if (it == index.end())
+        {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        hits.fetch_add(1, std::memory_order_relaxed);
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->value;
+    }
+
+    // Cache value unless it is less popular than every entry it would have to evict
+    // Access is counted when value was made without lookup() first
+    void insert(const Key &key, const Value &value, bool count_access = false)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (count_access)
+            sketch.increment(Hash()(key));
+        if (footprint(value) > capacity || index.find(key) != index.end())
+            return;
+        // Walk victims needed to make room first, cache is changed only when value beats all of them
+        int frequency = sketch.estimate(Hash()(key));
+        size_t freed = 0;
+        size_t victims = 0;
+        for (auto it = lru.rbegin(); used - freed + footprint(value) > capacity; ++it, victims++)
+        {
+            if (sketch.estimate(Hash()(it->key)) >= frequency)
+            {
+                rejections.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            freed += footprint(it->value);
+        }
+        for (size_t i = 0; i < victims; i++)
+        {
+            index.erase(lru.back().key);
+            lru.pop_back();
+        }
+        used -= freed;
+        evictions.fetch_add(victims, std::memory_order_relaxed);
+        lru.push_front(Entry{key, value});
+        index[key] = lru.begin();
+        used += footprint(value);
+    }
+
+    nlohmann::json toJson()
+    {
+        nlohmann::json res;
+        res["capacity"] = capacity;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            res["used"] = used;
+            res["entries"] = index.size();
+        }
+        res["hits"] = hits.load();
+        res["misses"] = misses.load();
+        res["evictions"] = evictions.load();
+        res["rejections"] = rejections.load();
+        return res;
+    }
+};
+
+#endif //TINYLFUCACHE_H
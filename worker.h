@@ -0,0 +1,522 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "connection.h"
+#include "connectionpool.h"
+#include "downloadscheduler.h"
+#include "requestparser.h"
+#include "reactor.h"
+#include "completionqueue.h"
+#include "serverconfig.h"
+#include "utils/timerwheel.h"
+#include "utils/ratelimiter.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <vector>
+
+#define WAIT_TIMEOUT 5000 // reactor wait timeout in milliseconds
+#define ACCEPT_BATCH 1024 // maximum number of connections accepted in one wakeup
+#define TIMER_TICK 100 // resolution of connection timeouts in milliseconds
+#define PARSE_BUDGET 64 // maximum number of requests of one connection handled in one wakeup
+#define SCHED_BUDGET 262144 // bytes of download data handed out by scheduler in one loop iteration
+#define SWEEP_INTERVAL 5000 // period of sweeping idle fan-out groups in milliseconds, only while there are some
+#define NOTSENT_LOWAT 16384 // unsent bytes kept in kernel send buffer, the rest waits in our queues where responses can overtake it
+#define LISTENER_TOKEN ConnectionPool::makeHandle(ConnectionPool::MAX_INDEX + 1, 0) // reactor token of listening socket
+#define COMPLETIONS_TOKEN ConnectionPool::makeHandle(ConnectionPool::MAX_INDEX + 2, 0) // reactor token of completion queue
+
+//
+// Worker owns listening socket, reactor and set of connections accepted on that socket
+// Every worker runs its own event loop, so several workers can run in separate threads
+// sharing only RequestParser (and objects behind it) which is safe for concurrent use.
+// Results of blocking jobs which parser runs on the thread pool come back through completions queue.
+//
+class Worker
+{
+  public:
+    using string = std::string;
+
+  private:
+    int id;
+    int sock; // listening socket
+    Reactor *reactor;
+    RequestParser *parser;
+    const ServerConfig &config;
+    ConnectionPool connections; // connections have stable addresses and are referred to by handles
+    std::vector<uint64_t> pending; // connections with complete requests left in the queue after last iteration
+    CompletionQueue completions; // results of blocking jobs submitted for connections of this worker
+    TimerWheel timers; // idle, request assembly and transfer stall timeouts of connections
+    TimerNode sweep_timer; // sweep of fan-out groups shared by workers, armed only while there are groups, owner is nullptr
+    DownloadScheduler scheduler; // decides which download of which connection queues data next
+    uint64_t now; // time in ms taken after last wait
+
+  public:
+    Worker(int id, Reactor *reactor, RequestParser *parser, const ServerConfig &config):
+      id(id), sock(-1), reactor(reactor), parser(parser), config(config), timers(TIMER_TICK),
+      scheduler(connections, (DownloadScheduler::Policy)DownloadScheduler::parsePolicy(config.scheduler))
+    {
+        now = TimerWheel::nowMs();
+    }
+
+    ~Worker()
+    {
+        if (sock != -1)
+            close(sock);
+        delete reactor;
+    }
+
+    Worker(const Worker&) = delete;
+    Worker& operator=(const Worker&) = delete;
+
+    //
+    // Create non-blocking listening socket bound to configured port
+    // With more than one worker every worker gets its own SO_REUSEPORT socket and kernel balances connections between them
+    // Return 0 on success
+    int openListener()
+    {
+        struct sockaddr_in server;
+        socklen_t length;
+        bool reuse_port = config.threads > 1;
+
+        sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock == -1)
+        {
+            perror("opening stream socket");
+            return -1;
+        }
+
+        // zgub denerwuja ̨cy komunikat bł ̨edu "Address already in use"
+        int yes = 1;
+        if (setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(int)) == -1)
+        {
+            perror("setsockopt");
+            return -1;
+        }
+        if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)
+        {
+            perror("setsockopt(SO_REUSEPORT)");
+            return -1;
+        }
+
+        /* dowiaz adres do gniazda */
+
+        server.sin_family = AF_INET;
+        server.sin_addr.s_addr = INADDR_ANY;
+        server.sin_port = htons(config.port);
+        if (bind(sock, (struct sockaddr *)&server, sizeof server) == -1)
+        {
+            perror("binding stream socket");
+            return -1;
+        }
+        /* wydrukuj na konsoli przydzielony port */
+        length = sizeof(server);
+        if (getsockname(sock, (struct sockaddr *)&server, &length) == -1)
+        {
+            perror("getting socket name");
+            return -1;
+        }
+        printf("[worker %d] Socket port #%d, I/O backend: %s\n", id, ntohs(server.sin_port), reactor->getName());
+        /* zacznij przyjmowaæ polaczenia... */
+        if (listen(sock, config.backlog) == -1)
+        {
+            perror("listen");
+            return -1;
+        }
+        if (completions.getFd() == -1 || reactor->add(completions.getFd(), COMPLETIONS_TOKEN) != 0)
+            return -1;
+        if (reactor->completesIo())
+            return reactor->startAccept(sock, LISTENER_TOKEN);
+        return reactor->add(sock, LISTENER_TOKEN);
+    }
+
+    //
+    // Run event loop, never returns
+    //
+    void run()
+    {
+        int nactive;
+        do
+        {
+            // Every worker seeing fan-out groups sweeps them, so the one whose downloads made them drops them
+            // once idle, then wheel of idle server empties and it sleeps until next event
+            if (fanout.hasGroups() && !sweep_timer.isArmed())
+                timers.schedule(&sweep_timer, SWEEP_INTERVAL);
+            // Connections with queued requests or waiting downloads must not wait for the next socket event
+            int timeout = pending.empty() ? timers.nextTimeout(WAIT_TIMEOUT) : 0;
+            if (scheduler.isBusy() && timeout > schedulerTimeout())
+                timeout = schedulerTimeout();
+            nactive = reactor->wait(timeout);
+            ServerStats::add(stats.loop_wakeups);
+            uint64_t busy_start = nowUs();
+            now = TimerWheel::nowMs();
+            timers.advance([this](TimerNode *node) { expireTimer(node); });
+            if (nactive == -1)
+                continue;
+            if (nactive == 0 && pending.empty() && !scheduler.isBusy())
+            {
+                if (timers.empty())
+                    printf("[worker %d] Timeout, restarting wait...\n", id);
+                continue;
+            }
+
+            std::vector<uint64_t> ready; // connections to handle in this iteration: pending ones go first
+            std::vector<uint32_t> ready_events(pending.size(), 0);
+            std::vector<int> ready_index(pending.size(), -1); // index of reactor event, -1 for pending connections
+            ready.swap(pending);
+            for (size_t i = 0; i < ready.size(); i++)
+            {
+                ConnectionPool::HotState *st = connections.state(ready[i]);
+                if (st != nullptr)
+                    st->pending = false;
+            }
+            for (int i = 0; i < nactive; i++)
+            {
+                ready.push_back(reactor->getToken(i));
+                ready_events.push_back(reactor->getEvents(i));
+                ready_index.push_back(i);
+            }
+
+            int accepted = 0;
+            for (size_t i = 0; i < ready.size(); i++)
+            {
+                uint64_t handle = ready[i];
+                if (handle == LISTENER_TOKEN)
+                {
+                    if (!reactor->completesIo())
+                        accepted += acceptConnections();
+                    else if (reactor->getResult(ready_index[i]) >= 0 && setupConnection(reactor->getResult(ready_index[i])))
+                        accepted++;
+                    continue;
+                }
+                if (handle == COMPLETIONS_TOKEN)
+                {
+                    handleCompletions();
+                    continue;
+                }
+
+                Connection *conn = connections.get(handle);
+                if (conn == nullptr)
+                    continue; // connection was closed earlier in this iteration
+
+                handleConnection(*conn, ready_events[i], ready_index[i]);
+                updateConnection(handle);
+            }
+            if (accepted > 0)
+                printf("[worker %d] accepted %d...(active connections = %d)\n", id, accepted, (int)connections.size());
+
+            runScheduler();
+            stats.loop_lag.record(nowUs() - busy_start);
+            //sleep(1);
+
+        } while (true);
+    }
+
+  private:
+    //
+    // Accept all connections waiting in the backlog (up to ACCEPT_BATCH), return number of accepted ones
+    //
+    int acceptConnections()
+    {
+        int accepted = 0;
+        while (accepted < ACCEPT_BATCH)
+        {
+            int msgsock = accept4(sock, (struct sockaddr *)0, (socklen_t *)0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (msgsock == -1)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    perror("accept4");
+                break;
+            }
+            if (setupConnection(msgsock))
+                accepted++;
+        }
+        return accepted;
+    }
+
+    //
+    // Set options of accepted socket and create its connection, return false when socket was closed instead
+    //
+    bool setupConnection(int msgsock)
+    {
+        // set SO_KEEPALIVE opt
+        int optval = 1;
+        if(setsockopt(msgsock, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval)) < 0)
+          perror("setsockopt(SO_KEEPALIVE)");
+        // Socket becomes writable only when kernel holds few unsent bytes, so download data
+        // doesn't pile up in the kernel ahead of responses to later requests
+        // Responses are already coalesced into gather writes, Nagle would only hold small ones back
+        if(setsockopt(msgsock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval)) < 0)
+          perror("setsockopt(TCP_NODELAY)");
+        optval = NOTSENT_LOWAT;
+        if(setsockopt(msgsock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &optval, sizeof(optval)) < 0)
+          perror("setsockopt(TCP_NOTSENT_LOWAT)");
+
+        uint64_t handle = connections.create(msgsock);
+        int rval = reactor->completesIo() ? reactor->attach(msgsock, handle) : reactor->add(msgsock, handle);
+        if (rval == -1)
+        {
+            close(msgsock);
+            connections.release(handle);
+            return false;
+        }
+        Connection &conn = *connections.get(handle);
+        conn.setCompletionQueue(handle, &completions);
+        conn.setReactor(reactor);
+        conn.setWorker(id);
+        conn.setSendWatermarks(config.send_cap * 1024ULL / 4, config.send_cap * 1024ULL);
+        conn.setLastActivity(now);
+        if (config.idle_timeout > 0)
+            timers.schedule(conn.getTimer(Connection::TIMER_IDLE), config.idle_timeout * 1000ULL);
+        return true;
+    }
+
+    //
+    // Deliver results of blocking jobs to connections which are still open
+    //
+    void handleCompletions()
+    {
+        std::vector<Completion> done;
+        completions.drain(done);
+        for (size_t i = 0; i < done.size(); i++)
+        {
+            Connection *conn = connections.get(done[i].conn_id);
+            if (conn == nullptr)
+                continue; // connection was closed while job was running
+            if (done[i].kind == Completion::READ_AHEAD)
+            {
+                // Downloads whose data is in memory now wait for their turn in scheduler again
+                conn->finishReadAhead();
+                updateConnection(done[i].conn_id);
+                continue;
+            }
+            conn->finishJob(done[i].response);
+
+            // Requests queued behind the job can go on right away, their responses are flushed together
+            processRequests(*conn);
+            flushResponses(*conn);
+            updateConnection(done[i].conn_id);
+        }
+    }
+
+    //
+    // Let scheduler hand out download data and send it right away
+    // With rate limit budget is granted from token bucket shared by all workers
+    //
+    void runScheduler()
+    {
+        std::vector<uint64_t> served;
+        long long budget = SCHED_BUDGET;
+        if (rateLimiter.isEnabled())
+        {
+            rateLimiter.refill(now);
+            budget = rateLimiter.acquire(SCHED_BUDGET);
+            if (budget == 0)
+                return;
+        }
+        size_t used = scheduler.run(budget, served);
+        if (rateLimiter.isEnabled())
+            rateLimiter.release(budget - (long long)used); // last package may overshoot, debt is paid from next refills
+        for (size_t i = 0; i < served.size(); i++)
+        {
+            Connection *conn = connections.get(served[i]);
+            if (conn == nullptr)
+                continue;
+            flushResponses(*conn);
+            updateConnection(served[i]);
+        }
+    }
+
+    // Monotonic time in microseconds, loop lag is measured with it
+    static uint64_t nowUs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    // Wait timeout while scheduler has active connections: 0, or time until rate limit allows more data
+    int schedulerTimeout() const
+    {
+        if (!rateLimiter.isEnabled())
+            return 0;
+        return rateLimiter.waitMs();
+    }
+
+    //
+    // Remove closed connection or update its pending state, write interest and scheduling after handling it
+    //
+    void updateConnection(uint64_t handle)
+    {
+        ConnectionPool::HotState *st = connections.state(handle);
+        if (st == nullptr)
+            return;
+        Connection &conn = *connections.get(handle);
+        if (conn.getSocket() == -1)
+        {
+            reactor->forget(st->socket);
+            connections.release(handle);
+            return;
+        }
+        if (conn.canParseRequest() && !st->pending)
+        {
+            st->pending = true;
+            pending.push_back(handle);
+        }
+        if (conn.wantsDownloadTurn())
+            scheduler.activate(handle, conn);
+
+        // Completion-based reactor sends on its own, there is no write interest to arm
+        bool want_write = conn.wantsWrite();
+        if (!reactor->completesIo() && want_write != st->write_armed && reactor->setWriteInterest(st->socket, handle, want_write) == 0)
+            st->write_armed = want_write;
+
+        // Request assembly deadline runs from the first byte of a request until it is complete
+        TimerNode *request_timer = conn.getTimer(Connection::TIMER_REQUEST);
+        if (config.request_timeout > 0 && conn.hasPartialRequest() && !request_timer->isArmed())
+            timers.schedule(request_timer, config.request_timeout * 1000ULL);
+        else if (!conn.hasPartialRequest() && request_timer->isArmed())
+            timers.cancel(request_timer);
+
+        // Stall timer runs while there is something to send
+        TimerNode *stall_timer = conn.getTimer(Connection::TIMER_STALL);
+        if (config.stall_timeout > 0 && want_write && !stall_timer->isArmed())
+        {
+            conn.setLastProgress(now);
+            timers.schedule(stall_timer, config.stall_timeout * 1000ULL);
+        }
+        else if (!want_write && stall_timer->isArmed())
+            timers.cancel(stall_timer);
+    }
+
+    //
+    // Check expired timer of a connection and close it when its deadline has really passed
+    // Idle and stall timers are not re-armed on every activity, they are re-scheduled here instead
+    //
+    void expireTimer(TimerNode *node)
+    {
+        if (node == &sweep_timer)
+        {
+            fanout.sweep(); // re-armed by run() while groups are left
+            return;
+        }
+        Connection *conn = static_cast<Connection*>(node->owner);
+        uint64_t deadline;
+        const char *reason;
+        switch (node->kind)
+        {
+            case Connection::TIMER_IDLE:
+                deadline = conn->getLastActivity() + config.idle_timeout * 1000ULL;
+                reason = "idle timeout";
+                break;
+            case Connection::TIMER_REQUEST:
+                deadline = now;
+                reason = "request not completed in time";
+                break;
+            case Connection::TIMER_STALL:
+                if (!conn->wantsWrite())
+                    return;
+                deadline = conn->getLastProgress() + config.stall_timeout * 1000ULL;
+                reason = "transfer stalled";
+                break;
+            default:
+                return;
+        }
+        if (deadline > now)
+        {
+            timers.schedule(node, deadline - now);
+            return;
+        }
+
+        printf("[worker %d] Closing connection: %s\n", id, reason);
+        conn->closeConnection();
+        updateConnection(conn->getId());
+    }
+
+    //
+    // Handle ready events on given connection: read incoming data, parse queued requests
+    // and send pending responses when socket is writable or new responses were queued
+    // With completion-based reactor event at index tells result of finished send or receive instead
+    void handleConnection(Connection &conn, uint32_t events, int index)
+    {
+        bool completed = reactor->completesIo();
+        if (completed && index >= 0 && (events & EPOLLOUT))
+        {
+            if (conn.finishSend(reactor->getResult(index)) > 0)
+            {
+                conn.setLastActivity(now);
+                conn.setLastProgress(now);
+            }
+            if (conn.getSocket() == -1)
+                return;
+        }
+        if (completed && index >= 0 && (events & EPOLLPRI))
+            conn.finishWrite(reactor->getResult(index)); // upload chunk is written, requests behind it go on
+        if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && (!completed || (index >= 0 && (events & EPOLLIN))))
+        {
+            int queued = conn.requestsQueued();
+            int rval = completed ? conn.receiveData(reactor->getData(index), reactor->getResult(index)) : conn.reciveMsg();
+            if (rval == 0 || (completed && rval < 0) || (rval == -1 && errno != EAGAIN && errno != EINTR))
+            {
+                printf("Ending connection\n");
+                conn.closeConnection();
+                return;
+            }
+            if (rval > 0)
+                conn.setLastActivity(now);
+            if (conn.requestsQueued() > queued) // request completed, deadline of the next one starts over
+                timers.cancel(conn.getTimer(Connection::TIMER_REQUEST));
+        }
+
+        int parsed = processRequests(conn);
+
+        // Responses of all requests parsed above go out in one gather write without waiting for EPOLLOUT
+        if (parsed > 0 || (events & (EPOLLOUT | EPOLLPRI)))
+            flushResponses(conn);
+    }
+
+    //
+    // Parse queued requests until blocking job is started or PARSE_BUDGET is used up
+    // Requests left in the queue are handled in next iteration, so one pipelining client can't starve others
+    // Return number of parsed requests
+    int processRequests(Connection &conn)
+    {
+        int parsed = 0;
+        while (parsed < PARSE_BUDGET && conn.getSocket() != -1 && conn.canParseRequest())
+        {
+            parser->parseRequest(&conn);
+            parsed++;
+        }
+        return parsed;
+    }
+
+    //
+    // Send queued responses right away, completion-based reactor gets the next send when none is in flight
+    // and its completion updates activity and progress of the connection
+    void flushResponses(Connection &conn)
+    {
+        if (reactor->completesIo())
+        {
+            SendQueue::Batch batch;
+            if (conn.prepareSend(batch) && reactor->startSend(conn.getSocket(), conn.getId(), std::move(batch)) != 0)
+            {
+                printf("[worker %d] Closing connection: send could not be started\n", id);
+                conn.cancelSend();
+                conn.closeConnection();
+            }
+            return;
+        }
+        if (conn.getSocket() != -1 && conn.responsesPending() && conn.sendResponse() > 0)
+        {
+            conn.setLastActivity(now);
+            conn.setLastProgress(now);
+        }
+    }
+};
+
+#endif //WORKER_H